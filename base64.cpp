@@ -0,0 +1,486 @@
+/* Copyright (c) 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "base64.hpp"
+#include <string.h>
+
+#include "util/cpu_features.hpp"
+
+#ifdef FOSSILIZE_CPU_X86
+#define FOSSILIZE_BASE64_X86
+#elif defined(FOSSILIZE_CPU_ARM64)
+#define FOSSILIZE_BASE64_NEON
+#include <arm_neon.h>
+#endif
+
+namespace Fossilize
+{
+static const char Alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+struct DecodeTable
+{
+	DecodeTable()
+	{
+		// Characters outside the alphabet, including '=', decode as zero.
+		memset(value, 0, sizeof(value));
+		for (unsigned i = 0; i < 64; i++)
+			value[uint8_t(Alphabet[i])] = uint8_t(i);
+	}
+
+	uint8_t value[256];
+};
+
+static const DecodeTable &get_decode_table()
+{
+	static const DecodeTable table;
+	return table;
+}
+
+size_t compute_base64_encoded_size(size_t size)
+{
+	return 4 * ((size + 2) / 3);
+}
+
+// Encodes the tail which the vectorized paths leave behind, including padding.
+static void encode_base64_scalar(char *out, const uint8_t *data, size_t size)
+{
+	while (size >= 3)
+	{
+		uint32_t code = (uint32_t(data[0]) << 16) | (uint32_t(data[1]) << 8) | uint32_t(data[2]);
+		out[0] = Alphabet[(code >> 18) & 63];
+		out[1] = Alphabet[(code >> 12) & 63];
+		out[2] = Alphabet[(code >> 6) & 63];
+		out[3] = Alphabet[code & 63];
+		data += 3;
+		size -= 3;
+		out += 4;
+	}
+
+	if (size)
+	{
+		uint32_t code = uint32_t(data[0]) << 16;
+		if (size == 2)
+			code |= uint32_t(data[1]) << 8;
+
+		out[0] = Alphabet[(code >> 18) & 63];
+		out[1] = Alphabet[(code >> 12) & 63];
+		out[2] = size == 2 ? Alphabet[(code >> 6) & 63] : '=';
+		out[3] = '=';
+	}
+}
+
+// Decodes one group of four characters. Padding in the last one or two characters
+// shortens the group, but does not stop decoding.
+static size_t decode_base64_group(uint8_t *out, size_t out_size, const char *data)
+{
+	auto &table = get_decode_table().value;
+	uint32_t values =
+			(uint32_t(table[uint8_t(data[0])]) << 18) |
+			(uint32_t(table[uint8_t(data[1])]) << 12) |
+			(uint32_t(table[uint8_t(data[2])]) << 6) |
+			(uint32_t(table[uint8_t(data[3])]) << 0);
+
+	size_t outbytes = 3;
+	if (data[2] == '=' && data[3] == '=')
+		outbytes = 1;
+	else if (data[3] == '=')
+		outbytes = 2;
+
+	if (outbytes > out_size)
+		outbytes = out_size;
+
+	uint8_t bytes[3] = { uint8_t(values >> 16), uint8_t(values >> 8), uint8_t(values) };
+	memcpy(out, bytes, outbytes);
+	return outbytes;
+}
+
+// Vectorized paths consume whole blocks and return how many input bytes or characters they consumed.
+// The decoders stop at the first block which contains anything but alphabet characters,
+// so padding and malformed input always go through decode_base64_group().
+using EncodeBlocksFunc = size_t (*)(char *, const uint8_t *, size_t);
+using DecodeBlocksFunc = size_t (*)(uint8_t *, size_t, const char *, size_t);
+
+static void encode_base64_blocks(EncodeBlocksFunc encode_blocks, char *out, const void *data_, size_t size)
+{
+	auto *data = static_cast<const uint8_t *>(data_);
+	if (encode_blocks)
+	{
+		size_t consumed = encode_blocks(out, data, size);
+		out += 4 * (consumed / 3);
+		data += consumed;
+		size -= consumed;
+	}
+
+	encode_base64_scalar(out, data, size);
+}
+
+static size_t decode_base64_blocks(DecodeBlocksFunc decode_blocks, uint8_t *out, size_t out_size,
+                                   const char *data, size_t length)
+{
+	size_t written = 0;
+	while (written < out_size && length >= 4)
+	{
+		if (decode_blocks)
+		{
+			size_t consumed = decode_blocks(out + written, out_size - written, data, length);
+			written += 3 * (consumed / 4);
+			data += consumed;
+			length -= consumed;
+			if (written >= out_size || length < 4)
+				break;
+		}
+
+		written += decode_base64_group(out + written, out_size - written, data);
+		data += 4;
+		length -= 4;
+	}
+
+	return written;
+}
+
+void encode_base64_portable(char *out, const void *data, size_t size)
+{
+	encode_base64_blocks(nullptr, out, data, size);
+}
+
+size_t decode_base64_portable(uint8_t *out, size_t out_size, const char *data, size_t length)
+{
+	return decode_base64_blocks(nullptr, out, out_size, data, length);
+}
+
+#ifdef FOSSILIZE_BASE64_X86
+// The vectorized codecs follow Wojciech Muła's "Base64 encoding and decoding with SIMD instructions".
+// Encoding reshuffles 12 bytes so that every 32-bit lane holds 3 bytes, splits those into four
+// 6-bit indices with multiplies, and maps the indices to ASCII with a 16-entry offset table.
+FOSSILIZE_TARGET_SSSE3
+static inline __m128i encode_indices_ssse3(__m128i in)
+{
+	in = _mm_shuffle_epi8(in, _mm_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10));
+	__m128i t0 = _mm_mulhi_epu16(_mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00)), _mm_set1_epi32(0x04000040));
+	__m128i t1 = _mm_mullo_epi16(_mm_and_si128(in, _mm_set1_epi32(0x003f03f0)), _mm_set1_epi32(0x01000010));
+	__m128i indices = _mm_or_si128(t0, t1);
+
+	// 0..25 -> 13, 26..51 -> 0, 52..61 -> 1..10, 62 -> 11, 63 -> 12.
+	__m128i lut_index = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+	__m128i is_upper = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);
+	lut_index = _mm_or_si128(lut_index, _mm_and_si128(is_upper, _mm_set1_epi8(13)));
+
+	const __m128i offsets = _mm_setr_epi8(
+			'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+			'0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+	return _mm_add_epi8(indices, _mm_shuffle_epi8(offsets, lut_index));
+}
+
+// Decoding validates characters by looking up the set of valid high nibbles for each low nibble,
+// and then adds a per-range offset. Returns false if any character is outside the alphabet.
+FOSSILIZE_TARGET_SSSE3
+static inline bool decode_values_ssse3(__m128i in, __m128i &values)
+{
+	const __m128i valid_high_nibbles = _mm_setr_epi8(
+			char(0xa8), char(0xf8), char(0xf8), char(0xf8), char(0xf8), char(0xf8), char(0xf8), char(0xf8),
+			char(0xf8), char(0xf8), char(0xf0), char(0x54), char(0x50), char(0x50), char(0x50), char(0x54));
+	const __m128i high_nibble_bit = _mm_setr_epi8(
+			1, 2, 4, 8, 16, 32, 64, char(0x80), 0, 0, 0, 0, 0, 0, 0, 0);
+	const __m128i offsets = _mm_setr_epi8(
+			0, 0, 62 - '+', 52 - '0', -'A', -'A', 26 - 'a', 26 - 'a', 0, 0, 0, 0, 0, 0, 0, 0);
+
+	__m128i high = _mm_and_si128(_mm_srli_epi32(in, 4), _mm_set1_epi8(0x0f));
+	__m128i low = _mm_and_si128(in, _mm_set1_epi8(0x0f));
+
+	__m128i valid = _mm_and_si128(_mm_shuffle_epi8(valid_high_nibbles, low), _mm_shuffle_epi8(high_nibble_bit, high));
+	if (_mm_movemask_epi8(_mm_cmpeq_epi8(valid, _mm_setzero_si128())) != 0)
+		return false;
+
+	// '+' and '/' share a high nibble, so '/' needs its own offset.
+	__m128i is_slash = _mm_cmpeq_epi8(in, _mm_set1_epi8('/'));
+	__m128i offset = _mm_shuffle_epi8(offsets, high);
+	offset = _mm_or_si128(_mm_andnot_si128(is_slash, offset), _mm_and_si128(is_slash, _mm_set1_epi8(63 - '/')));
+	values = _mm_add_epi8(in, offset);
+	return true;
+}
+
+// Packs sixteen 6-bit values into the first 12 bytes.
+FOSSILIZE_TARGET_SSSE3
+static inline __m128i pack_values_ssse3(__m128i values)
+{
+	__m128i pairs = _mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140));
+	__m128i triplets = _mm_madd_epi16(pairs, _mm_set1_epi32(0x00011000));
+	return _mm_shuffle_epi8(triplets, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+}
+
+FOSSILIZE_TARGET_SSSE3
+static size_t encode_blocks_ssse3(char *out, const uint8_t *data, size_t size)
+{
+	size_t consumed = 0;
+	// Each block loads 16 bytes but only consumes 12.
+	while (size - consumed >= 16)
+	{
+		__m128i in = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + consumed));
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(out), encode_indices_ssse3(in));
+		consumed += 12;
+		out += 16;
+	}
+	return consumed;
+}
+
+FOSSILIZE_TARGET_SSSE3
+static size_t decode_blocks_ssse3(uint8_t *out, size_t out_size, const char *data, size_t length)
+{
+	size_t consumed = 0;
+	// Each block stores 16 bytes but only produces 12.
+	while (length - consumed >= 16 && out_size >= 16)
+	{
+		__m128i values;
+		if (!decode_values_ssse3(_mm_loadu_si128(reinterpret_cast<const __m128i *>(data + consumed)), values))
+			break;
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(out), pack_values_ssse3(values));
+		consumed += 16;
+		out += 12;
+		out_size -= 12;
+	}
+	return consumed;
+}
+
+// The AVX2 paths are the SSSE3 algorithm on two independent 128-bit lanes.
+FOSSILIZE_TARGET_AVX2
+static size_t encode_blocks_avx2(char *out, const uint8_t *data, size_t size)
+{
+	const __m256i shuffle = _mm256_setr_epi8(
+			1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10,
+			1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10);
+	const __m256i offsets = _mm256_setr_epi8(
+			'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+			'0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0,
+			'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+			'0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+
+	size_t consumed = 0;
+	// The upper lane loads from 12 bytes in, so each block reads 28 bytes and consumes 24.
+	while (size - consumed >= 28)
+	{
+		__m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + consumed));
+		__m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + consumed + 12));
+		__m256i in = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+
+		in = _mm256_shuffle_epi8(in, shuffle);
+		__m256i t0 = _mm256_mulhi_epu16(_mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00)),
+		                                _mm256_set1_epi32(0x04000040));
+		__m256i t1 = _mm256_mullo_epi16(_mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0)),
+		                                _mm256_set1_epi32(0x01000010));
+		__m256i indices = _mm256_or_si256(t0, t1);
+
+		__m256i lut_index = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+		__m256i is_upper = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices);
+		lut_index = _mm256_or_si256(lut_index, _mm256_and_si256(is_upper, _mm256_set1_epi8(13)));
+		__m256i chars = _mm256_add_epi8(indices, _mm256_shuffle_epi8(offsets, lut_index));
+
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(out), chars);
+		consumed += 24;
+		out += 32;
+	}
+	return consumed;
+}
+
+FOSSILIZE_TARGET_AVX2
+static size_t decode_blocks_avx2(uint8_t *out, size_t out_size, const char *data, size_t length)
+{
+	const __m256i valid_high_nibbles = _mm256_setr_epi8(
+			char(0xa8), char(0xf8), char(0xf8), char(0xf8), char(0xf8), char(0xf8), char(0xf8), char(0xf8),
+			char(0xf8), char(0xf8), char(0xf0), char(0x54), char(0x50), char(0x50), char(0x50), char(0x54),
+			char(0xa8), char(0xf8), char(0xf8), char(0xf8), char(0xf8), char(0xf8), char(0xf8), char(0xf8),
+			char(0xf8), char(0xf8), char(0xf0), char(0x54), char(0x50), char(0x50), char(0x50), char(0x54));
+	const __m256i high_nibble_bit = _mm256_setr_epi8(
+			1, 2, 4, 8, 16, 32, 64, char(0x80), 0, 0, 0, 0, 0, 0, 0, 0,
+			1, 2, 4, 8, 16, 32, 64, char(0x80), 0, 0, 0, 0, 0, 0, 0, 0);
+	const __m256i offsets = _mm256_setr_epi8(
+			0, 0, 62 - '+', 52 - '0', -'A', -'A', 26 - 'a', 26 - 'a', 0, 0, 0, 0, 0, 0, 0, 0,
+			0, 0, 62 - '+', 52 - '0', -'A', -'A', 26 - 'a', 26 - 'a', 0, 0, 0, 0, 0, 0, 0, 0);
+	const __m256i pack_shuffle = _mm256_setr_epi8(
+			2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+			2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+
+	size_t consumed = 0;
+	// Each block stores 32 bytes but only produces 24.
+	while (length - consumed >= 32 && out_size >= 32)
+	{
+		__m256i in = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + consumed));
+		__m256i high = _mm256_and_si256(_mm256_srli_epi32(in, 4), _mm256_set1_epi8(0x0f));
+		__m256i low = _mm256_and_si256(in, _mm256_set1_epi8(0x0f));
+
+		__m256i valid = _mm256_and_si256(_mm256_shuffle_epi8(valid_high_nibbles, low),
+		                                 _mm256_shuffle_epi8(high_nibble_bit, high));
+		if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(valid, _mm256_setzero_si256())) != 0)
+			break;
+
+		__m256i is_slash = _mm256_cmpeq_epi8(in, _mm256_set1_epi8('/'));
+		__m256i offset = _mm256_blendv_epi8(_mm256_shuffle_epi8(offsets, high),
+		                                    _mm256_set1_epi8(63 - '/'), is_slash);
+		__m256i values = _mm256_add_epi8(in, offset);
+
+		__m256i pairs = _mm256_maddubs_epi16(values, _mm256_set1_epi32(0x01400140));
+		__m256i triplets = _mm256_madd_epi16(pairs, _mm256_set1_epi32(0x00011000));
+		__m256i packed = _mm256_shuffle_epi8(triplets, pack_shuffle);
+		// Move the 12 bytes of the upper lane down next to the lower lane.
+		packed = _mm256_permutevar8x32_epi32(packed, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7));
+
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(out), packed);
+		consumed += 32;
+		out += 24;
+		out_size -= 24;
+	}
+	return consumed;
+}
+#endif
+
+#ifdef FOSSILIZE_BASE64_NEON
+struct NEONTables
+{
+	uint8x16x4_t encode;
+	// Two 64-entry halves of a 128-entry decode table. Characters outside the alphabet map to 0xff.
+	uint8x16x4_t decode_lo;
+	uint8x16x4_t decode_hi;
+};
+
+static NEONTables load_neon_tables()
+{
+	uint8_t decode[128];
+	memset(decode, 0xff, sizeof(decode));
+	for (unsigned i = 0; i < 64; i++)
+		decode[uint8_t(Alphabet[i])] = uint8_t(i);
+
+	NEONTables tables;
+	for (unsigned i = 0; i < 4; i++)
+	{
+		tables.encode.val[i] = vld1q_u8(reinterpret_cast<const uint8_t *>(Alphabet) + 16 * i);
+		tables.decode_lo.val[i] = vld1q_u8(decode + 16 * i);
+		tables.decode_hi.val[i] = vld1q_u8(decode + 64 + 16 * i);
+	}
+	return tables;
+}
+
+// vld3/vst4 do the byte interleaving for us, so NEON works on 48 byte / 64 character blocks.
+static size_t encode_blocks_neon(char *out, const uint8_t *data, size_t size)
+{
+	static const NEONTables tables = load_neon_tables();
+	const uint8x16_t mask = vdupq_n_u8(63);
+
+	size_t consumed = 0;
+	while (size - consumed >= 48)
+	{
+		uint8x16x3_t in = vld3q_u8(data + consumed);
+		uint8x16x4_t indices;
+		indices.val[0] = vshrq_n_u8(in.val[0], 2);
+		indices.val[1] = vandq_u8(vorrq_u8(vshlq_n_u8(in.val[0], 4), vshrq_n_u8(in.val[1], 4)), mask);
+		indices.val[2] = vandq_u8(vorrq_u8(vshlq_n_u8(in.val[1], 2), vshrq_n_u8(in.val[2], 6)), mask);
+		indices.val[3] = vandq_u8(in.val[2], mask);
+
+		uint8x16x4_t chars;
+		for (unsigned i = 0; i < 4; i++)
+			chars.val[i] = vqtbl4q_u8(tables.encode, indices.val[i]);
+
+		vst4q_u8(reinterpret_cast<uint8_t *>(out), chars);
+		consumed += 48;
+		out += 64;
+	}
+	return consumed;
+}
+
+static size_t decode_blocks_neon(uint8_t *out, size_t out_size, const char *data, size_t length)
+{
+	static const NEONTables tables = load_neon_tables();
+	const uint8x16_t offset = vdupq_n_u8(64);
+
+	size_t consumed = 0;
+	while (length - consumed >= 64 && out_size >= 48)
+	{
+		uint8x16x4_t in = vld4q_u8(reinterpret_cast<const uint8_t *>(data + consumed));
+		uint8x16x4_t values;
+		uint8x16_t invalid = vdupq_n_u8(0);
+		for (unsigned i = 0; i < 4; i++)
+		{
+			// Out of range indices look up zero, so exactly one of the halves contributes for ASCII input.
+			values.val[i] = vorrq_u8(vqtbl4q_u8(tables.decode_lo, in.val[i]),
+			                         vqtbl4q_u8(tables.decode_hi, vsubq_u8(in.val[i], offset)));
+			// Non-ASCII input looks up zero in both halves, so check the input's top bit as well.
+			invalid = vorrq_u8(invalid, vorrq_u8(values.val[i], in.val[i]));
+		}
+
+		if (vmaxvq_u8(invalid) & 0x80)
+			break;
+
+		uint8x16x3_t bytes;
+		bytes.val[0] = vorrq_u8(vshlq_n_u8(values.val[0], 2), vshrq_n_u8(values.val[1], 4));
+		bytes.val[1] = vorrq_u8(vshlq_n_u8(values.val[1], 4), vshrq_n_u8(values.val[2], 2));
+		bytes.val[2] = vorrq_u8(vshlq_n_u8(values.val[2], 6), values.val[3]);
+		vst3q_u8(out, bytes);
+
+		consumed += 64;
+		out += 48;
+		out_size -= 48;
+	}
+	return consumed;
+}
+#endif
+
+struct Base64Implementation
+{
+	EncodeBlocksFunc encode_blocks;
+	DecodeBlocksFunc decode_blocks;
+	const char *name;
+};
+
+static Base64Implementation select_implementation()
+{
+#ifdef FOSSILIZE_BASE64_X86
+	if (cpu_supports_avx2())
+		return { encode_blocks_avx2, decode_blocks_avx2, "avx2" };
+	if (cpu_supports_ssse3())
+		return { encode_blocks_ssse3, decode_blocks_ssse3, "ssse3" };
+#endif
+#ifdef FOSSILIZE_BASE64_NEON
+	return { encode_blocks_neon, decode_blocks_neon, "neon" };
+#else
+	return { nullptr, nullptr, "scalar" };
+#endif
+}
+
+static const Base64Implementation &get_implementation()
+{
+	static const Base64Implementation impl = select_implementation();
+	return impl;
+}
+
+void encode_base64(char *out, const void *data, size_t size)
+{
+	encode_base64_blocks(get_implementation().encode_blocks, out, data, size);
+}
+
+size_t decode_base64(uint8_t *out, size_t out_size, const char *data, size_t length)
+{
+	return decode_base64_blocks(get_implementation().decode_blocks, out, out_size, data, length);
+}
+
+const char *get_base64_implementation_name()
+{
+	return get_implementation().name;
+}
+}
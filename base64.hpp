@@ -0,0 +1,50 @@
+/* Copyright (c) 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+namespace Fossilize
+{
+// Standard base64 (RFC 4648) with '=' padding, as stored for binary data in JSON state blobs.
+// Dispatches at runtime to AVX2 or SSSE3 on x86 and NEON on AArch64, with a scalar fallback.
+// Every implementation produces exactly the same output as the scalar path.
+
+// Number of characters encode_base64() writes for size bytes of input.
+size_t compute_base64_encoded_size(size_t size);
+
+// Writes compute_base64_encoded_size(size) characters to out. No terminator is written.
+void encode_base64(char *out, const void *data, size_t size);
+
+// Decodes groups of four characters until the input runs out or out_size bytes have been written,
+// and returns the number of bytes written. A trailing partial group is ignored.
+// The vectorized paths store whole registers, so the contents of out past the returned count are unspecified.
+// Characters outside the alphabet decode as zero bits rather than failing, which matches what
+// older versions of Fossilize did, so existing archives replay the same way.
+size_t decode_base64(uint8_t *out, size_t out_size, const char *data, size_t length);
+
+// Scalar fallbacks and the name of the path the codec picked.
+void encode_base64_portable(char *out, const void *data, size_t size);
+size_t decode_base64_portable(uint8_t *out, size_t out_size, const char *data, size_t length);
+const char *get_base64_implementation_name();
+}
@@ -27,17 +27,30 @@
 #include <memory>
 #include <random>
 #include <vector>
+#include <string.h>
+#include <unordered_map>
 #include "fossilize_inttypes.h"
+#include "util/flat_hash_map.hpp"
+#include "lz4_block.hpp"
+#include "crc32.hpp"
+#include "base64.hpp"
+#include "varint.hpp"
+#include "miniz.h"
+
+#ifdef __linux__
+#include <unistd.h>
+#endif
 
 using namespace Fossilize;
 
-static void bench_recorder(const char *path, bool compressed, bool checksum)
+static void bench_recorder(const char *path, bool compressed, bool fast_compression, bool checksum)
 {
 	remove(path);
 	auto iface = std::unique_ptr<DatabaseInterface>(create_database(path, DatabaseMode::OverWrite));
 	StateRecorder recorder;
 	recorder.set_database_enable_checksum(checksum);
 	recorder.set_database_enable_compression(compressed);
+	recorder.set_database_enable_fast_compression(fast_compression);
 	recorder.init_recording_thread(iface.get());
 
 	std::mt19937 rnd(1);
@@ -240,6 +253,17 @@ struct ReplayInterface : StateCreatorInterface
 	}
 };
 
+static const ResourceTag playback_order[] = {
+	RESOURCE_APPLICATION_INFO, // This will create the device, etc.
+	RESOURCE_SHADER_MODULE, // Kick off shader modules first since it can be done in a thread while we deal with trivial objects.
+	RESOURCE_SAMPLER, // Trivial, run in main thread.
+	RESOURCE_DESCRIPTOR_SET_LAYOUT, // Trivial, run in main thread
+	RESOURCE_PIPELINE_LAYOUT, // Trivial, run in main thread
+	RESOURCE_RENDER_PASS, // Trivial, run in main thread
+	RESOURCE_GRAPHICS_PIPELINE, // Multi-threaded
+	RESOURCE_COMPUTE_PIPELINE, // Multi-threaded
+};
+
 static bool dummy_replay_archive(const char *path)
 {
 	auto iface = std::unique_ptr<DatabaseInterface>(create_database(path, DatabaseMode::ReadOnly));
@@ -251,17 +275,6 @@ static bool dummy_replay_archive(const char *path)
 	std::vector<Hash> resource_hashes;
 	std::vector<uint8_t> state_json;
 
-	static const ResourceTag playback_order[] = {
-		RESOURCE_APPLICATION_INFO, // This will create the device, etc.
-		RESOURCE_SHADER_MODULE, // Kick off shader modules first since it can be done in a thread while we deal with trivial objects.
-		RESOURCE_SAMPLER, // Trivial, run in main thread.
-		RESOURCE_DESCRIPTOR_SET_LAYOUT, // Trivial, run in main thread
-		RESOURCE_PIPELINE_LAYOUT, // Trivial, run in main thread
-		RESOURCE_RENDER_PASS, // Trivial, run in main thread
-		RESOURCE_GRAPHICS_PIPELINE, // Multi-threaded
-		RESOURCE_COMPUTE_PIPELINE, // Multi-threaded
-	};
-
 	for (auto &tag : playback_order)
 	{
 		size_t resource_hash_count = 0;
@@ -304,8 +317,470 @@ static bool dummy_replay_archive(const char *path)
 	return true;
 }
 
-int main()
+static size_t get_resident_set_size()
+{
+#ifdef __linux__
+	FILE *file = fopen("/proc/self/statm", "r");
+	if (!file)
+		return 0;
+	unsigned long total = 0, resident = 0;
+	if (fscanf(file, "%lu %lu", &total, &resident) != 2)
+		resident = 0;
+	fclose(file);
+	return size_t(resident) * size_t(sysconf(_SC_PAGESIZE));
+#else
+	return 0;
+#endif
+}
+
+// Mirrors the per-entry metadata a StreamArchive keeps around for every blob.
+struct BenchEntry
+{
+	uint64_t offset;
+	uint32_t header[4];
+};
+
+template <typename Map, typename Insert, typename Find>
+static void bench_hash_index_impl(const char *name, const std::vector<Hash> &hashes,
+                                  const std::vector<Hash> &lookups, const Insert &insert, const Find &find)
+{
+	size_t rss_before = get_resident_set_size();
+	auto begin_time = std::chrono::steady_clock::now();
+
+	std::unique_ptr<Map> map(new Map);
+	for (auto &hash : hashes)
+		insert(*map, hash, BenchEntry{ hash, {} });
+
+	auto end_time = std::chrono::steady_clock::now();
+	size_t rss_after = get_resident_set_size();
+	auto insert_len = std::chrono::duration_cast<std::chrono::nanoseconds>(end_time - begin_time).count();
+
+	begin_time = std::chrono::steady_clock::now();
+	uint64_t checksum = 0;
+	for (auto &hash : lookups)
+		checksum += find(*map, hash);
+	end_time = std::chrono::steady_clock::now();
+	auto find_len = std::chrono::duration_cast<std::chrono::nanoseconds>(end_time - begin_time).count();
+
+	LOGI("[INDEX] %s: insert %.3f ms, find %.1f ns/lookup, RSS +%.1f MiB (checksum %" PRIx64 ")\n",
+	     name, insert_len * 1e-6, double(find_len) / double(lookups.size()),
+	     double(rss_after > rss_before ? rss_after - rss_before : 0) / (1024.0 * 1024.0), checksum);
+}
+
+static void bench_hash_index()
+{
+	// Roughly what a multi-GB archive looks like.
+	std::mt19937_64 rnd(1);
+	std::vector<Hash> hashes(2000000);
+	for (auto &hash : hashes)
+		hash = rnd();
+
+	std::vector<Hash> lookups(4000000);
+	std::uniform_int_distribution<size_t> dist(0, hashes.size() - 1);
+	for (auto &hash : lookups)
+		hash = hashes[dist(rnd)];
+
+	using UnorderedMap = std::unordered_map<Hash, BenchEntry>;
+	bench_hash_index_impl<UnorderedMap>("std::unordered_map", hashes, lookups,
+		[](UnorderedMap &map, Hash hash, const BenchEntry &entry) { map.emplace(hash, entry); },
+		[](const UnorderedMap &map, Hash hash) -> uint64_t {
+			auto itr = map.find(hash);
+			return itr != map.end() ? itr->second.offset : 0;
+		});
+
+	using FlatMap = FlatHashMap<BenchEntry>;
+	bench_hash_index_impl<FlatMap>("FlatHashMap", hashes, lookups,
+		[](FlatMap &map, Hash hash, const BenchEntry &entry) { map.emplace(hash, entry); },
+		[](const FlatMap &map, Hash hash) -> uint64_t {
+			auto *entry = map.find(hash);
+			return entry ? entry->offset : 0;
+		});
+}
+
+// Payload checksums are computed on every write and verified on every read.
+static void bench_crc32()
 {
+	std::mt19937 rnd(1);
+	std::vector<uint8_t> buffer(1024 * 1024);
+	for (auto &b : buffer)
+		b = uint8_t(rnd());
+
+	const struct
+	{
+		const char *name;
+		uint32_t (*func)(uint32_t, const void *, size_t);
+	} impls[] = {
+		{ "miniz", [](uint32_t crc, const void *data, size_t size) {
+			return uint32_t(mz_crc32(crc, static_cast<const uint8_t *>(data), size)); } },
+		{ "slicing-by-8", compute_crc32_portable },
+		{ get_crc32_implementation_name(), compute_crc32 },
+	};
+
+	for (size_t size : { size_t(256), size_t(4 * 1024), size_t(1024 * 1024) })
+	{
+		size_t iterations = (256 * 1024 * 1024) / size;
+		for (auto &impl : impls)
+		{
+			uint32_t crc = 0;
+			auto begin_time = std::chrono::steady_clock::now();
+			for (size_t i = 0; i < iterations; i++)
+				crc ^= impl.func(0, buffer.data(), size);
+			auto end_time = std::chrono::steady_clock::now();
+			auto len = std::chrono::duration_cast<std::chrono::nanoseconds>(end_time - begin_time).count();
+
+			LOGI("[CRC32] %-12s %7zu bytes: %8.1f MiB/s (checksum %08x)\n", impl.name, size,
+			     double(iterations * size) / (1024.0 * 1024.0) / (len * 1e-9), crc);
+		}
+	}
+}
+
+static void bench_base64()
+{
+	std::mt19937 rnd(1);
+	std::vector<uint8_t> buffer(1024 * 1024);
+	for (auto &b : buffer)
+		b = uint8_t(rnd());
+
+	std::vector<char> encoded(compute_base64_encoded_size(buffer.size()));
+	std::vector<uint8_t> decoded(buffer.size());
+
+	const struct
+	{
+		const char *name;
+		void (*encode)(char *, const void *, size_t);
+		size_t (*decode)(uint8_t *, size_t, const char *, size_t);
+	} impls[] = {
+		{ "scalar", encode_base64_portable, decode_base64_portable },
+		{ get_base64_implementation_name(), encode_base64, decode_base64 },
+	};
+
+	// Specialization data is usually tiny, SPIR-V without varint encoding is not.
+	for (size_t size : { size_t(48), size_t(4 * 1024), size_t(1024 * 1024) })
+	{
+		size_t iterations = (256 * 1024 * 1024) / size;
+		size_t encoded_size = compute_base64_encoded_size(size);
+		for (auto &impl : impls)
+		{
+			auto begin_time = std::chrono::steady_clock::now();
+			for (size_t i = 0; i < iterations; i++)
+				impl.encode(encoded.data(), buffer.data(), size);
+			auto end_time = std::chrono::steady_clock::now();
+			auto encode_len = std::chrono::duration_cast<std::chrono::nanoseconds>(end_time - begin_time).count();
+
+			begin_time = std::chrono::steady_clock::now();
+			for (size_t i = 0; i < iterations; i++)
+				impl.decode(decoded.data(), size, encoded.data(), encoded_size);
+			end_time = std::chrono::steady_clock::now();
+			auto decode_len = std::chrono::duration_cast<std::chrono::nanoseconds>(end_time - begin_time).count();
+
+			if (memcmp(decoded.data(), buffer.data(), size) != 0)
+				LOGE("[BASE64] %s failed to round trip %zu bytes.\n", impl.name, size);
+
+			LOGI("[BASE64] %-12s %7zu bytes: encode %8.1f MiB/s, decode %8.1f MiB/s\n", impl.name, size,
+			     double(iterations * size) / (1024.0 * 1024.0) / (encode_len * 1e-9),
+			     double(iterations * size) / (1024.0 * 1024.0) / (decode_len * 1e-9));
+		}
+	}
+}
+
+static void bench_varint()
+{
+	// Roughly the mix of a SPIR-V module: mostly small IDs and literals, instruction headers
+	// with the word count in the upper half, and the odd float constant which needs all 5 bytes.
+	std::mt19937 rnd(1);
+	std::vector<uint32_t> words(256 * 1024);
+	for (auto &w : words)
+	{
+		unsigned kind = rnd() % 16;
+		if (kind < 9)
+			w = uint32_t(rnd()) & 0x7f;
+		else if (kind < 12)
+			w = uint32_t(rnd()) & 0x3fff;
+		else if (kind < 15)
+			w = ((1u + rnd() % 8) << 16) | (uint32_t(rnd()) & 0x1ff);
+		else
+			w = uint32_t(rnd());
+	}
+
+	std::vector<uint8_t> encoded(compute_size_varint(words.data(), words.size()));
+	encode_varint(encoded.data(), words.data(), words.size());
+	std::vector<uint32_t> decoded(words.size());
+
+	const struct
+	{
+		const char *name;
+		bool (*decode)(uint32_t *, size_t, const uint8_t *, size_t);
+	} impls[] = {
+		{ "scalar", decode_varint_portable },
+		{ get_varint_implementation_name(), decode_varint },
+	};
+
+	size_t iterations = 1000;
+	for (auto &impl : impls)
+	{
+		bool ok = true;
+		auto begin_time = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < iterations; i++)
+			ok = impl.decode(decoded.data(), decoded.size(), encoded.data(), encoded.size()) && ok;
+		auto end_time = std::chrono::steady_clock::now();
+		auto len = std::chrono::duration_cast<std::chrono::nanoseconds>(end_time - begin_time).count();
+
+		if (!ok || decoded != words)
+			LOGE("[VARINT] %s failed to decode.\n", impl.name);
+
+		// Throughput is measured in decoded SPIR-V.
+		LOGI("[VARINT] %-12s %7zu bytes: %8.1f MiB/s\n", impl.name, encoded.size(),
+		     double(iterations * words.size() * sizeof(uint32_t)) / (1024.0 * 1024.0) / (len * 1e-9));
+	}
+}
+
+struct CodecStats
+{
+	size_t input_size = 0;
+	size_t compressed_size = 0;
+	double compress_ms = 0.0;
+	double decompress_ms = 0.0;
+};
+
+template <typename Compress, typename Decompress>
+static bool bench_codec(CodecStats &stats, const std::vector<std::vector<uint8_t>> &blobs,
+                        const Compress &compress, const Decompress &decompress)
+{
+	std::vector<std::vector<uint8_t>> compressed(blobs.size());
+
+	auto begin_time = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < blobs.size(); i++)
+		if (!compress(compressed[i], blobs[i]))
+			return false;
+	auto end_time = std::chrono::steady_clock::now();
+	stats.compress_ms += std::chrono::duration_cast<std::chrono::nanoseconds>(end_time - begin_time).count() * 1e-6;
+
+	std::vector<uint8_t> decompressed;
+	begin_time = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < blobs.size(); i++)
+	{
+		decompressed.resize(blobs[i].size());
+		if (!decompress(decompressed, compressed[i]))
+			return false;
+	}
+	end_time = std::chrono::steady_clock::now();
+	stats.decompress_ms += std::chrono::duration_cast<std::chrono::nanoseconds>(end_time - begin_time).count() * 1e-6;
+
+	for (size_t i = 0; i < blobs.size(); i++)
+	{
+		stats.input_size += blobs[i].size();
+		stats.compressed_size += compressed[i].size();
+	}
+
+	return true;
+}
+
+static void log_codec_stats(const char *name, const CodecStats &stats)
+{
+	double mib = double(stats.input_size) / (1024.0 * 1024.0);
+	LOGI("[CODEC]   %-8s ratio %.3f, compress %8.3f ms (%7.1f MiB/s), decompress %8.3f ms (%7.1f MiB/s)\n",
+	     name, stats.input_size ? double(stats.compressed_size) / double(stats.input_size) : 0.0,
+	     stats.compress_ms, stats.compress_ms > 0.0 ? mib / (stats.compress_ms * 1e-3) : 0.0,
+	     stats.decompress_ms, stats.decompress_ms > 0.0 ? mib / (stats.decompress_ms * 1e-3) : 0.0);
+}
+
+// Compares the payload codecs on the entries of an existing archive.
+// SPIR-V (varint encoded) and JSON compress very differently, so they are reported separately.
+static bool bench_codecs(const char *path)
+{
+	auto iface = std::unique_ptr<DatabaseInterface>(create_database(path, DatabaseMode::ReadOnly));
+	if (!iface || !iface->prepare())
+	{
+		LOGE("Failed to open %s.\n", path);
+		return false;
+	}
+
+	std::vector<std::vector<uint8_t>> spirv_blobs;
+	std::vector<std::vector<uint8_t>> json_blobs;
+	std::vector<Hash> hashes;
+
+	for (unsigned i = 0; i < RESOURCE_COUNT; i++)
+	{
+		auto tag = static_cast<ResourceTag>(i);
+		size_t hash_count = 0;
+		if (!iface->get_hash_list_for_resource_tag(tag, &hash_count, nullptr))
+			return false;
+		hashes.resize(hash_count);
+		if (!iface->get_hash_list_for_resource_tag(tag, &hash_count, hashes.data()))
+			return false;
+
+		auto &blobs = tag == RESOURCE_SHADER_MODULE ? spirv_blobs : json_blobs;
+		for (auto &hash : hashes)
+		{
+			size_t blob_size = 0;
+			if (!iface->read_entry(tag, hash, &blob_size, nullptr, PAYLOAD_READ_NO_FLAGS))
+				return false;
+			std::vector<uint8_t> blob(blob_size);
+			if (!iface->read_entry(tag, hash, &blob_size, blob.data(), PAYLOAD_READ_NO_FLAGS))
+				return false;
+			blobs.push_back(std::move(blob));
+		}
+	}
+
+	const auto deflate_compress = [](int level) {
+		return [level](std::vector<uint8_t> &dst, const std::vector<uint8_t> &src) -> bool {
+			mz_ulong zsize = mz_compressBound(src.size());
+			dst.resize(zsize);
+			if (mz_compress2(dst.data(), &zsize, src.data(), src.size(), level) != MZ_OK)
+				return false;
+			dst.resize(zsize);
+			return true;
+		};
+	};
+
+	const auto deflate_decompress = [](std::vector<uint8_t> &dst, const std::vector<uint8_t> &src) -> bool {
+		mz_ulong zsize = dst.size();
+		return mz_uncompress(dst.data(), &zsize, src.data(), src.size()) == MZ_OK && zsize == dst.size();
+	};
+
+	const auto lz4_compress = [](std::vector<uint8_t> &dst, const std::vector<uint8_t> &src) -> bool {
+		dst.resize(compute_max_size_lz4(src.size()));
+		size_t size = encode_lz4(dst.data(), dst.size(), src.data(), src.size());
+		dst.resize(size);
+		return size != 0;
+	};
+
+	const auto lz4_decompress = [](std::vector<uint8_t> &dst, const std::vector<uint8_t> &src) -> bool {
+		return decode_lz4(dst.data(), dst.size(), src.data(), src.size());
+	};
+
+	const struct
+	{
+		const char *name;
+		const std::vector<std::vector<uint8_t>> *blobs;
+	} groups[] = {
+		{ "SPIR-V", &spirv_blobs },
+		{ "JSON", &json_blobs },
+	};
+
+	for (auto &group : groups)
+	{
+		LOGI("[CODEC] %s: %zu blobs.\n", group.name, group.blobs->size());
+		CodecStats deflate_fast, deflate_best, lz4;
+		if (!bench_codec(deflate_fast, *group.blobs, deflate_compress(MZ_BEST_SPEED), deflate_decompress) ||
+		    !bench_codec(deflate_best, *group.blobs, deflate_compress(MZ_BEST_COMPRESSION), deflate_decompress) ||
+		    !bench_codec(lz4, *group.blobs, lz4_compress, lz4_decompress))
+		{
+			LOGE("Codec round-trip failed.\n");
+			return false;
+		}
+
+		log_codec_stats("deflate1", deflate_fast);
+		log_codec_stats("deflate9", deflate_best);
+		log_codec_stats("lz4", lz4);
+	}
+
+	return true;
+}
+
+// Compares replaying the state blobs of an existing archive in the JSON and the binary encoding.
+// Every blob is converted to both forms up front, so only parsing is measured.
+static bool bench_blob_encoding(const char *path)
+{
+	auto iface = std::unique_ptr<DatabaseInterface>(create_database(path, DatabaseMode::ReadOnly));
+	if (!iface || !iface->prepare())
+	{
+		LOGE("Failed to open %s.\n", path);
+		return false;
+	}
+
+	std::vector<std::vector<uint8_t>> json_blobs;
+	std::vector<std::vector<uint8_t>> binary_blobs;
+	std::vector<Hash> hashes;
+	std::vector<uint8_t> blob;
+
+	for (auto tag : playback_order)
+	{
+		size_t hash_count = 0;
+		if (!iface->get_hash_list_for_resource_tag(tag, &hash_count, nullptr))
+			return false;
+		hashes.resize(hash_count);
+		if (!iface->get_hash_list_for_resource_tag(tag, &hash_count, hashes.data()))
+			return false;
+
+		for (auto &hash : hashes)
+		{
+			size_t blob_size = 0;
+			if (!iface->read_entry(tag, hash, &blob_size, nullptr, PAYLOAD_READ_NO_FLAGS))
+				return false;
+			blob.resize(blob_size);
+			if (!iface->read_entry(tag, hash, &blob_size, blob.data(), PAYLOAD_READ_NO_FLAGS))
+				return false;
+
+			std::vector<uint8_t> json, binary;
+			if (!convert_state_blob(blob.data(), blob.size(), false, json) ||
+			    !convert_state_blob(blob.data(), blob.size(), true, binary))
+			{
+				LOGE("Failed to convert blob (tag: %d, hash: 0x%016" PRIx64 ").\n", tag, hash);
+				return false;
+			}
+
+			json_blobs.push_back(std::move(json));
+			binary_blobs.push_back(std::move(binary));
+		}
+	}
+
+	const struct
+	{
+		const char *name;
+		const std::vector<std::vector<uint8_t>> *blobs;
+	} encodings[] = {
+		{ "JSON", &json_blobs },
+		{ "binary", &binary_blobs },
+	};
+
+	// Throughput is measured in JSON, so that both encodings are comparable.
+	size_t json_size = 0;
+	for (auto &b : json_blobs)
+		json_size += b.size();
+
+	const unsigned iterations = 10;
+	for (auto &encoding : encodings)
+	{
+		size_t total_size = 0;
+		for (auto &b : *encoding.blobs)
+			total_size += b.size();
+
+		unsigned failures = 0;
+		auto begin_time = std::chrono::steady_clock::now();
+		for (unsigned i = 0; i < iterations; i++)
+		{
+			StateReplayer state_replayer;
+			ReplayInterface replayer;
+			for (auto &b : *encoding.blobs)
+				if (!state_replayer.parse(replayer, nullptr, b.data(), b.size()))
+					failures++;
+		}
+		auto end_time = std::chrono::steady_clock::now();
+		auto len = std::chrono::duration_cast<std::chrono::nanoseconds>(end_time - begin_time).count();
+
+		if (failures)
+			LOGE("[BLOB] %s: %u blobs failed to parse.\n", encoding.name, failures / iterations);
+
+		LOGI("[BLOB] %-6s %zu blobs, %8.3f MiB: parse %8.3f ms (%7.1f MiB/s)\n", encoding.name,
+		     encoding.blobs->size(), double(total_size) / (1024.0 * 1024.0), len * 1e-6 / iterations,
+		     double(iterations) * double(json_size) / (1024.0 * 1024.0) / (len * 1e-9));
+	}
+
+	return true;
+}
+
+int main(int argc, char **argv)
+{
+	// Benchmark codecs and blob encodings on a real capture.
+	if (argc == 2)
+		return bench_codecs(argv[1]) && bench_blob_encoding(argv[1]) ? EXIT_SUCCESS : EXIT_FAILURE;
+
+	bench_hash_index();
+	bench_crc32();
+	bench_base64();
+	bench_varint();
+
 	for (unsigned i = 0; i < 2; i++)
 	{
 		const char *path_compressed = i ? ".test.compressed.zip" : ".test.compressed.foz";
@@ -316,14 +791,18 @@ int main()
 		else
 			LOGI("=== Testing Fossilize DB ===\n");
 
-		const auto run = [&](bool compressed, bool checksum) {
+		const auto run = [&](bool compressed, bool fast_compression, bool checksum) {
 			const char *path = compressed ? path_compressed : path_uncompressed;
 			auto begin_time = std::chrono::steady_clock::now();
-			bench_recorder(path, compressed, checksum);
+			bench_recorder(path, compressed, fast_compression, checksum);
 			auto end_time = std::chrono::steady_clock::now();
 			auto len = std::chrono::duration_cast<std::chrono::nanoseconds>(end_time - begin_time).count();
 
-			if (compressed && checksum)
+			if (fast_compression && checksum)
+				LOGI("[WRITE] Fast compressed & checksum: %.3f ms\n", len * 1e-6);
+			else if (fast_compression)
+				LOGI("[WRITE] Fast compressed: %.3f ms\n", len * 1e-6);
+			else if (compressed && checksum)
 				LOGI("[WRITE] Compressed & checksum: %.3f ms\n", len * 1e-6);
 			else if (compressed)
 				LOGI("[WRITE] Compressed: %.3f ms\n", len * 1e-6);
@@ -341,10 +820,17 @@ int main()
 			LOGI("[READ]: %.3f ms\n", len * 1e-6);
 		};
 
-		run(false, false);
-		run(false, true);
-		run(true, false);
-		run(true, true);
+		run(false, false, false);
+		run(false, false, true);
+		run(true, false, false);
+		run(true, false, true);
+
+		// The ZIP backend has no LZ4 support.
+		if (!i)
+		{
+			run(true, true, false);
+			run(true, true, true);
+		}
 		LOGI("===================\n\n");
 	}
 }
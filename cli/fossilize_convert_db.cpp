@@ -20,11 +20,16 @@
  * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 
+#include "fossilize.hpp"
 #include "fossilize_db.hpp"
+#include "fossilize_inttypes.h"
 #include <memory>
 #include <vector>
+#include <unordered_set>
 #include "layer/utils.hpp"
 #include "cli_parser.hpp"
+#include "path.hpp"
+#include "lz4_block.hpp"
 #include <cstdlib>
 
 using namespace Fossilize;
@@ -32,16 +37,326 @@ using namespace Fossilize;
 static void print_help()
 {
 	LOGI("Usage: fossilize-convert-db input-db output-db\n"
-		"\t[--output-db-clear (only relevant for DumbDirectoryDatabase)]\n");
+		"\t[--output-db-clear (only relevant for DumbDirectoryDatabase)]\n"
+		"\t[--replay-order (lay out entries in the order fossilize-replay reads them)]\n"
+		"\t[--dictionary (compress SPIR-V and pipelines against dictionaries trained on the input)]\n"
+		"\t[--binary (store state in the compact binary encoding)]\n"
+		"\t[--json (store state as JSON text)]\n");
+}
+
+// The order in which fossilize-replay parses the archive.
+// Descriptor set layouts pull in immutable samplers, and pipelines pull in shader modules.
+static const ResourceTag replay_order[] = {
+	RESOURCE_APPLICATION_INFO,
+	RESOURCE_DESCRIPTOR_SET_LAYOUT,
+	RESOURCE_PIPELINE_LAYOUT,
+	RESOURCE_RENDER_PASS,
+	RESOURCE_GRAPHICS_PIPELINE,
+	RESOURCE_COMPUTE_PIPELINE,
+	RESOURCE_RAYTRACING_PIPELINE,
+};
+
+template <typename T>
+static inline T fake_handle(uint64_t v)
+{
+	return (T)v;
+}
+
+// StateReplayer calls into this in dependency order, i.e. everything an object
+// refers to is enqueued before the object itself, which is exactly the order we want to store entries in.
+struct ReplayOrderCollector : StateCreatorInterface
+{
+	std::vector<std::pair<ResourceTag, Hash>> order;
+	std::unordered_set<Hash> emitted[RESOURCE_COUNT];
+
+	void emit(ResourceTag tag, Hash hash)
+	{
+		if (emitted[tag].insert(hash).second)
+			order.emplace_back(tag, hash);
+	}
+
+	void emit_module(VkShaderModule module)
+	{
+		// Modules can also be provided inline or through identifiers, in which case there is nothing to emit.
+		if (module != VK_NULL_HANDLE)
+			emit(RESOURCE_SHADER_MODULE, (Hash)module);
+	}
+
+	bool enqueue_create_sampler(Hash hash, const VkSamplerCreateInfo *, VkSampler *sampler) override
+	{
+		*sampler = fake_handle<VkSampler>(hash);
+		emit(RESOURCE_SAMPLER, hash);
+		return true;
+	}
+
+	bool enqueue_create_descriptor_set_layout(Hash hash, const VkDescriptorSetLayoutCreateInfo *, VkDescriptorSetLayout *layout) override
+	{
+		*layout = fake_handle<VkDescriptorSetLayout>(hash);
+		emit(RESOURCE_DESCRIPTOR_SET_LAYOUT, hash);
+		return true;
+	}
+
+	bool enqueue_create_pipeline_layout(Hash hash, const VkPipelineLayoutCreateInfo *, VkPipelineLayout *layout) override
+	{
+		*layout = fake_handle<VkPipelineLayout>(hash);
+		emit(RESOURCE_PIPELINE_LAYOUT, hash);
+		return true;
+	}
+
+	bool enqueue_create_shader_module(Hash hash, const VkShaderModuleCreateInfo *, VkShaderModule *module) override
+	{
+		*module = fake_handle<VkShaderModule>(hash);
+		emit(RESOURCE_SHADER_MODULE, hash);
+		return true;
+	}
+
+	bool enqueue_create_render_pass(Hash hash, const VkRenderPassCreateInfo *, VkRenderPass *render_pass) override
+	{
+		*render_pass = fake_handle<VkRenderPass>(hash);
+		emit(RESOURCE_RENDER_PASS, hash);
+		return true;
+	}
+
+	bool enqueue_create_render_pass2(Hash hash, const VkRenderPassCreateInfo2 *, VkRenderPass *render_pass) override
+	{
+		*render_pass = fake_handle<VkRenderPass>(hash);
+		emit(RESOURCE_RENDER_PASS, hash);
+		return true;
+	}
+
+	bool enqueue_create_compute_pipeline(Hash hash, const VkComputePipelineCreateInfo *create_info, VkPipeline *pipeline) override
+	{
+		*pipeline = fake_handle<VkPipeline>(hash);
+		emit_module(create_info->stage.module);
+		emit(RESOURCE_COMPUTE_PIPELINE, hash);
+		return true;
+	}
+
+	bool enqueue_create_graphics_pipeline(Hash hash, const VkGraphicsPipelineCreateInfo *create_info, VkPipeline *pipeline) override
+	{
+		*pipeline = fake_handle<VkPipeline>(hash);
+		for (uint32_t i = 0; i < create_info->stageCount; i++)
+			emit_module(create_info->pStages[i].module);
+		emit(RESOURCE_GRAPHICS_PIPELINE, hash);
+		return true;
+	}
+
+	bool enqueue_create_raytracing_pipeline(Hash hash, const VkRayTracingPipelineCreateInfoKHR *create_info, VkPipeline *pipeline) override
+	{
+		*pipeline = fake_handle<VkPipeline>(hash);
+		for (uint32_t i = 0; i < create_info->stageCount; i++)
+			emit_module(create_info->pStages[i].module);
+		emit(RESOURCE_RAYTRACING_PIPELINE, hash);
+		return true;
+	}
+};
+
+enum class BlobEncoding
+{
+	Keep,
+	JSON,
+	Binary
+};
+
+// Bucket info entries are not written by StateRecorder, so those are copied as-is.
+// Blobs which are not state blobs are copied as-is as well, so that nothing is lost in the conversion.
+static void convert_blob_encoding(ResourceTag tag, Hash hash, BlobEncoding encoding, std::vector<uint8_t> &blob)
+{
+	if (encoding == BlobEncoding::Keep || tag == RESOURCE_BUCKET_INFO)
+		return;
+
+	std::vector<uint8_t> converted;
+	if (convert_state_blob(blob.data(), blob.size(), encoding == BlobEncoding::Binary, converted))
+		blob = std::move(converted);
+	else
+		LOGW("Failed to convert blob (tag: %d, hash: 0x%016" PRIx64 "), copying it unchanged.\n", tag, hash);
+}
+
+static bool get_hash_list(DatabaseInterface &db, ResourceTag tag, std::vector<Hash> &hashes)
+{
+	size_t hash_count = 0;
+	if (!db.get_hash_list_for_resource_tag(tag, &hash_count, nullptr))
+		return false;
+	hashes.resize(hash_count);
+	return db.get_hash_list_for_resource_tag(tag, &hash_count, hashes.data());
+}
+
+static bool build_replay_order(DatabaseInterface &db, std::vector<std::pair<ResourceTag, Hash>> &order)
+{
+	StateReplayer replayer;
+	ReplayOrderCollector collector;
+	replayer.set_resolve_shader_module_handles(false);
+
+	std::vector<Hash> hashes;
+	std::vector<uint8_t> state_json;
+
+	for (auto tag : replay_order)
+	{
+		if (!get_hash_list(db, tag, hashes))
+			return false;
+
+		for (auto hash : hashes)
+		{
+			size_t state_json_size = 0;
+			if (!db.read_entry(tag, hash, &state_json_size, nullptr, PAYLOAD_READ_NO_FLAGS))
+				return false;
+			state_json.resize(state_json_size);
+			if (!db.read_entry(tag, hash, &state_json_size, state_json.data(), PAYLOAD_READ_NO_FLAGS))
+				return false;
+
+			if (!replayer.parse(collector, &db, state_json.data(), state_json.size()))
+				LOGW("Failed to parse blob (tag: %d, hash: 0x%016" PRIx64 "), it will be placed last.\n", tag, hash);
+			else if (tag == RESOURCE_APPLICATION_INFO)
+				collector.emit(tag, hash);
+		}
+	}
+
+	// Anything which replay does not touch goes at the end, e.g. application links and unused modules.
+	for (unsigned i = 0; i < RESOURCE_COUNT; i++)
+	{
+		auto tag = static_cast<ResourceTag>(i);
+		if (!get_hash_list(db, tag, hashes))
+			return false;
+		for (auto hash : hashes)
+			collector.emit(tag, hash);
+	}
+
+	order = std::move(collector.order);
+	return true;
+}
+
+struct SeekStats
+{
+	uint64_t seeks = 0;
+	uint64_t distance = 0;
+};
+
+// Walks the entries in replay order and counts how often the reader has to jump.
+// Short forward skips are assumed to be covered by read-ahead.
+static bool compute_seek_stats(DatabaseInterface &db, const std::vector<std::pair<ResourceTag, Hash>> &order,
+                               SeekStats &stats)
+{
+	constexpr uint64_t ReadAheadWindow = 128 * 1024;
+	uint64_t current_offset = 0;
+
+	for (auto &entry : order)
+	{
+		uint64_t offset = 0, size = 0;
+		if (!db.get_entry_range(entry.first, entry.second, &offset, &size))
+			return false;
+
+		if (offset < current_offset || offset > current_offset + ReadAheadWindow)
+		{
+			stats.seeks++;
+			stats.distance += offset > current_offset ? offset - current_offset : current_offset - offset;
+		}
+
+		current_offset = offset + size;
+	}
+
+	return true;
+}
+
+// Entries of the same kind share most of their structure, so each group gets its own dictionary.
+struct DictionaryGroup
+{
+	const char *name;
+	std::vector<ResourceTag> tags;
+};
+
+static const DictionaryGroup dictionary_groups[] = {
+	{ "SPIR-V", { RESOURCE_SHADER_MODULE } },
+	{ "pipelines", { RESOURCE_GRAPHICS_PIPELINE, RESOURCE_COMPUTE_PIPELINE, RESOURCE_RAYTRACING_PIPELINE } },
+};
+
+// Samples are converted to the output encoding first, since that is what the dictionary will be used for.
+static bool train_dictionary(DatabaseInterface &db, const DictionaryGroup &group, BlobEncoding encoding,
+                             std::vector<uint8_t> &dict)
+{
+	constexpr size_t MaxSampleBytes = 32 * 1024 * 1024;
+	constexpr size_t DictionarySize = 64 * 1024;
+
+	std::vector<std::pair<ResourceTag, Hash>> entries;
+	std::vector<Hash> hashes;
+	size_t total_size = 0;
+	for (auto tag : group.tags)
+	{
+		if (!get_hash_list(db, tag, hashes))
+			return false;
+		for (auto hash : hashes)
+		{
+			size_t blob_size = 0;
+			if (!db.read_entry(tag, hash, &blob_size, nullptr, PAYLOAD_READ_NO_FLAGS))
+				return false;
+			total_size += blob_size;
+			entries.emplace_back(tag, hash);
+		}
+	}
+
+	// Sample evenly across the whole archive if there is too much to train on.
+	size_t stride = (total_size + MaxSampleBytes - 1) / MaxSampleBytes;
+	if (stride == 0)
+		stride = 1;
+
+	std::vector<std::vector<uint8_t>> samples;
+	for (size_t i = 0; i < entries.size(); i += stride)
+	{
+		size_t blob_size = 0;
+		if (!db.read_entry(entries[i].first, entries[i].second, &blob_size, nullptr, PAYLOAD_READ_NO_FLAGS))
+			return false;
+		std::vector<uint8_t> blob(blob_size);
+		if (!db.read_entry(entries[i].first, entries[i].second, &blob_size, blob.data(), PAYLOAD_READ_NO_FLAGS))
+			return false;
+		convert_blob_encoding(entries[i].first, entries[i].second, encoding, blob);
+		samples.push_back(std::move(blob));
+	}
+
+	std::vector<const uint8_t *> sample_data;
+	std::vector<size_t> sample_sizes;
+	size_t sample_bytes = 0;
+	for (auto &sample : samples)
+	{
+		sample_data.push_back(sample.data());
+		sample_sizes.push_back(sample.size());
+		sample_bytes += sample.size();
+	}
+
+	dict.resize(DictionarySize);
+	dict.resize(train_dictionary_lz4(dict.data(), dict.size(), sample_data.data(), sample_sizes.data(), samples.size()));
+	LOGI("Trained %zu byte dictionary for %s from %zu samples (%.1f MiB).\n",
+	     dict.size(), group.name, samples.size(), double(sample_bytes) / (1024.0 * 1024.0));
+	return true;
+}
+
+// Sums up the payloads as they are stored, i.e. after compression.
+static bool compute_stored_size(DatabaseInterface &db, const std::vector<std::pair<ResourceTag, Hash>> &order,
+                                uint64_t &size)
+{
+	size = 0;
+	for (auto &entry : order)
+	{
+		size_t blob_size = 0;
+		if (!db.read_entry(entry.first, entry.second, &blob_size, nullptr, PAYLOAD_READ_RAW_FOSSILIZE_DB_BIT))
+			return false;
+		size += blob_size;
+	}
+	return true;
 }
 
 int main(int argc, char *argv[])
 {
 	bool overwrite_db_clear = false;
+	bool use_replay_order = false;
+	bool use_dictionary = false;
+	BlobEncoding encoding = BlobEncoding::Keep;
 	if (argc > 3)
 	{
 		CLICallbacks cbs;
 		cbs.add("--output-db-clear", [&](CLIParser&) { overwrite_db_clear = true; });
+		cbs.add("--replay-order", [&](CLIParser&) { use_replay_order = true; });
+		cbs.add("--dictionary", [&](CLIParser&) { use_dictionary = true; });
+		cbs.add("--binary", [&](CLIParser&) { encoding = BlobEncoding::Binary; });
+		cbs.add("--json", [&](CLIParser&) { encoding = BlobEncoding::JSON; });
 		cbs.error_handler = [] { print_help(); };
 
 		CLIParser parser(std::move(cbs), argc - 3, argv + 3);
@@ -72,33 +387,118 @@ int main(int argc, char *argv[])
 		return EXIT_FAILURE;
 	}
 
-	for (unsigned i = 0; i < RESOURCE_COUNT; i++)
+	std::vector<std::pair<ResourceTag, Hash>> order;
+	if (use_replay_order)
 	{
-		auto tag = static_cast<ResourceTag>(i);
-
-		size_t hash_count = 0;
-		if (!input_db->get_hash_list_for_resource_tag(tag, &hash_count, nullptr))
-			return EXIT_FAILURE;
-		std::vector<Hash> hashes(hash_count);
-		if (!input_db->get_hash_list_for_resource_tag(tag, &hash_count, hashes.data()))
+		if (!build_replay_order(*input_db, order))
+		{
+			LOGE("Failed to determine replay order for database: %s\n", argv[1]);
 			return EXIT_FAILURE;
-
-		for (auto &hash : hashes)
+		}
+	}
+	else
+	{
+		std::vector<Hash> hashes;
+		for (unsigned i = 0; i < RESOURCE_COUNT; i++)
 		{
-			size_t blob_size = 0;
-			if (!input_db->read_entry(tag, hash, &blob_size, nullptr, PAYLOAD_READ_NO_FLAGS))
-				return EXIT_FAILURE;
-			std::vector<uint8_t> blob(blob_size);
-			if (!input_db->read_entry(tag, hash, &blob_size, blob.data(), PAYLOAD_READ_NO_FLAGS))
+			auto tag = static_cast<ResourceTag>(i);
+			if (!get_hash_list(*input_db, tag, hashes))
 				return EXIT_FAILURE;
+			for (auto hash : hashes)
+				order.emplace_back(tag, hash);
+		}
+	}
 
-			if (!output_db->write_entry(tag, hash, blob.data(), blob.size(),
-					PAYLOAD_WRITE_COMPUTE_CHECKSUM_BIT |
-					PAYLOAD_WRITE_COMPRESS_BIT |
-					PAYLOAD_WRITE_BEST_COMPRESSION_BIT))
+	bool use_dictionary_for_tag[RESOURCE_COUNT] = {};
+	if (use_dictionary)
+	{
+		for (auto &group : dictionary_groups)
+		{
+			std::vector<uint8_t> dict;
+			if (!train_dictionary(*input_db, group, encoding, dict))
 			{
+				LOGE("Failed to train dictionary for %s.\n", group.name);
 				return EXIT_FAILURE;
 			}
+
+			if (dict.empty())
+				continue;
+
+			for (auto tag : group.tags)
+			{
+				if (!output_db->set_compression_dictionary(tag, dict.data(), dict.size()))
+				{
+					LOGE("Compression dictionaries are only supported for stream archives.\n");
+					return EXIT_FAILURE;
+				}
+				use_dictionary_for_tag[tag] = true;
+			}
+		}
+	}
+
+	std::vector<uint8_t> blob;
+	for (auto &entry : order)
+	{
+		size_t blob_size = 0;
+		if (!input_db->read_entry(entry.first, entry.second, &blob_size, nullptr, PAYLOAD_READ_NO_FLAGS))
+			return EXIT_FAILURE;
+		blob.resize(blob_size);
+		if (!input_db->read_entry(entry.first, entry.second, &blob_size, blob.data(), PAYLOAD_READ_NO_FLAGS))
+			return EXIT_FAILURE;
+		convert_blob_encoding(entry.first, entry.second, encoding, blob);
+
+		PayloadWriteFlags flags = PAYLOAD_WRITE_COMPUTE_CHECKSUM_BIT |
+		                          PAYLOAD_WRITE_COMPRESS_BIT |
+		                          PAYLOAD_WRITE_BEST_COMPRESSION_BIT;
+		if (use_dictionary_for_tag[entry.first])
+			flags |= PAYLOAD_WRITE_DICTIONARY_BIT;
+
+		if (!output_db->write_entry(entry.first, entry.second, blob.data(), blob.size(), flags))
+		{
+			return EXIT_FAILURE;
+		}
+	}
+
+	// Stream archives get an index so that readers can avoid scanning the entire archive.
+	if (Path::ext(argv[2]) == "foz" && !output_db->write_index())
+	{
+		LOGE("Failed to write index for database: %s\n", argv[2]);
+		return EXIT_FAILURE;
+	}
+
+	// Reopen the output so that we see the archive exactly like the replayer will.
+	bool output_reopened = false;
+	if (use_replay_order || use_dictionary)
+	{
+		output_db.reset(create_database(argv[2], DatabaseMode::ReadOnly));
+		output_reopened = output_db && output_db->prepare();
+	}
+
+	if (use_dictionary)
+	{
+		uint64_t input_size, output_size;
+		if (output_reopened &&
+		    compute_stored_size(*input_db, order, input_size) &&
+		    compute_stored_size(*output_db, order, output_size))
+		{
+			LOGI("Stored payloads: %.1f MiB -> %.1f MiB.\n",
+			     double(input_size) / (1024.0 * 1024.0), double(output_size) / (1024.0 * 1024.0));
+		}
+	}
+
+	if (use_replay_order)
+	{
+		SeekStats input_stats, output_stats;
+		if (output_reopened &&
+		    compute_seek_stats(*input_db, order, input_stats) &&
+		    compute_seek_stats(*output_db, order, output_stats))
+		{
+			LOGI("Seeks during replay: %" PRIu64 " -> %" PRIu64 ", seek distance: %.1f MiB -> %.1f MiB.\n",
+			     input_stats.seeks, output_stats.seeks,
+			     double(input_stats.distance) / (1024.0 * 1024.0),
+			     double(output_stats.distance) / (1024.0 * 1024.0));
 		}
+		else
+			LOGW("Archive layout can only be analyzed for stream archives.\n");
 	}
 }
@@ -77,7 +77,8 @@ static void print_help()
 	}
 
 	help_msg += "\t[--size]\n"
-	            "\t[--connectivity]\n";
+	            "\t[--connectivity]\n"
+	            "\t[--stats]\n";
 
 	LOGI("%s", help_msg.c_str());
 }
@@ -298,6 +299,52 @@ void print_connectivity(Hash hash, const ListReplayer &list_replayer)
 	printf("\n");
 }
 
+static void print_tag_statistics(const char *name, const DatabaseTagStatistics &stats)
+{
+	printf("%-20s %10" PRIu64 " entries (%" PRIu64 " compressed), %14" PRIu64 " stored bytes, %14" PRIu64 " uncompressed bytes",
+	       name, stats.entry_count, stats.compressed_entry_count, stats.stored_bytes, stats.uncompressed_bytes);
+	if (stats.stored_bytes)
+		printf(", ratio %.3f", double(stats.uncompressed_bytes) / double(stats.stored_bytes));
+	printf("\n");
+}
+
+static void print_statistics(const DatabaseStatistics &stats)
+{
+	DatabaseTagStatistics total = {};
+	for (unsigned tag = 0; tag < RESOURCE_COUNT; tag++)
+	{
+		auto &tag_stats = stats.tags[tag];
+		print_tag_statistics(tag_names[tag], tag_stats);
+
+		total.entry_count += tag_stats.entry_count;
+		total.compressed_entry_count += tag_stats.compressed_entry_count;
+		total.stored_bytes += tag_stats.stored_bytes;
+		total.uncompressed_bytes += tag_stats.uncompressed_bytes;
+	}
+
+	print_tag_statistics("total", total);
+	if (stats.dictionary_count)
+		printf("%" PRIu64 " compression dictionaries, %" PRIu64 " bytes\n", stats.dictionary_count, stats.dictionary_bytes);
+
+	printf("\nUncompressed entry sizes:\n");
+	for (unsigned tag = 0; tag < RESOURCE_COUNT; tag++)
+	{
+		auto &tag_stats = stats.tags[tag];
+		if (!tag_stats.entry_count)
+			continue;
+
+		printf("%s:\n", tag_names[tag]);
+		for (unsigned i = 0; i < DatabaseStatisticsHistogramBuckets; i++)
+		{
+			if (tag_stats.size_histogram[i])
+			{
+				printf("\t[%10" PRIu64 ", %10" PRIu64 ") bytes: %" PRIu64 "\n",
+				       i ? (uint64_t(1) << i) : uint64_t(0), uint64_t(1) << (i + 1), tag_stats.size_histogram[i]);
+			}
+		}
+	}
+}
+
 int main(int argc, char **argv)
 {
 	CLICallbacks cbs;
@@ -305,11 +352,13 @@ int main(int argc, char **argv)
 	unsigned tag_uint = 0;
 	bool log_size = false;
 	bool log_connectivity = false;
+	bool log_stats = false;
 	cbs.default_handler = [&](const char *path) { db_path = path; };
 	cbs.add("--help", [&](CLIParser &parser) { print_help(); parser.end(); });
 	cbs.add("--tag", [&](CLIParser &parser) { tag_uint = parser.next_uint(); });
 	cbs.add("--size", [&](CLIParser &) { log_size = true; });
 	cbs.add("--connectivity", [&](CLIParser&) { log_connectivity = true; });
+	cbs.add("--stats", [&](CLIParser &) { log_stats = true; });
 	cbs.error_handler = [] { print_help(); };
 	CLIParser parser(std::move(cbs), argc - 1, argv + 1);
 
@@ -331,6 +380,20 @@ int main(int argc, char **argv)
 		return EXIT_FAILURE;
 	}
 
+	// Statistics only look at entry headers, so there is no need to go through the entries one by one.
+	if (log_stats)
+	{
+		DatabaseStatistics stats;
+		if (!input_db->get_statistics(&stats))
+		{
+			LOGE("Database does not support statistics.\n");
+			return EXIT_FAILURE;
+		}
+
+		print_statistics(stats);
+		return EXIT_SUCCESS;
+	}
+
 	if (tag_uint >= RESOURCE_COUNT)
 	{
 		LOGE("--tag (%u) is out of range.\n", tag_uint);
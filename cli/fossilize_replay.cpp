@@ -989,7 +989,8 @@ struct ThreadedReplayer : StateCreatorInterface
 			return false;
 		}
 
-		buffer.resize(json_size);
+		// Room for a terminator, so that the JSON can be parsed in place.
+		buffer.resize(json_size + 1);
 
 		if (!global_database->read_entry(work_item.tag, work_item.hash, &json_size, buffer.data(), PAYLOAD_READ_CONCURRENT_BIT))
 		{
@@ -997,6 +998,7 @@ struct ThreadedReplayer : StateCreatorInterface
 			     unsigned(work_item.tag), work_item.hash);
 			return false;
 		}
+		buffer[json_size] = '\0';
 
 		auto &per_thread = get_per_thread_data();
 		per_thread.current_parse_index = work_item.index;
@@ -1011,7 +1013,7 @@ struct ThreadedReplayer : StateCreatorInterface
 		// It's also possible that nothing happened while parsing. That should count as a fail as well.
 		per_thread.acknowledge_parsing_work = false;
 
-		if (!replayer.parse(*this, global_database, buffer.data(), buffer.size()) ||
+		if (!replayer.parse_in_place(*this, global_database, buffer.data(), buffer.size()) ||
 		    !per_thread.acknowledge_parsing_work)
 		{
 			LOGW("Did not replay blob (tag: %d, hash: 0x%016" PRIx64 "). See previous logs for context.\n",
@@ -4255,6 +4257,9 @@ static int run_normal_process(ThreadedReplayer &replayer, const vector<const cha
 			return EXIT_FAILURE;
 		}
 
+		// Start pulling in the archive while we parse, this is significant for cold caches.
+		resolver->prefetch(tag, resource_hashes.data(), resource_hashes.size());
+
 		auto &per_thread_data = replayer.get_per_thread_data();
 		per_thread_data.expected_tag = tag;
 
@@ -4396,6 +4401,9 @@ static int run_normal_process(ThreadedReplayer &replayer, const vector<const cha
 			std::move(begin(*hashes) + start_index, begin(*hashes) + end_index, begin(*hashes));
 			hashes->erase(begin(*hashes) + (end_index - start_index), end(*hashes));
 
+			// Worker threads will read the pipelines in this order, so have the I/O in flight before they start.
+			resolver->prefetch(tag, hashes->data(), hashes->size());
+
 			if (replayer.replayer_cache_db)
 				populate_blob_hash_set(replayer.cached_blobs[tag], tag, *replayer.replayer_cache_db);
 
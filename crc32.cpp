@@ -0,0 +1,256 @@
+/* Copyright (c) 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "crc32.hpp"
+
+#include "util/cpu_features.hpp"
+
+#ifdef FOSSILIZE_CPU_X86
+#define FOSSILIZE_CRC32_X86
+#elif defined(FOSSILIZE_CPU_ARM64) && (defined(__GNUC__) || defined(__clang__))
+#define FOSSILIZE_CRC32_ARM
+#include <arm_acle.h>
+#endif
+
+namespace Fossilize
+{
+// Reflected form of the zlib polynomial 0x04c11db7.
+static constexpr uint32_t Polynomial = 0xedb88320u;
+
+struct SlicingTables
+{
+	SlicingTables()
+	{
+		for (uint32_t i = 0; i < 256; i++)
+		{
+			uint32_t crc = i;
+			for (unsigned bit = 0; bit < 8; bit++)
+				crc = (crc >> 1) ^ (Polynomial & (0u - (crc & 1u)));
+			table[0][i] = crc;
+		}
+
+		// table[k] advances a byte through k more zero bytes.
+		for (unsigned k = 1; k < 8; k++)
+			for (uint32_t i = 0; i < 256; i++)
+				table[k][i] = (table[k - 1][i] >> 8) ^ table[0][table[k - 1][i] & 0xff];
+	}
+
+	uint32_t table[8][256];
+};
+
+static const SlicingTables &get_slicing_tables()
+{
+	static const SlicingTables tables;
+	return tables;
+}
+
+static inline uint32_t read32_le(const uint8_t *ptr)
+{
+	return uint32_t(ptr[0]) | (uint32_t(ptr[1]) << 8) | (uint32_t(ptr[2]) << 16) | (uint32_t(ptr[3]) << 24);
+}
+
+// Works on the inverted CRC, like the hardware paths.
+static uint32_t crc32_slicing_by_8(uint32_t crc, const uint8_t *ptr, size_t size)
+{
+	auto &t = get_slicing_tables().table;
+
+	while (size >= 8)
+	{
+		uint32_t lo = read32_le(ptr) ^ crc;
+		uint32_t hi = read32_le(ptr + 4);
+		crc = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^ t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24] ^
+		      t[3][hi & 0xff] ^ t[2][(hi >> 8) & 0xff] ^ t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24];
+		ptr += 8;
+		size -= 8;
+	}
+
+	while (size--)
+		crc = t[0][(crc ^ *ptr++) & 0xff] ^ (crc >> 8);
+
+	return crc;
+}
+
+uint32_t compute_crc32_portable(uint32_t crc, const void *data, size_t size)
+{
+	return ~crc32_slicing_by_8(~crc, static_cast<const uint8_t *>(data), size);
+}
+
+#ifdef FOSSILIZE_CRC32_X86
+// Advances acc by 128 bits and adds in the next block.
+FOSSILIZE_TARGET_PCLMUL
+static inline __m128i fold_pclmul(__m128i acc, __m128i next, __m128i k)
+{
+	__m128i lo = _mm_clmulepi64_si128(acc, k, 0x00);
+	__m128i hi = _mm_clmulepi64_si128(acc, k, 0x11);
+	return _mm_xor_si128(_mm_xor_si128(hi, lo), next);
+}
+
+// Folds four 128-bit lanes at a time with carry-less multiplies, then Barrett-reduces to 32 bits.
+// This is the algorithm from Intel's "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ Instruction",
+// with the constants for the bit-reflected zlib polynomial. size must be a multiple of 16, and at least 64.
+FOSSILIZE_TARGET_PCLMUL
+static uint32_t crc32_pclmul_folded(uint32_t crc, const uint8_t *ptr, size_t size)
+{
+	const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596ll, 0x0154442bd4ll);
+	const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009ell, 0x01751997d0ll);
+	const __m128i k5k0 = _mm_set_epi64x(0, 0x0163cd6124ll);
+	const __m128i poly = _mm_set_epi64x(0x01f7011641ll, 0x01db710641ll);
+	const __m128i mask32 = _mm_setr_epi32(-1, 0, -1, 0);
+
+	__m128i x1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(ptr + 0x00));
+	__m128i x2 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(ptr + 0x10));
+	__m128i x3 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(ptr + 0x20));
+	__m128i x4 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(ptr + 0x30));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(int(crc)));
+	ptr += 64;
+	size -= 64;
+
+	while (size >= 64)
+	{
+		__m128i x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+		__m128i x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+		__m128i x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+		__m128i x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+
+		x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128(reinterpret_cast<const __m128i *>(ptr + 0x00)));
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128(reinterpret_cast<const __m128i *>(ptr + 0x10)));
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128(reinterpret_cast<const __m128i *>(ptr + 0x20)));
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128(reinterpret_cast<const __m128i *>(ptr + 0x30)));
+
+		ptr += 64;
+		size -= 64;
+	}
+
+	// Fold the four lanes into one.
+	x1 = fold_pclmul(x1, x2, k3k4);
+	x1 = fold_pclmul(x1, x3, k3k4);
+	x1 = fold_pclmul(x1, x4, k3k4);
+
+	while (size >= 16)
+	{
+		x1 = fold_pclmul(x1, _mm_loadu_si128(reinterpret_cast<const __m128i *>(ptr)), k3k4);
+		ptr += 16;
+		size -= 16;
+	}
+
+	// Fold 128 bits down to 64.
+	x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+	x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, mask32);
+	x1 = _mm_clmulepi64_si128(x1, k5k0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	// Barrett reduction to 32 bits.
+	x2 = _mm_and_si128(x1, mask32);
+	x2 = _mm_clmulepi64_si128(x2, poly, 0x10);
+	x2 = _mm_and_si128(x2, mask32);
+	x2 = _mm_clmulepi64_si128(x2, poly, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	return uint32_t(_mm_cvtsi128_si32(_mm_srli_si128(x1, 4)));
+}
+
+static uint32_t crc32_pclmul(uint32_t crc, const uint8_t *ptr, size_t size)
+{
+	// Below this, setting up the folding costs more than it saves.
+	if (size >= 64)
+	{
+		size_t folded_size = size & ~size_t(15);
+		crc = crc32_pclmul_folded(crc, ptr, folded_size);
+		ptr += folded_size;
+		size -= folded_size;
+	}
+
+	return crc32_slicing_by_8(crc, ptr, size);
+}
+#endif
+
+#ifdef FOSSILIZE_CRC32_ARM
+FOSSILIZE_TARGET_CRC
+static uint32_t crc32_arm(uint32_t crc, const uint8_t *ptr, size_t size)
+{
+	while (size && (reinterpret_cast<uintptr_t>(ptr) & 7))
+	{
+		crc = __crc32b(crc, *ptr++);
+		size--;
+	}
+
+	while (size >= 8)
+	{
+		uint64_t v;
+		__builtin_memcpy(&v, ptr, sizeof(v));
+		crc = __crc32d(crc, v);
+		ptr += 8;
+		size -= 8;
+	}
+
+	while (size--)
+		crc = __crc32b(crc, *ptr++);
+
+	return crc;
+}
+#endif
+
+using CRC32Func = uint32_t (*)(uint32_t, const uint8_t *, size_t);
+
+struct CRC32Implementation
+{
+	CRC32Func func;
+	const char *name;
+};
+
+static CRC32Implementation select_implementation()
+{
+#ifdef FOSSILIZE_CRC32_X86
+	if (cpu_supports_pclmul())
+		return { crc32_pclmul, "pclmul" };
+#endif
+#ifdef FOSSILIZE_CRC32_ARM
+	if (cpu_supports_arm_crc32())
+		return { crc32_arm, "armv8-crc" };
+#endif
+	return { crc32_slicing_by_8, "slicing-by-8" };
+}
+
+static const CRC32Implementation &get_implementation()
+{
+	static const CRC32Implementation impl = select_implementation();
+	return impl;
+}
+
+uint32_t compute_crc32(uint32_t crc, const void *data, size_t size)
+{
+	return ~get_implementation().func(~crc, static_cast<const uint8_t *>(data), size);
+}
+
+const char *get_crc32_implementation_name()
+{
+	return get_implementation().name;
+}
+}
@@ -0,0 +1,39 @@
+/* Copyright (c) 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+namespace Fossilize
+{
+// CRC32 with the zlib polynomial, i.e. the same value as crc32() in zlib and mz_crc32() in miniz.
+// Archives store checksums in this form, so every implementation must be bit-exact with zlib.
+// Pass 0 as crc to start a new checksum, or a previous result to continue it.
+// Dispatches at runtime to PCLMULQDQ folding on x86, the CRC32 instructions on ARMv8,
+// and slicing-by-8 otherwise.
+uint32_t compute_crc32(uint32_t crc, const void *data, size_t size);
+
+// Slicing-by-8 fallback and the name of the path compute_crc32() picked.
+uint32_t compute_crc32_portable(uint32_t crc, const void *data, size_t size);
+const char *get_crc32_implementation_name();
+}
@@ -33,6 +33,7 @@
 #include <string.h>
 #include <stdarg.h>
 #include "varint.hpp"
+#include "base64.hpp"
 #include "path.hpp"
 #include "fossilize_db.hpp"
 #include "layer/utils.hpp"
@@ -48,11 +49,35 @@
 using namespace rapidjson;
 
 using Allocator = RAPIDJSON_DEFAULT_ALLOCATOR;
+// Both the values and the parser stack live in memory pools, so they can be backed by recycled buffers.
+using ParseDocument = GenericDocument<UTF8<>, Allocator, Allocator>;
+
+// Lets rapidjson writers emit JSON straight into a blob.
+struct BlobOutputStream
+{
+	typedef char Ch;
+
+	explicit BlobOutputStream(std::vector<uint8_t> &blob_)
+		: blob(blob_)
+	{
+	}
+
+	void Put(char c)
+	{
+		blob.push_back(uint8_t(c));
+	}
+
+	void Flush()
+	{
+	}
+
+	std::vector<uint8_t> &blob;
+};
 
 #ifdef PRETTY_WRITER
-using CustomWriter = PrettyWriter<StringBuffer>;
+using BlobWriter = PrettyWriter<BlobOutputStream, UTF8<>, UTF8<>, Allocator>;
 #else
-using CustomWriter = Writer<StringBuffer>;
+using BlobWriter = Writer<BlobOutputStream, UTF8<>, UTF8<>, Allocator>;
 #endif
 
 static inline bool operator==(const VkShaderModuleIdentifierEXT &a, const VkShaderModuleIdentifierEXT &b)
@@ -252,9 +277,22 @@ static bool shader_stage_is_identifier_only(const VkPipelineShaderStageCreateInf
 
 struct StateReplayer::Impl
 {
-	bool parse(StateCreatorInterface &iface, DatabaseInterface *resolver, const void *buffer, size_t size) FOSSILIZE_WARN_UNUSED;
+	bool parse(StateCreatorInterface &iface, DatabaseInterface *resolver, const void *buffer, size_t size,
+	           bool in_place) FOSSILIZE_WARN_UNUSED;
+	bool parse_document(StateCreatorInterface &iface, DatabaseInterface *resolver, const Value &doc,
+	                    const uint8_t *varint_buffer, size_t varint_size) FOSSILIZE_WARN_UNUSED;
 	ScratchAllocator allocator;
 
+	// Memory for parsed documents is recycled between blobs, so the parse does not have to go through malloc.
+	// Resolving dependencies parses blobs recursively, so each level of recursion has its own buffers.
+	struct DocumentScratch
+	{
+		std::vector<uint8_t> values;
+		std::vector<uint8_t> stack;
+	};
+	std::vector<DocumentScratch> document_scratch;
+	unsigned parse_depth = 0;
+
 	std::unordered_map<Hash, VkSampler> replayed_samplers;
 	std::unordered_map<Hash, VkDescriptorSetLayout> replayed_descriptor_set_layouts;
 	std::unordered_map<Hash, VkPipelineLayout> replayed_pipeline_layouts;
@@ -593,7 +631,7 @@ struct StateRecorder::Impl
 	bool serialize_application_info(std::vector<uint8_t> &blob) const FOSSILIZE_WARN_UNUSED;
 	bool serialize_application_blob_link(Hash hash, ResourceTag tag, std::vector<uint8_t> &blob) const FOSSILIZE_WARN_UNUSED;
 	Hash get_application_link_hash(ResourceTag tag, Hash hash) const;
-	bool register_application_link_hash(ResourceTag tag, Hash hash, std::vector<uint8_t> &blob) const FOSSILIZE_WARN_UNUSED;
+	bool register_application_link_hash(ResourceTag tag, Hash hash, std::vector<uint8_t> &blob) FOSSILIZE_WARN_UNUSED;
 	bool serialize_sampler(Hash hash, const VkSamplerCreateInfo &create_info, std::vector<uint8_t> &blob) const FOSSILIZE_WARN_UNUSED;
 	bool serialize_descriptor_set_layout(Hash hash, const VkDescriptorSetLayoutCreateInfo &create_info, std::vector<uint8_t> &blob) const FOSSILIZE_WARN_UNUSED;
 	bool serialize_pipeline_layout(Hash hash, const VkPipelineLayoutCreateInfo &create_info, std::vector<uint8_t> &blob) const FOSSILIZE_WARN_UNUSED;
@@ -615,8 +653,15 @@ struct StateRecorder::Impl
 	void push_unregister_locked(VkStructureType sType, T obj);
 
 	bool compression = false;
+	bool fast_compression = false;
 	bool checksum = false;
+	bool binary_encoding = false;
+
+	// Backs the documents built by serialize_*(), see RecycledDocument.
+	mutable std::vector<uint8_t> document_buffer;
+	mutable size_t document_buffer_size = 16 * 1024;
 	bool application_feature_links = true;
+	uint32_t flush_interval_ms = 1000;
 
 	void record_task(StateRecorder *recorder, bool looping);
 	void pump_synchronized_recording(StateRecorder *recorder);
@@ -642,7 +687,23 @@ struct StateRecorder::Impl
 		bool need_flush = false;
 		bool need_prepare = true;
 		vector<uint8_t> blob;
+
+		// Serialized entries are batched up and committed to the database in one go.
+		struct PendingEntry
+		{
+			ResourceTag tag;
+			Hash hash;
+			size_t offset;
+			size_t size;
+			PayloadWriteFlags flags;
+		};
+		vector<PendingEntry> pending_entries;
+		vector<uint8_t> pending_data;
+		vector<DatabaseWriteEntry> write_entries;
 	} record_data;
+
+	void queue_database_entry(ResourceTag tag, Hash hash, const vector<uint8_t> &blob, PayloadWriteFlags flags);
+	void commit_database_entries();
 };
 
 // reinterpret_cast does not work reliably on MSVC 2013 for Vulkan objects.
@@ -2904,69 +2965,11 @@ bool compute_hash_render_pass2(const VkRenderPassCreateInfo2 &create_info, Hash
 }
 }
 
-static uint8_t *decode_base64(ScratchAllocator &allocator, const char *data, size_t length)
+static uint8_t *decode_base64(ScratchAllocator &allocator, const Value &value, size_t size)
 {
-	auto *buf = static_cast<uint8_t *>(allocator.allocate_raw(length, 16));
-	auto *ptr = buf;
-
-	const auto base64_index = [](char c) -> uint32_t {
-		if (c >= 'A' && c <= 'Z')
-			return uint32_t(c - 'A');
-		else if (c >= 'a' && c <= 'z')
-			return uint32_t(c - 'a') + 26;
-		else if (c >= '0' && c <= '9')
-			return uint32_t(c - '0') + 52;
-		else if (c == '+')
-			return 62;
-		else if (c == '/')
-			return 63;
-		else
-			return 0;
-	};
-
-	for (uint64_t i = 0; i < length; )
-	{
-		char c0 = *data++;
-		if (c0 == '\0')
-			break;
-		char c1 = *data++;
-		if (c1 == '\0')
-			break;
-		char c2 = *data++;
-		if (c2 == '\0')
-			break;
-		char c3 = *data++;
-		if (c3 == '\0')
-			break;
-
-		uint32_t values =
-				(base64_index(c0) << 18) |
-				(base64_index(c1) << 12) |
-				(base64_index(c2) << 6) |
-				(base64_index(c3) << 0);
-
-		unsigned outbytes = 3;
-		if (c2 == '=' && c3 == '=')
-		{
-			outbytes = 1;
-			*ptr++ = uint8_t(values >> 16);
-		}
-		else if (c3 == '=')
-		{
-			outbytes = 2;
-			*ptr++ = uint8_t(values >> 16);
-			*ptr++ = uint8_t(values >> 8);
-		}
-		else
-		{
-			*ptr++ = uint8_t(values >> 16);
-			*ptr++ = uint8_t(values >> 8);
-			*ptr++ = uint8_t(values >> 0);
-		}
-
-		i += outbytes;
-	}
-
+	auto *buf = static_cast<uint8_t *>(allocator.allocate_raw(size, 16));
+	if (buf)
+		decode_base64(buf, size, value.GetString(), value.GetStringLength());
 	return buf;
 }
 
@@ -3005,7 +3008,7 @@ bool StateReplayer::Impl::parse_immutable_samplers(StateCreatorInterface &iface,
 					return false;
 				}
 
-				vector<uint8_t> external_state(external_state_size);
+				vector<uint8_t> external_state(external_state_size + 1);
 
 				if (!resolver->read_entry(RESOURCE_SAMPLER, sampler_hash,
 				                          &external_state_size, external_state.data(),
@@ -3014,8 +3017,9 @@ bool StateReplayer::Impl::parse_immutable_samplers(StateCreatorInterface &iface,
 					log_missing_resource("Immutable sampler", sampler_hash);
 					return false;
 				}
+				external_state[external_state_size] = '\0';
 
-				if (!this->parse(iface, resolver, external_state.data(), external_state.size()))
+				if (!this->parse(iface, resolver, external_state.data(), external_state.size(), true))
 					return false;
 
 				iface.sync_samplers();
@@ -3169,7 +3173,7 @@ bool StateReplayer::Impl::parse_shader_modules(StateCreatorInterface &iface, con
 			info.pCode = decoded;
 		}
 		else
-			info.pCode = reinterpret_cast<uint32_t *>(decode_base64(allocator, obj["code"].GetString(), info.codeSize));
+			info.pCode = reinterpret_cast<uint32_t *>(decode_base64(allocator, obj["code"], info.codeSize));
 
 		if (!iface.enqueue_create_shader_module(hash, &info, &replayed_shader_modules[hash]))
 			return false;
@@ -3766,7 +3770,7 @@ bool StateReplayer::Impl::parse_specialization_info(const Value &spec_info, cons
 {
 	auto *spec = allocator.allocate_cleared<VkSpecializationInfo>();
 	spec->dataSize = spec_info["dataSize"].GetUint();
-	spec->pData = decode_base64(allocator, spec_info["data"].GetString(), spec->dataSize);
+	spec->pData = decode_base64(allocator, spec_info["data"], spec->dataSize);
 	if (spec_info.HasMember("mapEntries"))
 	{
 		spec->mapEntryCount = spec_info["mapEntries"].Size();
@@ -3825,7 +3829,7 @@ bool StateReplayer::Impl::parse_compute_pipeline(StateCreatorInterface &iface, D
 				return false;
 			}
 
-			vector<uint8_t> external_state(external_state_size);
+			vector<uint8_t> external_state(external_state_size + 1);
 
 			if (!resolver->read_entry(RESOURCE_SHADER_MODULE, module, &external_state_size, external_state.data(),
 			                          PAYLOAD_READ_NO_FLAGS))
@@ -3833,8 +3837,9 @@ bool StateReplayer::Impl::parse_compute_pipeline(StateCreatorInterface &iface, D
 				log_missing_resource("Shader module", module);
 				return false;
 			}
+			external_state[external_state_size] = '\0';
 
-			if (!this->parse(iface, resolver, external_state.data(), external_state.size()))
+			if (!this->parse(iface, resolver, external_state.data(), external_state.size(), true))
 				return false;
 
 			iface.sync_shader_modules();
@@ -4263,7 +4268,7 @@ bool StateReplayer::Impl::parse_stages(StateCreatorInterface &iface, DatabaseInt
 					return false;
 				}
 
-				vector<uint8_t> external_state(external_state_size);
+				vector<uint8_t> external_state(external_state_size + 1);
 
 				if (!resolver->read_entry(RESOURCE_SHADER_MODULE, module, &external_state_size, external_state.data(),
 				                          PAYLOAD_READ_NO_FLAGS))
@@ -4271,8 +4276,9 @@ bool StateReplayer::Impl::parse_stages(StateCreatorInterface &iface, DatabaseInt
 					log_missing_resource("Shader module", module);
 					return false;
 				}
+				external_state[external_state_size] = '\0';
 
-				if (!this->parse(iface, resolver, external_state.data(), external_state.size()))
+				if (!this->parse(iface, resolver, external_state.data(), external_state.size(), true))
 					return false;
 
 				iface.sync_shader_modules();
@@ -4376,7 +4382,7 @@ bool StateReplayer::Impl::parse_derived_pipeline_handle(StateCreatorInterface &i
 				return false;
 			}
 
-			vector<uint8_t> external_state(external_state_size);
+			vector<uint8_t> external_state(external_state_size + 1);
 
 			if (!resolver->read_entry(tag, pipeline, &external_state_size, external_state.data(),
 			                          PAYLOAD_READ_NO_FLAGS))
@@ -4384,8 +4390,9 @@ bool StateReplayer::Impl::parse_derived_pipeline_handle(StateCreatorInterface &i
 				log_missing_resource("Base pipeline", pipeline);
 				return false;
 			}
+			external_state[external_state_size] = '\0';
 
-			if (!this->parse(iface, resolver, external_state.data(), external_state.size()))
+			if (!this->parse(iface, resolver, external_state.data(), external_state.size(), true))
 				return false;
 
 			iface.sync_threads();
@@ -6216,7 +6223,12 @@ ScratchAllocator &StateReplayer::get_allocator()
 
 bool StateReplayer::parse(StateCreatorInterface &iface, DatabaseInterface *resolver, const void *buffer, size_t size)
 {
-	return impl->parse(iface, resolver, buffer, size);
+	return impl->parse(iface, resolver, buffer, size, false);
+}
+
+bool StateReplayer::parse_in_place(StateCreatorInterface &iface, DatabaseInterface *resolver, void *buffer, size_t size)
+{
+	return impl->parse(iface, resolver, buffer, size, true);
 }
 
 void StateReplayer::set_resolve_derivative_pipeline_handles(bool enable)
@@ -6273,24 +6285,424 @@ void StateReplayer::Impl::forget_handle_references()
 	forget_pipeline_handle_references();
 }
 
-bool StateReplayer::Impl::parse(StateCreatorInterface &iface, DatabaseInterface *resolver, const void *buffer_, size_t total_size)
+// Binary form of a state blob, see StateRecorder::set_database_enable_binary_encoding().
+// It encodes the same document as the JSON form, so both go through the same parsing code,
+// but decoding it does not have to tokenize text, parse numbers or unescape strings.
+//
+// Layout: '\0' 'F' 'Z' 'B', an encoding version byte, the root value,
+// then the binary payload which follows the '\0' delimiter in the JSON form (SPIR-V varint for example).
+// The leading '\0' means older replayers see an empty JSON document and reject the blob cleanly.
+//
+// Every value starts with a tag. Integers and counts are LEB128 varints.
+// Strings are length prefixed and '\0' terminated, so decoded documents can point into the blob.
+// Handles, i.e. 16 digit lowercase hex strings, are stored as raw little-endian u64.
+// Object keys which have already been seen in the blob refer back to the first occurrence.
+static const uint8_t binary_blob_magic[4] = { '\0', 'F', 'Z', 'B' };
+
+enum
+{
+	BinaryBlobVersion = 1,
+	BinaryBlobHeaderSize = 5,
+	BinaryBlobMaxDepth = 256
+};
+
+enum BinaryBlobTag
+{
+	BINARY_BLOB_TAG_NULL = 0,
+	BINARY_BLOB_TAG_FALSE = 1,
+	BINARY_BLOB_TAG_TRUE = 2,
+	BINARY_BLOB_TAG_UINT = 3,
+	BINARY_BLOB_TAG_NEGATIVE_INT = 4,
+	BINARY_BLOB_TAG_DOUBLE = 5,
+	BINARY_BLOB_TAG_STRING = 6,
+	BINARY_BLOB_TAG_HANDLE = 7,
+	BINARY_BLOB_TAG_KEY_REFERENCE = 8,
+	BINARY_BLOB_TAG_ARRAY = 9,
+	BINARY_BLOB_TAG_OBJECT = 10
+};
+
+static bool is_binary_state_blob(const uint8_t *buffer, size_t size)
+{
+	return size >= BinaryBlobHeaderSize && memcmp(buffer, binary_blob_magic, sizeof(binary_blob_magic)) == 0;
+}
+
+static int hex_digit_value(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	else if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	else
+		return -1;
+}
+
+struct BinaryBlobEncoder
+{
+	explicit BinaryBlobEncoder(vector<uint8_t> &out_)
+		: out(out_)
+	{
+	}
+
+	// Only the first keys are remembered, which keeps the encoder from allocating.
+	// Typical blobs have far fewer distinct keys than this. The decoder remembers all of them,
+	// which is fine since the encoder never refers to the ones it did not remember.
+	enum { MaxKeys = 256 };
+
+	vector<uint8_t> &out;
+	pair<const char *, SizeType> keys[MaxKeys];
+	size_t key_count = 0;
+
+	void write_varint(uint64_t value)
+	{
+		while (value >= 0x80)
+		{
+			out.push_back(uint8_t(value | 0x80));
+			value >>= 7;
+		}
+		out.push_back(uint8_t(value));
+	}
+
+	bool write_handle(const char *str, SizeType len)
+	{
+		if (len != 16)
+			return false;
+
+		uint64_t handle = 0;
+		for (SizeType i = 0; i < len; i++)
+		{
+			int digit = hex_digit_value(str[i]);
+			if (digit < 0)
+				return false;
+			handle = (handle << 4) | uint64_t(digit);
+		}
+
+		out.push_back(BINARY_BLOB_TAG_HANDLE);
+		for (unsigned i = 0; i < 8; i++)
+			out.push_back(uint8_t(handle >> (8 * i)));
+		return true;
+	}
+
+	void write_string(const char *str, SizeType len)
+	{
+		if (write_handle(str, len))
+			return;
+
+		out.push_back(BINARY_BLOB_TAG_STRING);
+		write_varint(len);
+		out.insert(out.end(), str, str + len);
+		out.push_back('\0');
+	}
+
+	void write_key(const Value &key)
+	{
+		const char *str = key.GetString();
+		SizeType len = key.GetStringLength();
+		if (write_handle(str, len))
+			return;
+
+		for (size_t i = 0; i < key_count; i++)
+		{
+			if (keys[i].second == len && memcmp(keys[i].first, str, len) == 0)
+			{
+				out.push_back(BINARY_BLOB_TAG_KEY_REFERENCE);
+				write_varint(i);
+				return;
+			}
+		}
+
+		if (key_count < MaxKeys)
+			keys[key_count++] = { str, len };
+		out.push_back(BINARY_BLOB_TAG_STRING);
+		write_varint(len);
+		out.insert(out.end(), str, str + len);
+		out.push_back('\0');
+	}
+
+	void write_value(const Value &value)
+	{
+		if (value.IsNull())
+			out.push_back(BINARY_BLOB_TAG_NULL);
+		else if (value.IsBool())
+			out.push_back(value.GetBool() ? BINARY_BLOB_TAG_TRUE : BINARY_BLOB_TAG_FALSE);
+		else if (value.IsUint64())
+		{
+			out.push_back(BINARY_BLOB_TAG_UINT);
+			write_varint(value.GetUint64());
+		}
+		else if (value.IsInt64())
+		{
+			// Only negative values end up here, so store the one's complement.
+			out.push_back(BINARY_BLOB_TAG_NEGATIVE_INT);
+			write_varint(~uint64_t(value.GetInt64()));
+		}
+		else if (value.IsNumber())
+		{
+			double d = value.GetDouble();
+			uint64_t bits;
+			memcpy(&bits, &d, sizeof(bits));
+			out.push_back(BINARY_BLOB_TAG_DOUBLE);
+			for (unsigned i = 0; i < 8; i++)
+				out.push_back(uint8_t(bits >> (8 * i)));
+		}
+		else if (value.IsString())
+			write_string(value.GetString(), value.GetStringLength());
+		else if (value.IsArray())
+		{
+			out.push_back(BINARY_BLOB_TAG_ARRAY);
+			write_varint(value.Size());
+			for (auto itr = value.Begin(); itr != value.End(); ++itr)
+				write_value(*itr);
+		}
+		else
+		{
+			out.push_back(BINARY_BLOB_TAG_OBJECT);
+			write_varint(value.MemberCount());
+			for (auto itr = value.MemberBegin(); itr != value.MemberEnd(); ++itr)
+			{
+				write_key(itr->name);
+				write_value(itr->value);
+			}
+		}
+	}
+};
+
+struct BinaryBlobDecoder
+{
+	BinaryBlobDecoder(const uint8_t *data_, const uint8_t *end_, Allocator &alloc_)
+		: data(data_), end(end_), alloc(alloc_)
+	{
+	}
+
+	const uint8_t *data;
+	const uint8_t *end;
+	Allocator &alloc;
+	vector<pair<const char *, SizeType>> keys;
+
+	bool read_varint(uint64_t &value)
+	{
+		value = 0;
+		for (unsigned shift = 0; shift < 64 && data < end; shift += 7)
+		{
+			uint8_t c = *data++;
+			value |= uint64_t(c & 0x7f) << shift;
+			if ((c & 0x80) == 0)
+				return true;
+		}
+		return false;
+	}
+
+	bool read_u64(uint64_t &value)
+	{
+		if (end - data < 8)
+			return false;
+		value = 0;
+		for (unsigned i = 0; i < 8; i++)
+			value |= uint64_t(data[i]) << (8 * i);
+		data += 8;
+		return true;
+	}
+
+	bool read_count(SizeType &count)
+	{
+		// Every element takes at least one byte, which bounds allocations on corrupt input.
+		uint64_t value;
+		if (!read_varint(value) || value > uint64_t(end - data))
+			return false;
+		count = SizeType(value);
+		return true;
+	}
+
+	bool read_string(const char *&str, SizeType &len)
+	{
+		if (!read_count(len) || len >= uint64_t(end - data) || data[len] != '\0')
+			return false;
+		str = reinterpret_cast<const char *>(data);
+		data += len + 1;
+		return true;
+	}
+
+	void set_handle(Value &value, uint64_t handle)
+	{
+		static const char digits[] = "0123456789abcdef";
+		char str[16];
+		for (int i = 15; i >= 0; i--, handle >>= 4)
+			str[i] = digits[handle & 0xf];
+		value.SetString(str, 16, alloc);
+	}
+
+	bool read_key(Value &key)
+	{
+		if (data >= end)
+			return false;
+
+		const char *str;
+		SizeType len;
+		uint64_t v;
+		switch (*data++)
+		{
+		case BINARY_BLOB_TAG_HANDLE:
+			if (!read_u64(v))
+				return false;
+			set_handle(key, v);
+			return true;
+
+		case BINARY_BLOB_TAG_STRING:
+			if (!read_string(str, len))
+				return false;
+			keys.emplace_back(str, len);
+			key.SetString(StringRef(str, len));
+			return true;
+
+		case BINARY_BLOB_TAG_KEY_REFERENCE:
+			if (!read_varint(v) || v >= keys.size())
+				return false;
+			key.SetString(StringRef(keys[v].first, keys[v].second));
+			return true;
+
+		default:
+			return false;
+		}
+	}
+
+	bool read_value(Value &value, unsigned depth)
+	{
+		if (data >= end || depth > BinaryBlobMaxDepth)
+			return false;
+
+		const char *str;
+		SizeType len;
+		uint64_t v;
+		switch (*data++)
+		{
+		case BINARY_BLOB_TAG_NULL:
+			value.SetNull();
+			return true;
+
+		case BINARY_BLOB_TAG_FALSE:
+			value.SetBool(false);
+			return true;
+
+		case BINARY_BLOB_TAG_TRUE:
+			value.SetBool(true);
+			return true;
+
+		case BINARY_BLOB_TAG_UINT:
+			if (!read_varint(v))
+				return false;
+			value.SetUint64(v);
+			return true;
+
+		case BINARY_BLOB_TAG_NEGATIVE_INT:
+			if (!read_varint(v))
+				return false;
+			value.SetInt64(int64_t(~v));
+			return true;
+
+		case BINARY_BLOB_TAG_DOUBLE:
+		{
+			if (!read_u64(v))
+				return false;
+			double d;
+			memcpy(&d, &v, sizeof(d));
+			value.SetDouble(d);
+			return true;
+		}
+
+		case BINARY_BLOB_TAG_STRING:
+			if (!read_string(str, len))
+				return false;
+			value.SetString(StringRef(str, len));
+			return true;
+
+		case BINARY_BLOB_TAG_HANDLE:
+			if (!read_u64(v))
+				return false;
+			set_handle(value, v);
+			return true;
+
+		case BINARY_BLOB_TAG_ARRAY:
+		{
+			if (!read_count(len))
+				return false;
+			value.SetArray();
+			value.Reserve(len, alloc);
+			for (SizeType i = 0; i < len; i++)
+			{
+				Value elem;
+				if (!read_value(elem, depth + 1))
+					return false;
+				value.PushBack(elem, alloc);
+			}
+			return true;
+		}
+
+		case BINARY_BLOB_TAG_OBJECT:
+		{
+			if (!read_count(len))
+				return false;
+			value.SetObject();
+			for (SizeType i = 0; i < len; i++)
+			{
+				Value key, member;
+				if (!read_key(key) || !read_value(member, depth + 1))
+					return false;
+				value.AddMember(key, member, alloc);
+			}
+			return true;
+		}
+
+		default:
+			return false;
+		}
+	}
+};
+
+// Parses either form of a state blob. The payload points to the binary data after the document, if any.
+// Strings decoded from the binary form point into the buffer, so it must outlive the document.
+// If in_place is set, the buffer is writable and JSON strings are decoded in place when the document is '\0' terminated.
+static bool parse_state_blob(ParseDocument &doc, const void *buffer_, size_t total_size,
+                             const uint8_t *&payload, size_t &payload_size, bool in_place = false)
 {
+	const uint8_t *buffer = static_cast<const uint8_t *>(buffer_);
+	payload = nullptr;
+	payload_size = 0;
+
+	if (is_binary_state_blob(buffer, total_size))
+	{
+		if (buffer[sizeof(binary_blob_magic)] != BinaryBlobVersion)
+		{
+			LOGE_LEVEL("Unsupported binary blob version %u.\n", unsigned(buffer[sizeof(binary_blob_magic)]));
+			return false;
+		}
+
+		BinaryBlobDecoder decoder(buffer + BinaryBlobHeaderSize, buffer + total_size, doc.GetAllocator());
+		if (!decoder.read_value(doc, 0) || !doc.IsObject())
+		{
+			LOGE_LEVEL("Failed to decode binary blob.\n");
+			return false;
+		}
+
+		payload_size = size_t(decoder.end - decoder.data);
+		if (payload_size)
+			payload = decoder.data;
+		return true;
+	}
+
 	// All data after a string terminating '\0' is considered binary payload
 	// which can be read for various purposes (SPIR-V varint for example).
-	const uint8_t *buffer = static_cast<const uint8_t *>(buffer_);
 	auto itr = find(buffer, buffer + total_size, '\0');
-	const uint8_t *varint_buffer = nullptr;
-	size_t varint_size = 0;
 	size_t json_size = itr - buffer;
 
 	if (itr < buffer + total_size)
 	{
-		varint_buffer = itr + 1;
-		varint_size = (buffer + total_size) - varint_buffer;
+		payload = itr + 1;
+		payload_size = (buffer + total_size) - payload;
 	}
 
-	Document doc;
-	doc.Parse(reinterpret_cast<const char *>(buffer), json_size);
+	if (in_place && payload)
+		doc.ParseInsitu(reinterpret_cast<char *>(const_cast<uint8_t *>(buffer)));
+	else
+		doc.Parse(reinterpret_cast<const char *>(buffer), json_size);
 
 	if (doc.HasParseError())
 	{
@@ -6299,6 +6711,138 @@ bool StateReplayer::Impl::parse(StateCreatorInterface &iface, DatabaseInterface
 		return false;
 	}
 
+	if (!doc.IsObject())
+	{
+		LOGE_LEVEL("Root of state blob is not an object.\n");
+		return false;
+	}
+
+	return true;
+}
+
+// The payload is appended after the document, following a '\0' delimiter in the JSON form.
+// Both forms are written directly into the blob, so its capacity is reused.
+static void serialize_state_blob(const Value &doc, bool binary, vector<uint8_t> &blob,
+                                 const uint8_t *payload = nullptr, size_t payload_size = 0)
+{
+	if (binary)
+	{
+		blob.assign(binary_blob_magic, binary_blob_magic + sizeof(binary_blob_magic));
+		blob.push_back(BinaryBlobVersion);
+		BinaryBlobEncoder encoder(blob);
+		encoder.write_value(doc);
+	}
+	else
+	{
+		// The writer only needs a small stack to track nesting, so keep that off the heap as well.
+		uint64_t stack_buffer[256];
+		Allocator stack_allocator(stack_buffer, sizeof(stack_buffer));
+		blob.clear();
+		BlobOutputStream stream(blob);
+		BlobWriter writer(stream, &stack_allocator);
+		doc.Accept(writer);
+
+		if (payload)
+			blob.push_back('\0');
+	}
+
+	blob.insert(blob.end(), payload, payload + payload_size);
+}
+
+// A document for serializing a single blob, with its memory pool backed by a recycled buffer.
+// If a document does not fit, the pool spills into malloc, and the buffer grows for the next document.
+// The pool writes to its buffer when it is destroyed, so the buffer can only be resized on the next use.
+struct RecycledDocument
+{
+	RecycledDocument(vector<uint8_t> &buffer, size_t &buffer_size_)
+		: buffer_size(buffer_size_), pool(prepare_buffer(buffer, buffer_size_), buffer_size_), doc(&pool)
+	{
+		doc.SetObject();
+	}
+
+	~RecycledDocument()
+	{
+		buffer_size = std::max(buffer_size, std::min(pool.Capacity(), size_t(MaxBufferSize)));
+	}
+
+	static void *prepare_buffer(vector<uint8_t> &buffer, size_t size)
+	{
+		if (buffer.size() < size)
+			buffer.resize(size);
+		return buffer.data();
+	}
+
+	enum { MaxBufferSize = 4 * 1024 * 1024 };
+	size_t &buffer_size;
+	Allocator pool;
+	Document doc;
+};
+
+bool convert_state_blob(const void *blob, size_t size, bool binary, vector<uint8_t> &out)
+{
+	ParseDocument doc;
+	const uint8_t *payload;
+	size_t payload_size;
+	if (!parse_state_blob(doc, blob, size, payload, payload_size))
+		return false;
+
+	serialize_state_blob(doc, binary, out, payload, payload_size);
+	return true;
+}
+
+bool StateReplayer::Impl::parse(StateCreatorInterface &iface, DatabaseInterface *resolver, const void *buffer, size_t total_size,
+                                bool in_place)
+{
+	// Start out with enough for typical pipelines. Buffers grow to fit the largest document seen,
+	// but huge documents, e.g. shader modules with base64 SPIR-V, are left to spill into malloc.
+	constexpr size_t InitialValueBufferSize = 64 * 1024;
+	constexpr size_t InitialStackBufferSize = 4 * 1024;
+	constexpr size_t MaxScratchBufferSize = 4 * 1024 * 1024;
+
+	if (parse_depth >= document_scratch.size())
+	{
+		document_scratch.emplace_back();
+		document_scratch.back().values.resize(InitialValueBufferSize);
+		document_scratch.back().stack.resize(InitialStackBufferSize);
+	}
+
+	// Resolving dependencies may grow document_scratch, so don't hold on to references into it.
+	auto values = std::move(document_scratch[parse_depth].values);
+	auto stack = std::move(document_scratch[parse_depth].stack);
+	size_t value_capacity, stack_capacity;
+	bool ret;
+
+	{
+		Allocator value_allocator(values.data(), values.size());
+		Allocator stack_allocator(stack.data(), stack.size());
+		ParseDocument doc(&value_allocator, stack.size() / 2, &stack_allocator);
+
+		const uint8_t *varint_buffer;
+		size_t varint_size;
+		parse_depth++;
+		ret = parse_state_blob(doc, buffer, total_size, varint_buffer, varint_size, in_place) &&
+		      parse_document(iface, resolver, doc, varint_buffer, varint_size);
+		parse_depth--;
+
+		value_capacity = value_allocator.Capacity();
+		stack_capacity = stack_allocator.Capacity();
+	}
+
+	// If the pools had to spill over, make room so that the next document of this size fits.
+	// The allocators write to their buffers when destroyed, so this has to wait until they are gone.
+	if (value_capacity > values.size())
+		values.resize(std::min(value_capacity, MaxScratchBufferSize));
+	if (stack_capacity > stack.size())
+		stack.resize(std::min(stack_capacity, MaxScratchBufferSize));
+
+	document_scratch[parse_depth].values = std::move(values);
+	document_scratch[parse_depth].stack = std::move(stack);
+	return ret;
+}
+
+bool StateReplayer::Impl::parse_document(StateCreatorInterface &iface, DatabaseInterface *resolver, const Value &doc,
+                                         const uint8_t *varint_buffer, size_t varint_size)
+{
 	int version = doc["version"].GetInt();
 	if (version > FOSSILIZE_FORMAT_VERSION || version < FOSSILIZE_FORMAT_MIN_COMPAT_VERSION)
 	{
@@ -7198,11 +7742,26 @@ void StateRecorder::set_database_enable_compression(bool enable)
 	impl->compression = enable;
 }
 
+void StateRecorder::set_database_enable_fast_compression(bool enable)
+{
+	impl->fast_compression = enable;
+}
+
+void StateRecorder::set_database_enable_binary_encoding(bool enable)
+{
+	impl->binary_encoding = enable;
+}
+
 void StateRecorder::set_database_enable_application_feature_links(bool enable)
 {
 	impl->application_feature_links = enable;
 }
 
+void StateRecorder::set_database_flush_interval(uint32_t milliseconds)
+{
+	impl->flush_interval_ms = milliseconds;
+}
+
 bool StateRecorder::record_application_info(const VkApplicationInfo &info)
 {
 	if (info.pNext)
@@ -8977,8 +9536,7 @@ Hash StateRecorder::Impl::record_shader_module(const WorkItem &record_item, bool
 			{
 				if (serialize_shader_module(hash, *create_info, blob, allocator))
 				{
-					database_iface->write_entry(RESOURCE_SHADER_MODULE, hash, blob.data(), blob.size(),
-												record_data.payload_flags);
+					queue_database_entry(RESOURCE_SHADER_MODULE, hash, blob, record_data.payload_flags);
 					record_data.need_flush = true;
 				}
 			}
@@ -9012,6 +9570,39 @@ Hash StateRecorder::Impl::record_shader_module(const WorkItem &record_item, bool
 	return hash;
 }
 
+void StateRecorder::Impl::queue_database_entry(ResourceTag tag, Hash hash, const vector<uint8_t> &blob,
+                                               PayloadWriteFlags flags)
+{
+	record_data.pending_entries.push_back({ tag, hash, record_data.pending_data.size(), blob.size(), flags });
+	record_data.pending_data.insert(record_data.pending_data.end(), blob.begin(), blob.end());
+
+	// Don't let a long burst of recordings hold on to too much memory.
+	if (record_data.pending_data.size() >= 1024 * 1024)
+		commit_database_entries();
+}
+
+void StateRecorder::Impl::commit_database_entries()
+{
+	if (record_data.pending_entries.empty())
+		return;
+
+	// pending_data may have been reallocated while queueing, so resolve pointers late.
+	record_data.write_entries.clear();
+	for (auto &entry : record_data.pending_entries)
+	{
+		record_data.write_entries.push_back({ entry.tag, entry.hash,
+		                                      record_data.pending_data.data() + entry.offset,
+		                                      entry.size, entry.flags });
+	}
+
+	if (database_iface && !database_iface->write_entries(record_data.write_entries.data(), record_data.write_entries.size()))
+		LOGW_LEVEL("Failed to write %u entries to database.\n", unsigned(record_data.write_entries.size()));
+
+	record_data.pending_entries.clear();
+	record_data.pending_data.clear();
+	record_data.need_flush = true;
+}
+
 void StateRecorder::Impl::record_task(StateRecorder *recorder, bool looping)
 {
 	auto &blob = record_data.blob;
@@ -9021,6 +9612,8 @@ void StateRecorder::Impl::record_task(StateRecorder *recorder, bool looping)
 		record_data.payload_flags = 0;
 		if (compression)
 			record_data.payload_flags |= PAYLOAD_WRITE_COMPRESS_BIT;
+		if (compression && fast_compression)
+			record_data.payload_flags |= PAYLOAD_WRITE_FAST_COMPRESSION_BIT;
 		if (checksum)
 			record_data.payload_flags |= PAYLOAD_WRITE_COMPUTE_CHECKSUM_BIT;
 
@@ -9061,8 +9654,7 @@ void StateRecorder::Impl::record_task(StateRecorder *recorder, bool looping)
 			Hashing::hash_application_feature_info(h, application_feature_hash);
 			if (serialize_application_info(blob))
 			{
-				database_iface->write_entry(RESOURCE_APPLICATION_INFO, h.get(), blob.data(), blob.size(),
-											record_data.payload_flags);
+				queue_database_entry(RESOURCE_APPLICATION_INFO, h.get(), blob, record_data.payload_flags);
 
 				register_on_use(RESOURCE_APPLICATION_INFO, h.get());
 			}
@@ -9108,6 +9700,15 @@ void StateRecorder::Impl::record_task(StateRecorder *recorder, bool looping)
 		WorkItem record_item = {};
 		{
 			std::unique_lock<std::mutex> lock(record_lock);
+
+			// The queue is drained, so commit everything recorded so far in one write before going to sleep.
+			if (record_queue.empty() && !record_data.pending_entries.empty())
+			{
+				lock.unlock();
+				commit_database_entries();
+				lock.lock();
+			}
+
 			if (record_queue.empty())
 				temp_allocator.reset();
 
@@ -9118,11 +9719,11 @@ void StateRecorder::Impl::record_task(StateRecorder *recorder, bool looping)
 
 			// If we have written something to the database, wake up to flush whatever files are
 			// necessary. Do not flush after every single write, as that might bog down the file system.
-			// Once no new writes have occurred for a second, we flush, and go to deep sleep.
+			// Once no new writes have occurred for the flush interval, we flush, and go to deep sleep.
 			bool has_data;
 			if (record_data.need_flush)
 			{
-				has_data = record_cv.wait_for(lock, std::chrono::seconds(1),
+				has_data = record_cv.wait_for(lock, std::chrono::milliseconds(flush_interval_ms),
 				                              [&]()
 				                              {
 					                              return !record_queue.empty();
@@ -9139,7 +9740,8 @@ void StateRecorder::Impl::record_task(StateRecorder *recorder, bool looping)
 
 			if (database_iface && !has_data && record_data.need_flush)
 			{
-				database_iface->flush();
+				if (!database_iface->flush())
+					LOGW_LEVEL("Failed to flush database.\n");
 				record_data.need_flush = false;
 				continue;
 			}
@@ -9189,8 +9791,7 @@ void StateRecorder::Impl::record_task(StateRecorder *recorder, bool looping)
 					{
 						if (serialize_sampler(hash, *create_info, blob))
 						{
-							database_iface->write_entry(tag, hash, blob.data(), blob.size(),
-														record_data.payload_flags);
+							queue_database_entry(tag, hash, blob, record_data.payload_flags);
 							record_data.need_flush = true;
 						}
 					}
@@ -9259,8 +9860,7 @@ void StateRecorder::Impl::record_task(StateRecorder *recorder, bool looping)
 						if ((create_info && serialize_render_pass(hash, *create_info, blob)) ||
 						    (create_info2 && serialize_render_pass2(hash, *create_info2, blob)))
 						{
-							database_iface->write_entry(tag, hash, blob.data(), blob.size(),
-														record_data.payload_flags);
+							queue_database_entry(tag, hash, blob, record_data.payload_flags);
 							record_data.need_flush = true;
 						}
 					}
@@ -9331,8 +9931,7 @@ void StateRecorder::Impl::record_task(StateRecorder *recorder, bool looping)
 					{
 						if (serialize_descriptor_set_layout(hash, *create_info_copy, blob))
 						{
-							database_iface->write_entry(tag, hash, blob.data(), blob.size(),
-														record_data.payload_flags);
+							queue_database_entry(tag, hash, blob, record_data.payload_flags);
 							record_data.need_flush = true;
 						}
 					}
@@ -9388,8 +9987,7 @@ void StateRecorder::Impl::record_task(StateRecorder *recorder, bool looping)
 					{
 						if (serialize_pipeline_layout(hash, *create_info_copy, blob))
 						{
-							database_iface->write_entry(tag, hash, blob.data(), blob.size(),
-														record_data.payload_flags);
+							queue_database_entry(tag, hash, blob, record_data.payload_flags);
 							record_data.need_flush = true;
 						}
 					}
@@ -9455,8 +10053,7 @@ void StateRecorder::Impl::record_task(StateRecorder *recorder, bool looping)
 					{
 						if (serialize_raytracing_pipeline(hash, *create_info_copy, blob))
 						{
-							database_iface->write_entry(tag, hash, blob.data(), blob.size(),
-														record_data.payload_flags);
+							queue_database_entry(tag, hash, blob, record_data.payload_flags);
 							record_data.need_flush = true;
 						}
 					}
@@ -9523,8 +10120,7 @@ void StateRecorder::Impl::record_task(StateRecorder *recorder, bool looping)
 					{
 						if (serialize_graphics_pipeline(hash, *create_info_copy, blob))
 						{
-							database_iface->write_entry(tag, hash, blob.data(), blob.size(),
-														record_data.payload_flags);
+							queue_database_entry(tag, hash, blob, record_data.payload_flags);
 							record_data.need_flush = true;
 						}
 					}
@@ -9590,8 +10186,7 @@ void StateRecorder::Impl::record_task(StateRecorder *recorder, bool looping)
 					{
 						if (serialize_compute_pipeline(hash, *create_info_copy, blob))
 						{
-							database_iface->write_entry(tag, hash, blob.data(), blob.size(),
-														record_data.payload_flags);
+							queue_database_entry(tag, hash, blob, record_data.payload_flags);
 							record_data.need_flush = true;
 						}
 					}
@@ -9616,6 +10211,8 @@ void StateRecorder::Impl::record_task(StateRecorder *recorder, bool looping)
 			register_on_use(tag, hash);
 	}
 
+	commit_database_entries();
+
 	if (looping)
 	{
 		if (database_iface)
@@ -9647,56 +10244,14 @@ void StateRecorder::Impl::record_task(StateRecorder *recorder, bool looping)
 	}
 }
 
-static char base64(uint32_t v)
+// The string lives in the document's allocator, so rapidjson does not need to copy it.
+static Value encode_base64(const void *data, size_t size, Allocator &alloc)
 {
-	if (v == 63)
-		return '/';
-	else if (v == 62)
-		return '+';
-	else if (v >= 52)
-		return char('0' + (v - 52));
-	else if (v >= 26)
-		return char('a' + (v - 26));
-	else
-		return char('A' + v);
-}
-
-static std::string encode_base64(const void *data_, size_t size)
-{
-	auto *data = static_cast<const uint8_t *>(data_);
-	size_t num_chars = 4 * ((size + 2) / 3);
-	std::string ret;
-	ret.reserve(num_chars);
-
-	for (size_t i = 0; i < size; i += 3)
-	{
-		uint32_t code = data[i] << 16;
-		if (i + 1 < size)
-			code |= data[i + 1] << 8;
-		if (i + 2 < size)
-			code |= data[i + 2] << 0;
-
-		auto c0 = base64((code >> 18) & 63);
-		auto c1 = base64((code >> 12) & 63);
-		auto c2 = base64((code >>  6) & 63);
-		auto c3 = base64((code >>  0) & 63);
-
-		auto outbytes = std::min(size - i, size_t(3));
-		if (outbytes == 1)
-		{
-			c2 = '=';
-			c3 = '=';
-		}
-		else if (outbytes == 2)
-			c3 = '=';
-
-		ret.push_back(c0);
-		ret.push_back(c1);
-		ret.push_back(c2);
-		ret.push_back(c3);
-	}
-
-	return ret;
+	size_t length = compute_base64_encoded_size(size);
+	auto *str = static_cast<char *>(alloc.Malloc(length + 1));
+	encode_base64(str, data, size);
+	str[length] = '\0';
+	return Value(StringRef(str, SizeType(length)));
 }
 
 template <typename T>
@@ -9759,7 +10314,7 @@ static bool json_value(const VkShaderModuleCreateInfo& module, Allocator& alloc,
 	Value m(kObjectType);
 	m.AddMember("flags", module.flags, alloc);
 	m.AddMember("codeSize", uint64_t(module.codeSize), alloc);
-	m.AddMember("code", encode_base64(module.pCode, module.codeSize), alloc);
+	m.AddMember("code", encode_base64(module.pCode, module.codeSize, alloc), alloc);
 
 	*out_value = m;
 	return true;
@@ -10954,7 +11509,7 @@ static bool json_value(const VkComputePipelineCreateInfo& pipe, Allocator& alloc
 		spec.AddMember("dataSize", uint64_t(pipe.stage.pSpecializationInfo->dataSize), alloc);
 		spec.AddMember("data",
 		               encode_base64(pipe.stage.pSpecializationInfo->pData,
-		                             pipe.stage.pSpecializationInfo->dataSize), alloc);
+		                             pipe.stage.pSpecializationInfo->dataSize, alloc), alloc);
 		Value map_entries(kArrayType);
 		for (uint32_t i = 0; i < pipe.stage.pSpecializationInfo->mapEntryCount; i++)
 		{
@@ -11292,7 +11847,7 @@ static bool json_value(const VkPipelineShaderStageCreateInfo *pStages, uint32_t
 			spec.AddMember("dataSize", uint64_t(s.pSpecializationInfo->dataSize), alloc);
 			spec.AddMember("data",
 			               encode_base64(s.pSpecializationInfo->pData,
-			                             s.pSpecializationInfo->dataSize), alloc);
+			                             s.pSpecializationInfo->dataSize, alloc), alloc);
 			Value map_entries(kArrayType);
 			for (uint32_t j = 0; j < s.pSpecializationInfo->mapEntryCount; j++)
 			{
@@ -11915,8 +12470,8 @@ static bool serialize_physical_device_features_inline(Value &value, const VkPhys
 
 bool StateRecorder::Impl::serialize_application_info(vector<uint8_t> &blob) const
 {
-	Document doc;
-	doc.SetObject();
+	RecycledDocument scratch(document_buffer, document_buffer_size);
+	auto &doc = scratch.doc;
 	auto &alloc = doc.GetAllocator();
 
 	Value app_info(kObjectType);
@@ -11931,12 +12486,7 @@ bool StateRecorder::Impl::serialize_application_info(vector<uint8_t> &blob) cons
 	doc.AddMember("applicationInfo", app_info, alloc);
 	doc.AddMember("physicalDeviceFeatures", pdf_info, alloc);
 
-	StringBuffer buffer;
-	CustomWriter writer(buffer);
-	doc.Accept(writer);
-
-	blob.resize(buffer.GetSize());
-	memcpy(blob.data(), buffer.GetString(), buffer.GetSize());
+	serialize_state_blob(doc, binary_encoding, blob);
 	return true;
 }
 
@@ -11945,7 +12495,7 @@ Hash StateRecorder::Impl::get_application_link_hash(ResourceTag tag, Hash hash)
 	return Hashing::compute_hash_application_info_link(application_feature_hash, tag, hash);
 }
 
-bool StateRecorder::Impl::register_application_link_hash(ResourceTag tag, Hash hash, vector<uint8_t> &blob) const
+bool StateRecorder::Impl::register_application_link_hash(ResourceTag tag, Hash hash, vector<uint8_t> &blob)
 {
 	if (!application_feature_links)
 		return false;
@@ -11960,7 +12510,7 @@ bool StateRecorder::Impl::register_application_link_hash(ResourceTag tag, Hash h
 	{
 		if (!serialize_application_blob_link(hash, tag, blob))
 			return false;
-		database_iface->write_entry(RESOURCE_APPLICATION_BLOB_LINK, link_hash, blob.data(), blob.size(), payload_flags);
+		queue_database_entry(RESOURCE_APPLICATION_BLOB_LINK, link_hash, blob, payload_flags);
 		return true;
 	}
 	else
@@ -11969,8 +12519,8 @@ bool StateRecorder::Impl::register_application_link_hash(ResourceTag tag, Hash h
 
 bool StateRecorder::Impl::serialize_application_blob_link(Hash hash, ResourceTag tag, vector<uint8_t> &blob) const
 {
-	Document doc;
-	doc.SetObject();
+	RecycledDocument scratch(document_buffer, document_buffer_size);
+	auto &doc = scratch.doc;
 	auto &alloc = doc.GetAllocator();
 
 	doc.AddMember("version", FOSSILIZE_FORMAT_VERSION, alloc);
@@ -11985,19 +12535,14 @@ bool StateRecorder::Impl::serialize_application_blob_link(Hash hash, ResourceTag
 	link.AddMember("hash", uint64_string(hash, alloc), alloc);
 	doc.AddMember("link", link, alloc);
 
-	StringBuffer buffer;
-	CustomWriter writer(buffer);
-	doc.Accept(writer);
-
-	blob.resize(buffer.GetSize());
-	memcpy(blob.data(), buffer.GetString(), buffer.GetSize());
+	serialize_state_blob(doc, binary_encoding, blob);
 	return true;
 }
 
 bool StateRecorder::Impl::serialize_sampler(Hash hash, const VkSamplerCreateInfo &create_info, vector<uint8_t> &blob) const
 {
-	Document doc;
-	doc.SetObject();
+	RecycledDocument scratch(document_buffer, document_buffer_size);
+	auto &doc = scratch.doc;
 	auto &alloc = doc.GetAllocator();
 
 	Value value;
@@ -12010,20 +12555,15 @@ bool StateRecorder::Impl::serialize_sampler(Hash hash, const VkSamplerCreateInfo
 	doc.AddMember("version", FOSSILIZE_FORMAT_VERSION, alloc);
 	doc.AddMember("samplers", serialized_samplers, alloc);
 
-	StringBuffer buffer;
-	CustomWriter writer(buffer);
-	doc.Accept(writer);
-
-	blob.resize(buffer.GetSize());
-	memcpy(blob.data(), buffer.GetString(), buffer.GetSize());
+	serialize_state_blob(doc, binary_encoding, blob);
 	return true;
 }
 
 bool StateRecorder::Impl::serialize_descriptor_set_layout(Hash hash, const VkDescriptorSetLayoutCreateInfo &create_info,
                                                           vector<uint8_t> &blob) const
 {
-	Document doc;
-	doc.SetObject();
+	RecycledDocument scratch(document_buffer, document_buffer_size);
+	auto &doc = scratch.doc;
 	auto &alloc = doc.GetAllocator();
 
 	Value value;
@@ -12036,20 +12576,15 @@ bool StateRecorder::Impl::serialize_descriptor_set_layout(Hash hash, const VkDes
 	doc.AddMember("version", FOSSILIZE_FORMAT_VERSION, alloc);
 	doc.AddMember("setLayouts", layouts, alloc);
 
-	StringBuffer buffer;
-	CustomWriter writer(buffer);
-	doc.Accept(writer);
-
-	blob.resize(buffer.GetSize());
-	memcpy(blob.data(), buffer.GetString(), buffer.GetSize());
+	serialize_state_blob(doc, binary_encoding, blob);
 	return true;
 }
 
 bool StateRecorder::Impl::serialize_pipeline_layout(Hash hash, const VkPipelineLayoutCreateInfo &create_info,
                                                     vector<uint8_t> &blob) const
 {
-	Document doc;
-	doc.SetObject();
+	RecycledDocument scratch(document_buffer, document_buffer_size);
+	auto &doc = scratch.doc;
 	auto &alloc = doc.GetAllocator();
 
 	Value value;
@@ -12062,19 +12597,14 @@ bool StateRecorder::Impl::serialize_pipeline_layout(Hash hash, const VkPipelineL
 	doc.AddMember("version", FOSSILIZE_FORMAT_VERSION, alloc);
 	doc.AddMember("pipelineLayouts", layouts, alloc);
 
-	StringBuffer buffer;
-	CustomWriter writer(buffer);
-	doc.Accept(writer);
-
-	blob.resize(buffer.GetSize());
-	memcpy(blob.data(), buffer.GetString(), buffer.GetSize());
+	serialize_state_blob(doc, binary_encoding, blob);
 	return true;
 }
 
 bool StateRecorder::Impl::serialize_render_pass(Hash hash, const VkRenderPassCreateInfo &create_info, vector<uint8_t> &blob) const
 {
-	Document doc;
-	doc.SetObject();
+	RecycledDocument scratch(document_buffer, document_buffer_size);
+	auto &doc = scratch.doc;
 	auto &alloc = doc.GetAllocator();
 
 	Value value;
@@ -12087,19 +12617,14 @@ bool StateRecorder::Impl::serialize_render_pass(Hash hash, const VkRenderPassCre
 	doc.AddMember("version", FOSSILIZE_FORMAT_VERSION, alloc);
 	doc.AddMember("renderPasses", serialized_render_passes, alloc);
 
-	StringBuffer buffer;
-	CustomWriter writer(buffer);
-	doc.Accept(writer);
-
-	blob.resize(buffer.GetSize());
-	memcpy(blob.data(), buffer.GetString(), buffer.GetSize());
+	serialize_state_blob(doc, binary_encoding, blob);
 	return true;
 }
 
 bool StateRecorder::Impl::serialize_render_pass2(Hash hash, const VkRenderPassCreateInfo2 &create_info, vector<uint8_t> &blob) const
 {
-	Document doc;
-	doc.SetObject();
+	RecycledDocument scratch(document_buffer, document_buffer_size);
+	auto &doc = scratch.doc;
 	auto &alloc = doc.GetAllocator();
 
 	Value value;
@@ -12112,19 +12637,14 @@ bool StateRecorder::Impl::serialize_render_pass2(Hash hash, const VkRenderPassCr
 	doc.AddMember("version", FOSSILIZE_FORMAT_VERSION, alloc);
 	doc.AddMember("renderPasses2", serialized_render_passes, alloc);
 
-	StringBuffer buffer;
-	CustomWriter writer(buffer);
-	doc.Accept(writer);
-
-	blob.resize(buffer.GetSize());
-	memcpy(blob.data(), buffer.GetString(), buffer.GetSize());
+	serialize_state_blob(doc, binary_encoding, blob);
 	return true;
 }
 
 bool StateRecorder::Impl::serialize_graphics_pipeline(Hash hash, const VkGraphicsPipelineCreateInfo &create_info, vector<uint8_t> &blob) const
 {
-	Document doc;
-	doc.SetObject();
+	RecycledDocument scratch(document_buffer, document_buffer_size);
+	auto &doc = scratch.doc;
 	auto &alloc = doc.GetAllocator();
 
 	Value value;
@@ -12142,19 +12662,14 @@ bool StateRecorder::Impl::serialize_graphics_pipeline(Hash hash, const VkGraphic
 	doc.AddMember("version", FOSSILIZE_FORMAT_VERSION, alloc);
 	doc.AddMember("graphicsPipelines", serialized_graphics_pipelines, alloc);
 
-	StringBuffer buffer;
-	CustomWriter writer(buffer);
-	doc.Accept(writer);
-
-	blob.resize(buffer.GetSize());
-	memcpy(blob.data(), buffer.GetString(), buffer.GetSize());
+	serialize_state_blob(doc, binary_encoding, blob);
 	return true;
 }
 
 bool StateRecorder::Impl::serialize_compute_pipeline(Hash hash, const VkComputePipelineCreateInfo &create_info, vector<uint8_t> &blob) const
 {
-	Document doc;
-	doc.SetObject();
+	RecycledDocument scratch(document_buffer, document_buffer_size);
+	auto &doc = scratch.doc;
 	auto &alloc = doc.GetAllocator();
 
 	Value value;
@@ -12167,20 +12682,15 @@ bool StateRecorder::Impl::serialize_compute_pipeline(Hash hash, const VkComputeP
 	doc.AddMember("version", FOSSILIZE_FORMAT_VERSION, alloc);
 	doc.AddMember("computePipelines", serialized_compute_pipelines, alloc);
 
-	StringBuffer buffer;
-	CustomWriter writer(buffer);
-	doc.Accept(writer);
-
-	blob.resize(buffer.GetSize());
-	memcpy(blob.data(), buffer.GetString(), buffer.GetSize());
+	serialize_state_blob(doc, binary_encoding, blob);
 	return true;
 }
 
 bool StateRecorder::Impl::serialize_raytracing_pipeline(Hash hash, const VkRayTracingPipelineCreateInfoKHR &create_info,
                                                         std::vector<uint8_t> &blob) const
 {
-	Document doc;
-	doc.SetObject();
+	RecycledDocument scratch(document_buffer, document_buffer_size);
+	auto &doc = scratch.doc;
 	auto &alloc = doc.GetAllocator();
 
 	Value value;
@@ -12193,20 +12703,15 @@ bool StateRecorder::Impl::serialize_raytracing_pipeline(Hash hash, const VkRayTr
 	doc.AddMember("version", FOSSILIZE_FORMAT_VERSION, alloc);
 	doc.AddMember("raytracingPipelines", serialized_raytracing_pipelines, alloc);
 
-	StringBuffer buffer;
-	CustomWriter writer(buffer);
-	doc.Accept(writer);
-
-	blob.resize(buffer.GetSize());
-	memcpy(blob.data(), buffer.GetString(), buffer.GetSize());
+	serialize_state_blob(doc, binary_encoding, blob);
 	return true;
 }
 
 bool StateRecorder::Impl::serialize_shader_module(Hash hash, const VkShaderModuleCreateInfo &create_info,
                                                   vector<uint8_t> &blob, ScratchAllocator &blob_allocator) const
 {
-	Document doc;
-	doc.SetObject();
+	RecycledDocument scratch(document_buffer, document_buffer_size);
+	auto &doc = scratch.doc;
 	auto &alloc = doc.GetAllocator();
 
 	Value serialized_shader_modules(kObjectType);
@@ -12221,20 +12726,13 @@ bool StateRecorder::Impl::serialize_shader_module(Hash hash, const VkShaderModul
 	varint.AddMember("codeSize", uint64_t(create_info.codeSize), alloc);
 	varint.AddMember("flags", 0, alloc);
 
-	// Varint binary form, starts at offset 0 after the delim '\0' character.
+	// Varint binary form, starts at offset 0 of the payload after the document.
 	serialized_shader_modules.AddMember(uint64_string(hash, alloc), varint, alloc);
 
 	doc.AddMember("version", FOSSILIZE_FORMAT_VERSION, alloc);
 	doc.AddMember("shaderModules", serialized_shader_modules, alloc);
 
-	StringBuffer buffer;
-	CustomWriter writer(buffer);
-	doc.Accept(writer);
-
-	blob.resize(buffer.GetSize() + 1 + size);
-	memcpy(blob.data(), buffer.GetString(), buffer.GetSize());
-	blob[buffer.GetSize()] = '\0';
-	memcpy(blob.data() + buffer.GetSize() + 1, encoded, size);
+	serialize_state_blob(doc, binary_encoding, blob, encoded, size);
 	return true;
 }
 
@@ -24,6 +24,7 @@
 
 #include "vulkan/vulkan.h"
 #include <stddef.h>
+#include <vector>
 #include "fossilize_types.hpp"
 
 #if defined(__GNUC__)
@@ -156,6 +157,11 @@ public:
 	StateReplayer();
 	~StateReplayer();
 	bool parse(StateCreatorInterface &iface, DatabaseInterface *database, const void *buffer, size_t size) FOSSILIZE_WARN_UNUSED;
+	// Same as parse(), but the buffer may be modified, and its contents are undefined afterwards.
+	// JSON strings are then decoded in place instead of being copied.
+	// This requires the JSON to be '\0' terminated inside the buffer, which shader module blobs always are.
+	// Append a '\0' to other blobs and include it in size to benefit.
+	bool parse_in_place(StateCreatorInterface &iface, DatabaseInterface *database, void *buffer, size_t size) FOSSILIZE_WARN_UNUSED;
 
 	// Default is true. If true, the replayer will make sure the derivative pipeline handles provided to
 	// the API is a correct VkPipeline. If false, pipelines with VK_PIPELINE_CREATE_DERIVATIVE_BIT will have its basePipelineHandle
@@ -200,8 +206,17 @@ public:
 
 	// Call before init_recording_thread.
 	void set_database_enable_compression(bool enable);
+	// If compression is enabled, use LZ4 instead of deflate. Much cheaper on the recording thread,
+	// but the resulting archives can only be read by Fossilize versions which understand LZ4 payloads.
+	void set_database_enable_fast_compression(bool enable);
+	// Writes entries in a compact binary encoding instead of JSON text. It is much cheaper to parse when replaying,
+	// but can only be read by Fossilize versions which understand it. fossilize-convert-db translates between the two.
+	void set_database_enable_binary_encoding(bool enable);
 	void set_database_enable_checksum(bool enable);
 	void set_database_enable_application_feature_links(bool enable);
+	// Entries are written to the database in batches. Once the recording thread has been idle
+	// for this long, the database is flushed. Defaults to 1000 ms.
+	void set_database_flush_interval(uint32_t milliseconds);
 
 	// These methods should only be called at the very beginning of the application lifetime.
 	// It will affect the hash of all create info structures.
@@ -324,6 +339,11 @@ private:
 	Impl *impl;
 };
 
+// Re-encodes a blob written by StateRecorder either as JSON text or in the binary encoding,
+// see StateRecorder::set_database_enable_binary_encoding(). Either form is accepted as input.
+// Returns false if the blob does not decode to a JSON object, i.e. it is not a state blob.
+bool convert_state_blob(const void *blob, size_t size, bool binary, std::vector<uint8_t> &out) FOSSILIZE_WARN_UNUSED;
+
 namespace Hashing
 {
 // Computes a base hash which can be used to compute some other hashes without having to create a full StateRecorder.
@@ -30,6 +30,7 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <errno.h>
 #endif
 
 #include "fossilize_db.hpp"
@@ -37,12 +38,20 @@
 #include "path.hpp"
 #include "layer/utils.hpp"
 #include "miniz.h"
+#include "lz4_block.hpp"
+#include "crc32.hpp"
+#include "util/flat_hash_map.hpp"
+#include "util/bloom_filter.hpp"
 #include <unordered_map>
 #include <unordered_set>
 #include <algorithm>
 #include <memory>
 #include <mutex>
 #include <atomic>
+#include <thread>
+#include <condition_variable>
+#include <deque>
+#include <functional>
 #include <dirent.h>
 
 #include "fossilize_inttypes.h"
@@ -59,27 +68,6 @@ static_assert(FOSSILIZE_BLOB_HASH_LENGTH >= 32, "Blob hash length must be at lea
 
 namespace Fossilize
 {
-class ConditionalLockGuard
-{
-public:
-	ConditionalLockGuard(std::mutex &lock_, bool enable_)
-		: lock(lock_), enable(enable_)
-	{
-		if (enable)
-			lock.lock();
-	}
-
-	~ConditionalLockGuard()
-	{
-		if (enable)
-			lock.unlock();
-	}
-
-private:
-	std::mutex &lock;
-	bool enable;
-};
-
 struct PayloadHeader
 {
 	uint32_t payload_size;
@@ -88,13 +76,15 @@ struct PayloadHeader
 	uint32_t uncompressed_size;
 };
 
-struct ExportedMetadataBlock
+// For stream archives, each list is stored as an array of hashes,
+// immediately followed by a parallel array of payloads.
+// Lookups only have to touch the hash array until a match is found.
+struct ExportedMetadataPayload
 {
-	Hash hash;
 	uint64_t file_offset;
 	PayloadHeader payload;
 };
-static_assert(sizeof(ExportedMetadataBlock) % 8 == 0, "Alignment of ExportedMetadataBlock must be 8.");
+static_assert(sizeof(ExportedMetadataPayload) % 8 == 0, "Alignment of ExportedMetadataPayload must be 8.");
 
 // Encodes a unique list of hashes, so that we don't have to maintain per-process hashmaps
 // when replaying concurrent databases.
@@ -109,20 +99,142 @@ struct ExportedMetadataList
 static_assert(sizeof(ExportedMetadataList) % 8 == 0, "Alignment of ExportedMetadataList must be 8.");
 
 // Only for sanity checking when importing blobs, not a true file format.
-static const uint64_t ExportedMetadataMagic = 0xb10bf05511153ull;
-static const uint64_t ExportedMetadataMagicConcurrent = 0xb10b5f05511153ull;
+// Bump these whenever the layout of the exported metadata changes,
+// so that mismatched producers and consumers reject each other.
+static const uint64_t ExportedMetadataMagic = 0xb10bf05511156ull;
+static const uint64_t ExportedMetadataMagicConcurrent = 0xb10b5f05511156ull;
 
 struct ExportedMetadataHeader
 {
 	uint64_t magic;
 	uint64_t size;
 	ExportedMetadataList lists[RESOURCE_COUNT];
+	// Compression dictionaries of a stream archive. Same layout as the lists, but in no particular order.
+	ExportedMetadataList dictionaries;
+	// Only for concurrent metadata. BloomFilterBlocks covering the hashes of every list.
+	ExportedMetadataList filter;
 };
 static_assert(sizeof(ExportedMetadataHeader) % 8 == 0, "Alignment of ExportedMetadataHeader must be 8.");
 
+// Hashes in exported stream archive metadata are stored in Eytzinger (BFS) order rather than sorted order.
+// A binary search then walks the array front to back, the first levels of the tree
+// share cache lines, and the next levels can be prefetched ahead of time.
+// Node k (1-based) has children 2k and 2k + 1, and is stored at index k - 1.
+
+// Calls func(eytzinger_index, sorted_index) for every element.
+template <typename Func>
+static size_t build_eytzinger_order(size_t count, size_t k, size_t sorted_index, const Func &func)
+{
+	if (k <= count)
+	{
+		sorted_index = build_eytzinger_order(count, 2 * k, sorted_index, func);
+		func(k - 1, sorted_index++);
+		sorted_index = build_eytzinger_order(count, 2 * k + 1, sorted_index, func);
+	}
+	return sorted_index;
+}
+
+// Visits the elements in sorted order. Calls func(eytzinger_index).
+template <typename Func>
+static void traverse_eytzinger_in_order(size_t count, const Func &func)
+{
+	if (!count)
+		return;
+
+	// Start at the left-most node.
+	size_t k = 1;
+	while (2 * k <= count)
+		k = 2 * k;
+
+	while (k != 0)
+	{
+		func(k - 1);
+
+		if (2 * k + 1 <= count)
+		{
+			// Left-most node in the right sub-tree.
+			k = 2 * k + 1;
+			while (2 * k <= count)
+				k = 2 * k;
+		}
+		else
+		{
+			// Walk up until we come from a left child.
+			while (k & 1)
+				k >>= 1;
+			k >>= 1;
+		}
+	}
+}
+
+// Returns the index of hash in the array, or count if not found.
+static size_t find_eytzinger(const Hash *hashes, size_t count, Hash hash)
+{
+	size_t k = 1;
+	while (k <= count)
+	{
+#if defined(__GNUC__)
+		// Four levels down is 16 nodes, i.e. two cache lines. Prefetch the first one.
+		__builtin_prefetch(hashes + std::min(16 * k, count) - 1);
+#endif
+		k = 2 * k + size_t(hashes[k - 1] < hash);
+	}
+
+	// k now encodes the search path. Strip the right turns we made after the last left turn
+	// to find the lower bound.
+	while (k & 1)
+		k >>= 1;
+	k >>= 1;
+
+	if (k != 0 && hashes[k - 1] == hash)
+		return k - 1;
+	else
+		return count;
+}
+
 // Allow termination request if using the interface on a thread
 std::atomic<bool> shutdown_requested;
 
+// Runs func(index) for every index in [0, count) on a small pool of threads.
+// Archives are mostly I/O bound to prepare, so there is little point in going very wide.
+static void parallel_for(size_t count, const std::function<void (size_t)> &func)
+{
+	enum { MaxThreads = 8 };
+	size_t num_threads = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), MaxThreads);
+	num_threads = std::min(num_threads, count);
+
+	if (num_threads <= 1)
+	{
+		for (size_t i = 0; i < count; i++)
+			func(i);
+		return;
+	}
+
+	// Worker threads inherit logging setup from the calling thread.
+	auto level = get_thread_log_level();
+	auto cb = Internal::get_thread_log_callback();
+	auto userdata = Internal::get_thread_log_userdata();
+
+	std::atomic<size_t> next_index;
+	next_index.store(0, std::memory_order_relaxed);
+
+	std::vector<std::thread> threads;
+	threads.reserve(num_threads);
+	for (size_t i = 0; i < num_threads; i++)
+	{
+		threads.emplace_back([&]() {
+			set_thread_log_level(level);
+			set_thread_log_callback(cb, userdata);
+			size_t index;
+			while ((index = next_index.fetch_add(1, std::memory_order_relaxed)) < count)
+				func(index);
+		});
+	}
+
+	for (auto &thread : threads)
+		thread.join();
+}
+
 struct DatabaseInterface::Impl
 {
 	std::unique_ptr<DatabaseInterface> whitelist;
@@ -423,6 +535,21 @@ void DatabaseInterface::add_imported_metadata(const ExportedMetadataHeader *head
 	impl->imported_metadata.push_back(header);
 }
 
+bool DatabaseInterface::set_compression_dictionary(ResourceTag, const void *, size_t)
+{
+	return false;
+}
+
+bool DatabaseInterface::set_write_behind(unsigned, size_t)
+{
+	return false;
+}
+
+bool DatabaseInterface::get_statistics(DatabaseStatistics *)
+{
+	return false;
+}
+
 bool DatabaseInterface::set_bucket_path(const char *, const char *)
 {
 	return false;
@@ -432,6 +559,29 @@ void DatabaseInterface::set_bucket_info(const char *)
 {
 }
 
+bool DatabaseInterface::write_entries(const DatabaseWriteEntry *entries, size_t count)
+{
+	bool ret = true;
+	for (size_t i = 0; i < count; i++)
+		if (!write_entry(entries[i].tag, entries[i].hash, entries[i].buffer, entries[i].size, entries[i].flags))
+			ret = false;
+	return ret;
+}
+
+bool DatabaseInterface::write_index()
+{
+	return false;
+}
+
+void DatabaseInterface::prefetch(ResourceTag, const Hash *, size_t)
+{
+}
+
+bool DatabaseInterface::get_entry_range(ResourceTag, Hash, uint64_t *, uint64_t *)
+{
+	return false;
+}
+
 static size_t deduce_imported_size(const void *mapped, size_t maximum_size)
 {
 	size_t total_size = 0;
@@ -462,6 +612,12 @@ bool DatabaseInterface::Impl::parse_imported_metadata(const void *data_, size_t
 	auto *concurrent_header = reinterpret_cast<const ExportedMetadataHeader *>(data);
 	if (concurrent_header->magic == ExportedMetadataMagicConcurrent)
 	{
+		if (concurrent_header->size > size)
+			return false;
+		if (concurrent_header->filter.offset + concurrent_header->filter.count * sizeof(BloomFilterBlock) >
+		    concurrent_header->size)
+			return false;
+
 		data += concurrent_header->size;
 		size -= concurrent_header->size;
 	}
@@ -480,8 +636,10 @@ bool DatabaseInterface::Impl::parse_imported_metadata(const void *data_, size_t
 			return false;
 
 		for (auto &list : header->lists)
-			if (list.offset + list.count * sizeof(ExportedMetadataBlock) > size)
+			if (list.offset + list.count * (sizeof(Hash) + sizeof(ExportedMetadataPayload)) > size)
 				return false;
+		if (header->dictionaries.offset + header->dictionaries.count * (sizeof(Hash) + sizeof(ExportedMetadataPayload)) > size)
+			return false;
 
 		data += header->size;
 		size -= header->size;
@@ -554,6 +712,9 @@ bool DatabaseInterface::import_metadata_from_os_handle(intptr_t handle)
 #endif
 }
 
+// Entries are stored as <base>/<hh>/<tag>.<hash>.json, where hh are the first two hex digits of the hash,
+// so that no single directory ends up with hundreds of thousands of files.
+// Older databases put everything directly in <base>, and those entries are still found.
 struct DumbDirectoryDatabase : DatabaseInterface
 {
 	DumbDirectoryDatabase(const string &base, DatabaseMode mode_)
@@ -563,28 +724,196 @@ struct DumbDirectoryDatabase : DatabaseInterface
 			mode = DatabaseMode::OverWrite;
 	}
 
-	void flush() override
+	~DumbDirectoryDatabase()
 	{
+#ifndef _WIN32
+		if (base_fd >= 0)
+			close(base_fd);
+#endif
 	}
 
-	bool overwrite_db_clear()
+	enum { ShardCount = 256 };
+
+	enum EntryLocation : uint8_t
+	{
+		LocationFlat = 0,
+		LocationSharded = 1
+	};
+
+	struct ListedEntry
+	{
+		unsigned tag;
+		Hash hash;
+	};
+
+	bool flush() override
+	{
+		return true;
+	}
+
+	static bool parse_entry_name(const char *name, ListedEntry &entry)
+	{
+		uint64_t value;
+		if (sscanf(name, "%x.%" SCNx64 ".json", &entry.tag, &value) != 2)
+			return false;
+		entry.hash = value;
+		return entry.tag < RESOURCE_COUNT;
+	}
+
+	static bool parse_shard_name(const char *name, unsigned &shard)
+	{
+		return strlen(name) == 2 && isxdigit(uint8_t(name[0])) && isxdigit(uint8_t(name[1])) &&
+		       sscanf(name, "%2x", &shard) == 1;
+	}
+
+	static unsigned get_shard(Hash hash)
+	{
+		return unsigned(hash >> 56);
+	}
+
+	// Path of an entry relative to the base directory.
+	static void format_entry_path(char (&path)[28], ResourceTag tag, Hash hash, EntryLocation location)
+	{
+		if (location == LocationSharded)
+			sprintf(path, "%02x/%02x.%016" PRIx64 ".json", get_shard(hash), static_cast<unsigned>(tag), hash);
+		else
+			sprintf(path, "%02x.%016" PRIx64 ".json", static_cast<unsigned>(tag), hash);
+	}
+
+	// Everything is opened relative to a directory handle we hold on to,
+	// so the kernel does not have to walk the full path for every entry.
+	bool open_base_directory()
+	{
+#ifndef _WIN32
+		if (base_fd < 0)
+			base_fd = open(base_directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		return base_fd >= 0;
+#else
+		return Path::is_directory(base_directory);
+#endif
+	}
+
+	DIR *open_directory(const char *relpath) const
+	{
+#ifndef _WIN32
+		int fd = openat(base_fd, relpath, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (fd < 0)
+			return nullptr;
+		DIR *dp = fdopendir(fd);
+		if (!dp)
+			close(fd);
+		return dp;
+#else
+		return opendir(Path::join(base_directory, relpath).c_str());
+#endif
+	}
+
+	FILE *open_file(const char *relpath, bool write) const
+	{
+#ifndef _WIN32
+		int fd = write ?
+		         openat(base_fd, relpath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644) :
+		         openat(base_fd, relpath, O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+			return nullptr;
+		FILE *file = fdopen(fd, write ? "wb" : "rb");
+		if (!file)
+			close(fd);
+		return file;
+#else
+		return fopen(Path::join(base_directory, relpath).c_str(), write ? "wb" : "rb");
+#endif
+	}
+
+	bool remove_file(const char *relpath) const
+	{
+#ifndef _WIN32
+		return unlinkat(base_fd, relpath, 0) == 0;
+#else
+		return remove(Path::join(base_directory, relpath).c_str()) == 0;
+#endif
+	}
+
+	bool create_shard_directory(unsigned shard)
+	{
+		if (created_shards[shard])
+			return true;
+
+		char name[3];
+		sprintf(name, "%02x", shard);
+#ifndef _WIN32
+		if (mkdirat(base_fd, name, 0755) != 0 && errno != EEXIST)
+			return false;
+#else
+		if (!Path::mkdir(Path::join(base_directory, name)))
+			return false;
+#endif
+		created_shards[shard] = true;
+		return true;
+	}
+
+	// Lists the entries in a directory relative to the base directory, and the shard directories if requested.
+	bool list_directory(const char *relpath, std::vector<ListedEntry> &entries, std::vector<unsigned> *shards) const
 	{
-		DIR *dp = opendir(base_directory.c_str());
+		DIR *dp = open_directory(relpath);
 		if (!dp)
 			return false;
 
-		dirent *next_file;
+		while (auto *pEntry = readdir(dp))
+		{
+			if (shutdown_requested.load(std::memory_order_relaxed))
+			{
+				closedir(dp);
+				return false;
+			}
+
+			unsigned shard;
+			ListedEntry entry;
+			if (shards && (pEntry->d_type == DT_DIR || pEntry->d_type == DT_UNKNOWN) &&
+			    parse_shard_name(pEntry->d_name, shard))
+			{
+				shards->push_back(shard);
+			}
+			else if (pEntry->d_type == DT_REG && parse_entry_name(pEntry->d_name, entry))
+				entries.push_back(entry);
+		}
+
+		closedir(dp);
+		return true;
+	}
+
+	bool overwrite_db_clear()
+	{
+		std::vector<ListedEntry> entries;
+		std::vector<unsigned> shards;
+		if (!list_directory(".", entries, &shards))
+			return false;
 
-		while ((next_file = readdir(dp)) != nullptr)
+		for (auto &entry : entries)
 		{
-			if (strcmp(Path::ext(next_file->d_name).c_str(), "json") != 0)
-				continue;
+			char path[28];
+			format_entry_path(path, ResourceTag(entry.tag), entry.hash, LocationFlat);
+			if (!remove_file(path))
+				return false;
+		}
 
-			if (remove(Path::join(base_directory, next_file->d_name).c_str()) != 0)
+		for (unsigned shard : shards)
+		{
+			char name[3];
+			sprintf(name, "%02x", shard);
+			entries.clear();
+			if (!list_directory(name, entries, nullptr))
 				return false;
+
+			for (auto &entry : entries)
+			{
+				char path[28];
+				format_entry_path(path, ResourceTag(entry.tag), entry.hash, LocationSharded);
+				if (!remove_file(path))
+					return false;
+			}
 		}
 
-		closedir(dp);
 		return true;
 	}
 
@@ -592,37 +921,48 @@ struct DumbDirectoryDatabase : DatabaseInterface
 	{
 		if (mode == DatabaseMode::OverWrite)
 		{
-			if (!Path::mkdir(base_directory) || (impl->overwrite_db_clear && !overwrite_db_clear()))
+			if (!Path::mkdir(base_directory) || !open_base_directory() ||
+			    (impl->overwrite_db_clear && !overwrite_db_clear()))
 				return false;
 
 			return true;
 		}
 
-		DIR *dp = opendir(base_directory.c_str());
-		if (!dp)
+		if (!open_base_directory())
 			return false;
 
-		while (auto *pEntry = readdir(dp))
-		{
-			if (shutdown_requested.load(std::memory_order_relaxed))
-				return false;
+		std::vector<ListedEntry> flat_entries;
+		std::vector<unsigned> shards;
+		if (!list_directory(".", flat_entries, &shards))
+			return false;
 
-			if (pEntry->d_type != DT_REG)
-				continue;
+		// Listing is mostly waiting on the filesystem, so list the shards in parallel.
+		std::vector<std::vector<ListedEntry>> shard_entries(shards.size());
+		std::vector<uint8_t> listed(shards.size());
+		parallel_for(shards.size(), [&](size_t index) {
+			char name[3];
+			sprintf(name, "%02x", shards[index]);
+			listed[index] = list_directory(name, shard_entries[index], nullptr);
+		});
 
-			unsigned tag;
-			uint64_t value;
-			if (sscanf(pEntry->d_name, "%x.%" SCNx64 ".json", &tag, &value) != 2)
-				continue;
+		if (std::find(listed.begin(), listed.end(), 0) != listed.end())
+			return false;
 
-			if (tag >= RESOURCE_COUNT)
-				continue;
+		const auto add_entry = [this](const ListedEntry &entry, EntryLocation location) {
+			if (test_resource_filter(static_cast<ResourceTag>(entry.tag), entry.hash))
+				seen_blobs[entry.tag].emplace(entry.hash, location);
+		};
 
-			if (test_resource_filter(static_cast<ResourceTag>(tag), value))
-				seen_blobs[tag].insert(value);
+		for (unsigned i = 0; i < shards.size(); i++)
+		{
+			created_shards[shards[i]] = true;
+			for (auto &entry : shard_entries[i])
+				add_entry(entry, LocationSharded);
 		}
 
-		closedir(dp);
+		for (auto &entry : flat_entries)
+			add_entry(entry, LocationFlat);
+
 		return true;
 	}
 
@@ -641,27 +981,30 @@ struct DumbDirectoryDatabase : DatabaseInterface
 		if (mode != DatabaseMode::ReadOnly)
 			return false;
 
-		if (!has_entry(tag, hash))
+		if (!test_resource_filter(tag, hash))
+			return false;
+
+		const EntryLocation *location = seen_blobs[tag].find(hash);
+		if (!location)
 			return false;
 
 		if (!blob_size)
 			return false;
 
-		char filename[25]; // 2 digits + "." + 16 digits + ".json" + null
-		sprintf(filename, "%02x.%016" PRIx64 ".json", static_cast<unsigned>(tag), hash);
-		auto path = Path::join(base_directory, filename);
+		char path[28];
+		format_entry_path(path, tag, hash, *location);
 
-		FILE *file = fopen(path.c_str(), "rb");
+		FILE *file = open_file(path, false);
 		if (!file)
 		{
-			LOGE_LEVEL("Failed to open file: %s\n", path.c_str());
+			LOGE_LEVEL("Failed to open file: %s/%s\n", base_directory.c_str(), path);
 			return false;
 		}
 
 		if (fseek(file, 0, SEEK_END) < 0)
 		{
 			fclose(file);
-			LOGE_LEVEL("Failed to seek in file: %s\n", path.c_str());
+			LOGE_LEVEL("Failed to seek in file: %s/%s\n", base_directory.c_str(), path);
 			return false;
 		}
 
@@ -699,14 +1042,19 @@ struct DumbDirectoryDatabase : DatabaseInterface
 		if (has_entry(tag, hash))
 			return true;
 
-		char filename[25]; // 2 digits + "." + 16 digits + ".json" + null
-		sprintf(filename, "%02x.%016" PRIx64 ".json", static_cast<unsigned>(tag), hash);
-		auto path = Path::join(base_directory, filename);
+		if (!create_shard_directory(get_shard(hash)))
+		{
+			LOGE_LEVEL("Failed to create shard directory in %s.\n", base_directory.c_str());
+			return false;
+		}
+
+		char path[28];
+		format_entry_path(path, tag, hash, LocationSharded);
 
-		FILE *file = fopen(path.c_str(), "wb");
+		FILE *file = open_file(path, true);
 		if (!file)
 		{
-			LOGE_LEVEL("Failed to write serialized state to disk (%s).\n", path.c_str());
+			LOGE_LEVEL("Failed to write serialized state to disk (%s/%s).\n", base_directory.c_str(), path);
 			return false;
 		}
 
@@ -718,6 +1066,7 @@ struct DumbDirectoryDatabase : DatabaseInterface
 		}
 
 		fclose(file);
+		seen_blobs[tag].emplace(hash, LocationSharded);
 		return true;
 	}
 
@@ -735,8 +1084,9 @@ struct DumbDirectoryDatabase : DatabaseInterface
 		if (hashes)
 		{
 			Hash *iter = hashes;
-			for (auto &blob : seen_blobs[tag])
-				*iter++ = blob;
+			seen_blobs[tag].for_each([&](Hash hash, EntryLocation) {
+				*iter++ = hash;
+			});
 
 			// Make replay more deterministic.
 			sort(hashes, hashes + size);
@@ -754,7 +1104,12 @@ struct DumbDirectoryDatabase : DatabaseInterface
 
 	string base_directory;
 	DatabaseMode mode;
-	unordered_set<Hash> seen_blobs[RESOURCE_COUNT];
+	// The enumeration of the directory tree from prepare(), kept up to date as we write.
+	FlatHashMap<EntryLocation> seen_blobs[RESOURCE_COUNT];
+	bool created_shards[ShardCount] = {};
+#ifndef _WIN32
+	int base_fd = -1;
+#endif
 };
 
 DatabaseInterface *create_dumb_folder_database(const char *directory_path, DatabaseMode mode)
@@ -763,8 +1118,66 @@ DatabaseInterface *create_dumb_folder_database(const char *directory_path, Datab
 	return db;
 }
 
+// Reads from an absolute offset without touching the file position, so any number of threads can read at once.
+static bool read_file_range(FILE *file, void *data, uint64_t offset, size_t size)
+{
+	auto *ptr = static_cast<uint8_t *>(data);
+
+#ifdef _WIN32
+	HANDLE file_handle = reinterpret_cast<HANDLE>(_get_osfhandle(_fileno(file)));
+	if (file_handle == INVALID_HANDLE_VALUE)
+		return false;
+
+	while (size)
+	{
+		// For a synchronous handle, the read starts at the given offset and completes before returning.
+		OVERLAPPED overlapped = {};
+		overlapped.Offset = DWORD(offset);
+		overlapped.OffsetHigh = DWORD(offset >> 32);
+		DWORD to_read = DWORD(std::min<size_t>(size, 1u << 30));
+		DWORD did_read = 0;
+		if (!ReadFile(file_handle, ptr, to_read, &did_read, &overlapped) || did_read == 0)
+			return false;
+
+		ptr += did_read;
+		offset += did_read;
+		size -= did_read;
+	}
+#else
+	int fd = fileno(file);
+	while (size)
+	{
+		ssize_t did_read = pread(fd, ptr, size, off_t(offset));
+		if (did_read < 0 && errno == EINTR)
+			continue;
+		if (did_read <= 0)
+			return false;
+
+		ptr += did_read;
+		offset += size_t(did_read);
+		size -= size_t(did_read);
+	}
+#endif
+
+	return true;
+}
+
 struct ZipDatabase : DatabaseInterface
 {
+	enum { LocalHeaderSize = 30 };
+	enum : uint32_t { LocalHeaderSignature = 0x04034b50 };
+
+	struct Entry
+	{
+		unsigned index;
+		size_t size;
+		uint64_t local_header_offset;
+		uint64_t compressed_size;
+		uint32_t crc;
+		uint16_t method;
+		bool supported;
+	};
+
 	ZipDatabase(const string &path_, DatabaseMode mode_)
 		: DatabaseInterface(mode_), path(path_), mode(mode_)
 	{
@@ -775,21 +1188,22 @@ struct ZipDatabase : DatabaseInterface
 
 	~ZipDatabase()
 	{
-		if (alive)
+		if (alive && mode != DatabaseMode::ReadOnly)
 		{
-			if (mode != DatabaseMode::ReadOnly)
-			{
-				if (!mz_zip_writer_finalize_archive(&mz))
-					LOGE_LEVEL("Failed to finalize archive.\n");
-			}
+			if (!mz_zip_writer_finalize_archive(&mz))
+				LOGE_LEVEL("Failed to finalize archive.\n");
 
 			if (!mz_zip_end(&mz))
 				LOGE_LEVEL("mz_zip_end failed!\n");
 		}
+
+		if (file)
+			fclose(file);
 	}
 
-	void flush() override
+	bool flush() override
 	{
+		return true;
 	}
 
 	static bool string_is_hex(const char *str)
@@ -841,8 +1255,35 @@ struct ZipDatabase : DatabaseInterface
 					continue;
 				uint64_t value = strtoull(value_str, nullptr, 16);
 
-				if (test_resource_filter(static_cast<ResourceTag>(tag), value))
-					seen_blobs[tag].emplace(value, Entry{i, size_t(s.m_uncomp_size)});
+				if (!test_resource_filter(static_cast<ResourceTag>(tag), value))
+					continue;
+
+				Entry entry = {};
+				entry.index = i;
+				entry.size = size_t(s.m_uncomp_size);
+				entry.local_header_offset = s.m_local_header_ofs;
+				entry.compressed_size = s.m_comp_size;
+				entry.crc = s.m_crc32;
+				entry.method = s.m_method;
+				entry.supported = s.m_is_supported && !s.m_is_encrypted &&
+				                  (s.m_method == 0 || s.m_method == MZ_DEFLATED);
+				seen_blobs[tag].emplace(value, entry);
+			}
+
+			if (mode == DatabaseMode::ReadOnly)
+			{
+				// Everything needed to extract an entry is now in seen_blobs,
+				// so reads go straight to the file instead of through the shared miniz reader.
+				mz_zip_reader_end(&mz);
+				file = fopen(path.c_str(), "rb");
+				if (!file)
+				{
+					LOGE_LEVEL("Failed to open ZIP archive for reading.\n");
+					return false;
+				}
+
+				alive = true;
+				return true;
 			}
 
 			// In-place update the archive. Should we consider emitting a new archive instead?
@@ -893,7 +1334,7 @@ struct ZipDatabase : DatabaseInterface
 
 		if (blob)
 		{
-			if (!mz_zip_reader_extract_to_mem(&mz, itr->second.index, blob, itr->second.size, 0))
+			if (!extract_entry(itr->second, blob))
 			{
 				LOGE_LEVEL("Failed to extract blob.\n");
 				return false;
@@ -903,26 +1344,76 @@ struct ZipDatabase : DatabaseInterface
 		return true;
 	}
 
-	bool write_entry(ResourceTag tag, Hash hash, const void *blob, size_t size, PayloadWriteFlags flags) override
+	// Locates the entry data through its local header and inflates it.
+	// Only positional reads and per-call state are used, so this is safe to call concurrently.
+	bool extract_entry(const Entry &entry, void *blob)
 	{
-		if ((flags & PAYLOAD_WRITE_RAW_FOSSILIZE_DB_BIT) != 0)
+		if (!entry.supported)
 			return false;
 
-		if (!alive || mode == DatabaseMode::ReadOnly)
+		uint8_t local_header[LocalHeaderSize];
+		if (!read_file_range(file, local_header, entry.local_header_offset, LocalHeaderSize))
 			return false;
 
-		auto itr = seen_blobs[tag].find(hash);
-		if (itr != end(seen_blobs[tag]))
-			return true;
+		uint32_t signature = local_header[0] | (local_header[1] << 8) |
+		                     (local_header[2] << 16) | (uint32_t(local_header[3]) << 24);
+		if (signature != LocalHeaderSignature)
+			return false;
 
-		char str[FOSSILIZE_BLOB_HASH_LENGTH + 1]; // 40 digits + null
-		sprintf(str, "%0*x", FOSSILIZE_BLOB_HASH_LENGTH - 16, tag);
-		sprintf(str + FOSSILIZE_BLOB_HASH_LENGTH - 16, "%016" PRIx64, hash);
+		unsigned name_size = local_header[26] | (local_header[27] << 8);
+		unsigned extra_size = local_header[28] | (local_header[29] << 8);
+		uint64_t data_offset = entry.local_header_offset + LocalHeaderSize + name_size + extra_size;
 
-		unsigned mz_flags;
-		if ((flags & PAYLOAD_WRITE_COMPRESS_BIT) != 0)
+		if (entry.method == 0)
 		{
-			if ((flags & PAYLOAD_WRITE_BEST_COMPRESSION_BIT) != 0)
+			if (entry.compressed_size != entry.size)
+				return false;
+			if (!read_file_range(file, blob, data_offset, entry.size))
+				return false;
+		}
+		else
+		{
+			if (uint64_t(size_t(entry.compressed_size)) != entry.compressed_size)
+				return false;
+
+			static thread_local std::vector<uint8_t> compressed_buffer;
+			size_t compressed_size = size_t(entry.compressed_size);
+			if (compressed_buffer.size() < compressed_size)
+				compressed_buffer.resize(compressed_size);
+
+			if (!read_file_range(file, compressed_buffer.data(), data_offset, compressed_size))
+				return false;
+
+			size_t decoded_size = tinfl_decompress_mem_to_mem(blob, entry.size,
+			                                                  compressed_buffer.data(), compressed_size,
+			                                                  TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF);
+			if (decoded_size != entry.size)
+				return false;
+		}
+
+		return compute_crc32(0, blob, entry.size) == entry.crc;
+	}
+
+	bool write_entry(ResourceTag tag, Hash hash, const void *blob, size_t size, PayloadWriteFlags flags) override
+	{
+		if ((flags & PAYLOAD_WRITE_RAW_FOSSILIZE_DB_BIT) != 0)
+			return false;
+
+		if (!alive || mode == DatabaseMode::ReadOnly)
+			return false;
+
+		auto itr = seen_blobs[tag].find(hash);
+		if (itr != end(seen_blobs[tag]))
+			return true;
+
+		char str[FOSSILIZE_BLOB_HASH_LENGTH + 1]; // 40 digits + null
+		sprintf(str, "%0*x", FOSSILIZE_BLOB_HASH_LENGTH - 16, tag);
+		sprintf(str + FOSSILIZE_BLOB_HASH_LENGTH - 16, "%016" PRIx64, hash);
+
+		unsigned mz_flags;
+		if ((flags & PAYLOAD_WRITE_COMPRESS_BIT) != 0)
+		{
+			if ((flags & PAYLOAD_WRITE_BEST_COMPRESSION_BIT) != 0)
 				mz_flags = MZ_BEST_COMPRESSION;
 			else
 				mz_flags = MZ_BEST_SPEED;
@@ -938,7 +1429,7 @@ struct ZipDatabase : DatabaseInterface
 
 		// The index is irrelevant, we're not going to read from this archive any time soon.
 		if (test_resource_filter(static_cast<ResourceTag>(tag), hash))
-			seen_blobs[tag].emplace(hash, Entry{~0u, size});
+			seen_blobs[tag].emplace(hash, Entry{~0u, size, 0, 0, 0, 0, false});
 		return true;
 	}
 
@@ -982,12 +1473,9 @@ struct ZipDatabase : DatabaseInterface
 
 	string path;
 	mz_zip_archive mz;
+	// Only used in ReadOnly mode.
+	FILE *file = nullptr;
 
-	struct Entry
-	{
-		unsigned index;
-		size_t size;
-	};
 
 	unordered_map<Hash, Entry> seen_blobs[RESOURCE_COUNT];
 	DatabaseMode mode;
@@ -1014,7 +1502,8 @@ DatabaseInterface *create_zip_archive_database(const char *path, DatabaseMode mo
  * unused1         uint8_t        Currently unused. Must be zero.
  * unused2         uint8_t        Currently unused. Must be zero.
  * unused3         uint8_t        Currently unused. Must be zero.
- * version         uint8_t        StreamArchive version: 6
+ * version         uint8_t        StreamArchive version: 6, 7 if any entry uses LZ4 compression,
+ *                                or 8 if the archive contains compression dictionaries.
  *
  *
  * Each entry follows this format:
@@ -1032,12 +1521,65 @@ DatabaseInterface *create_zip_archive_database(const char *path, DatabaseMode mo
  * The flags field must contain one of:
  *     0x1: No compression.
  *     0x2: Deflate compression.
+ *     0x3: LZ4 block compression. Only valid in version 7 archives.
+ *     0x4: LZ4 block compression against a dictionary. Only valid in version 8 archives.
+ *          The payload starts with the uint64_t hash of the dictionary entry, followed by the LZ4 block.
+ *          The dictionary is treated as if it immediately preceded the decompressed data.
  *
  * Entries should have a unique tag and hash combination. Implementations may
  * ignore duplicated tag and hash combinations.
  *
  * It is acceptable for the last entry to be truncated. In this case, that
  * entry should be ignored.
+ *
+ * Entries with a tag which is not understood by the implementation must be ignored.
+ *
+ * Compression dictionaries use tag 0x10001, and the hash of the dictionary contents as hash.
+ * They are stored uncompressed. Entries can only refer to dictionaries within the same archive.
+ *
+ * Optionally, the very last entry in the file can be an index which describes every other entry,
+ * so that readers do not have to scan through the entire archive.
+ * The index entry uses tag 0x10000 and hash 0, and is stored uncompressed with a checksum.
+ * The index is only valid if it is the last entry in the file.
+ *
+ * When entries are appended to an archive which ends with an index, the index is left in place,
+ * and the new entries are sealed by a segment index (version 3) at the new end of the file.
+ * A segment index only describes the entries between the end of the previous index and itself,
+ * so readers follow the chain of segment indices back until they reach a full index or the start of the archive.
+ * If the chain is broken, e.g. because the last session never sealed its entries,
+ * readers may still use the last complete chain and only scan the entries after it.
+ * The index payload is as follows:
+ *
+ * Field           Type                              Description
+ * -----           ----                              -----------
+ * tag_count       uint32_t                          Number of tags described by the index.
+ * dict_count      uint32_t                          Number of compression dictionaries. Must be zero in version 1.
+ * record_count    uint64_t[tag_count]               Number of records for each tag.
+ * records         record[sum(record_count)]         Records for tag 0, followed by tag 1, etc. Sorted by hash within a tag.
+ * dict_records    record[dict_count]                Records for the compression dictionaries.
+ * segment_offset  uint64_t                          Only in version 3. File offset where the previous index ends,
+ *                                                   or where the first entry begins if there is none.
+ * footer          footer                            See below.
+ *
+ * Each record is as follows:
+ *
+ * Field           Type                              Description
+ * -----           ----                              -----------
+ * hash            uint64_t                          Hash of the entry.
+ * offset          uint64_t                          File offset of the entry payload.
+ * stored_size     uint32_t                          Same as stored_size in the entry.
+ * flags           uint32_t                          Same as flags in the entry.
+ * crc32           uint32_t                          Same as crc32 in the entry.
+ * payload_size    uint32_t                          Same as payload_size in the entry.
+ *
+ * The footer is placed at the very end of the file:
+ *
+ * Field           Type                              Description
+ * -----           ----                              -----------
+ * index_offset    uint64_t                          File offset of the index entry itself (its tag field).
+ * version         uint32_t                          Index version: 1, or 2 if dict_count is not zero. 3 for a segment index.
+ * reserved        uint32_t                          Currently unused. Must be zero.
+ * magic           uint8_t[8]                        Constant value: "FOZINDEX"
  */
 
 static const uint8_t stream_reference_magic_and_version[16] = {
@@ -1048,10 +1590,41 @@ static const uint8_t stream_reference_magic_and_version[16] = {
 	FOSSILIZE_FORMAT_VERSION,
 };
 
+// Archives are only bumped to this version once they contain LZ4 payloads.
+// Readers which predate LZ4 then reject the archive up front instead of failing on individual entries,
+// while archives without LZ4 payloads remain readable by them.
+// The same goes for dictionaries.
+enum { FOSSILIZE_FORMAT_LZ4_VERSION = 7, FOSSILIZE_FORMAT_DICTIONARY_VERSION = 8 };
+static_assert(int(FOSSILIZE_FORMAT_LZ4_VERSION) > int(FOSSILIZE_FORMAT_VERSION), "LZ4 archive version must be newer than the base version.");
+
+static const uint8_t stream_index_magic[8] = {
+	'F', 'O', 'Z', 'I',
+	'N', 'D', 'E', 'X',
+};
+
 struct StreamArchive : DatabaseInterface
 {
 	enum { MagicSize = sizeof(stream_reference_magic_and_version) };
-	enum { FOSSILIZE_COMPRESSION_NONE = 1, FOSSILIZE_COMPRESSION_DEFLATE = 2 };
+	enum
+	{
+		FOSSILIZE_COMPRESSION_NONE = 1,
+		FOSSILIZE_COMPRESSION_DEFLATE = 2,
+		FOSSILIZE_COMPRESSION_LZ4 = 3,
+		FOSSILIZE_COMPRESSION_LZ4_DICTIONARY = 4
+	};
+	enum
+	{
+		IndexTag = 0x10000,
+		IndexVersion = 1,
+		IndexVersionDictionaries = 2,
+		IndexVersionSegment = 3,
+		IndexRecordSize = 32,
+		IndexFooterSize = 24,
+		IndexSegmentOffsetSize = 8
+	};
+	// How far back from the end of an Append archive we look for the last sealed segment.
+	enum { SegmentSearchLimit = 16 * 1024 * 1024 };
+	enum { DictionaryTag = 0x10001 };
 
 	struct PayloadHeaderRaw
 	{
@@ -1064,6 +1637,14 @@ struct StreamArchive : DatabaseInterface
 		PayloadHeader header;
 	};
 
+	// In ReadOnly mode, only the data of the dictionaries is needed.
+	// When writing, the dictionaries set for a tag are also prepared for compression.
+	struct CompressionDictionary
+	{
+		Hash id;
+		LZ4Dictionary dict;
+	};
+
 	StreamArchive(const string &path_, DatabaseMode mode_)
 		: DatabaseInterface(mode_), path(path_), mode(mode_)
 	{
@@ -1071,15 +1652,34 @@ struct StreamArchive : DatabaseInterface
 
 	~StreamArchive()
 	{
+		stop_write_behind();
+
+		// Seal what this session appended, so the next prepare() does not have to scan it.
+		if (alive && seal_on_close && wrote_entries && !index_truncate_pending)
+			write_index();
+
 		free(zlib_buffer);
+		unmap_file();
 		if (file)
 			fclose(file);
 	}
 
-	void flush() override
+	bool flush() override
 	{
-		if (file && mode != DatabaseMode::ReadOnly)
-			fflush(file);
+		bool ret = sync_write_behind();
+		if (file && mode != DatabaseMode::ReadOnly && fflush(file) != 0)
+			ret = false;
+		return ret;
+	}
+
+	bool set_write_behind(unsigned worker_count, size_t max_in_flight_bytes) override
+	{
+		if (alive || mode == DatabaseMode::ReadOnly)
+			return false;
+
+		write_behind_worker_count = worker_count;
+		write_behind_max_in_flight_bytes = max_in_flight_bytes;
+		return true;
 	}
 
 	bool prepare() override
@@ -1179,12 +1779,34 @@ struct StreamArchive : DatabaseInterface
 				if (memcmp(magic, stream_reference_magic_and_version, MagicSize - 1))
 					return false;
 				int version = magic[MagicSize - 1];
-				if (version > FOSSILIZE_FORMAT_VERSION || version < FOSSILIZE_FORMAT_MIN_COMPAT_VERSION)
+				if (version > FOSSILIZE_FORMAT_DICTIONARY_VERSION || version < FOSSILIZE_FORMAT_MIN_COMPAT_VERSION)
 					return false;
+				archive_version = version;
 
 				size_t offset = MagicSize;
 				size_t begin_append_offset = len;
 
+				// If the archive ends with a valid index, we don't have to scan through the archive.
+				// Indices are kept when appending, and new entries are covered by a segment chained to them.
+				if (supports_index())
+				{
+					if (load_index_chain(len))
+					{
+						offset = len;
+						segment_offset = len;
+					}
+					else if (mode == DatabaseMode::Append && find_last_sealed_segment(len, offset))
+					{
+						// The last session did not seal its segment. Only the entries it wrote need to be scanned.
+						LOGW_LEVEL("Archive was not sealed, scanning the last segment.\n");
+						segment_offset = offset;
+						if (fseek(file, offset, SEEK_SET) < 0)
+							return false;
+					}
+					else if (fseek(file, offset, SEEK_SET) < 0)
+						return false;
+				}
+
 				while (offset < len)
 				{
 					if (shutdown_requested.load(std::memory_order_relaxed))
@@ -1229,17 +1851,19 @@ struct StreamArchive : DatabaseInterface
 						Entry entry = fill_entry(header, offset);
 						if (test_resource_filter(static_cast<ResourceTag>(tag), value))
 							seen_blobs[tag].emplace(value, entry);
+						else
+							index_is_complete = false;
 					}
+					else if (tag == DictionaryTag)
+						dictionary_entries.emplace(strtoull(value_str, nullptr, 16), fill_entry(header, offset));
 
 					if (!move_offset_through_header_size(header, offset))
 						return false;
 				}
 
-				if (mode == DatabaseMode::Append && offset != len)
-				{
-					if (fseek(file, begin_append_offset, SEEK_SET) < 0)
-						return false;
-				}
+				write_offset = offset != len ? begin_append_offset : len;
+				if (mode == DatabaseMode::Append && fseek(file, write_offset, SEEK_SET) < 0)
+					return false;
 			}
 			else
 			{
@@ -1247,6 +1871,7 @@ struct StreamArchive : DatabaseInterface
 				if (fwrite(stream_reference_magic_and_version, 1,
 				           sizeof(stream_reference_magic_and_version), file) != sizeof(stream_reference_magic_and_version))
 					return false;
+				write_offset = MagicSize;
 			}
 		}
 		else
@@ -1256,230 +1881,1608 @@ struct StreamArchive : DatabaseInterface
 			{
 				return false;
 			}
+			write_offset = MagicSize;
 		}
 
+		if (mode == DatabaseMode::ReadOnly)
+			map_file();
+
+		load_dictionaries();
+
+		seal_on_close = mode == DatabaseMode::Append && supports_index();
 		alive = true;
+
+		if (write_behind_worker_count && mode != DatabaseMode::ReadOnly)
+			start_write_behind();
+
 		return true;
 	}
 
-	static bool find_entry_from_metadata(const ExportedMetadataHeader *header, ResourceTag tag, Hash hash, Entry *entry)
+	// In read-only mode, we try to map the entire archive into memory.
+	// Payloads can then be copied or decompressed straight from the mapping,
+	// and concurrent readers never have to serialize on a shared FILE position.
+	// If mapping fails for whatever reason, we silently fall back to stdio.
+	void map_file()
 	{
-		size_t count = header->lists[tag].count;
-		if (!count)
-			return false;
+		// Very large archives might not fit in the address space of a 32-bit process.
+		if (sizeof(void *) < 8)
+			return;
 
-		// Binary search in-place.
-		auto *blocks = reinterpret_cast<const ExportedMetadataBlock *>(
-				reinterpret_cast<const uint8_t *>(header) + header->lists[tag].offset);
+#ifdef _WIN32
+		HANDLE file_handle = reinterpret_cast<HANDLE>(_get_osfhandle(_fileno(file)));
+		if (file_handle == INVALID_HANDLE_VALUE)
+			return;
 
-		auto itr = std::lower_bound(blocks, blocks + count, hash, [](const ExportedMetadataBlock &a, Hash hash_) {
-			return a.hash < hash_;
-		});
+		LARGE_INTEGER size;
+		if (!GetFileSizeEx(file_handle, &size) || size.QuadPart == 0)
+			return;
 
-		if (itr != blocks + count && itr->hash == hash)
-		{
-			if (entry)
-			{
-				entry->offset = itr->file_offset;
-				entry->header = itr->payload;
-			}
-			return true;
-		}
-		else
-			return false;
+		HANDLE mapping_handle = CreateFileMappingA(file_handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (!mapping_handle)
+			return;
+
+		// The view holds a reference to the mapping object, so we don't need to hold on to the handle.
+		void *mapped = MapViewOfFile(mapping_handle, FILE_MAP_READ, 0, 0, 0);
+		CloseHandle(mapping_handle);
+		if (!mapped)
+			return;
+
+		mapped_file = static_cast<const uint8_t *>(mapped);
+		mapped_file_size = size_t(size.QuadPart);
+#else
+		struct stat s = {};
+		if (fstat(fileno(file), &s) < 0 || s.st_size == 0)
+			return;
+
+		void *mapped = mmap(nullptr, size_t(s.st_size), PROT_READ, MAP_SHARED, fileno(file), 0);
+		if (mapped == MAP_FAILED)
+			return;
+
+		// Same reasoning as the fadvise in prepare().
+		if (imported_metadata && madvise(mapped, size_t(s.st_size), MADV_RANDOM) != 0)
+			LOGW_LEVEL("Failed to advise of mapping usage. This is not fatal, but might compromise disk performance.\n");
+
+		mapped_file = static_cast<const uint8_t *>(mapped);
+		mapped_file_size = size_t(s.st_size);
+#endif
 	}
 
-	bool find_entry(ResourceTag tag, Hash hash, Entry &entry) const
+	void unmap_file()
 	{
-		if (imported_metadata)
-		{
-			return find_entry_from_metadata(imported_metadata, tag, hash, &entry);
-		}
-		else
+		if (!mapped_file)
+			return;
+
+#ifdef _WIN32
+		UnmapViewOfFile(mapped_file);
+#else
+		munmap(const_cast<uint8_t *>(mapped_file), mapped_file_size);
+#endif
+		mapped_file = nullptr;
+		mapped_file_size = 0;
+	}
+
+	const uint8_t *get_mapped_range(uint64_t offset, size_t size) const
+	{
+		if (!mapped_file || offset > mapped_file_size || size > mapped_file_size - offset)
+			return nullptr;
+		return mapped_file + offset;
+	}
+
+	// Reads never go through the FILE position, so concurrent readers do not have to serialize.
+	// Prefer the mapping, otherwise fall back to positional I/O on the underlying file.
+	bool read_range(void *data, uint64_t offset, size_t size)
+	{
+		if (mapped_file)
 		{
-			auto itr = seen_blobs[tag].find(hash);
-			if (itr == end(seen_blobs[tag]))
+			auto *mapped = get_mapped_range(offset, size);
+			if (!mapped)
 				return false;
-
-			entry = itr->second;
+			memcpy(data, mapped, size);
 			return true;
 		}
+
+		return read_file_range(file, data, offset, size);
 	}
 
-	bool read_entry(ResourceTag tag, Hash hash, size_t *blob_size, void *blob, PayloadReadFlags flags) override
+	static void format_entry_name(char *str, unsigned tag, Hash hash)
 	{
-		if (!alive || mode != DatabaseMode::ReadOnly)
+		sprintf(str, "%0*x", FOSSILIZE_BLOB_HASH_LENGTH - 16, tag);
+		sprintf(str + FOSSILIZE_BLOB_HASH_LENGTH - 16, "%016" PRIx64, hash);
+	}
+
+	virtual bool supports_index() const
+	{
+		return true;
+	}
+
+	// Validates the footer and the entry header of an index which ends at len.
+	bool locate_index(size_t len, uint64_t &index_offset, PayloadHeader &header, uint32_t &version)
+	{
+		const size_t entry_header_size = FOSSILIZE_BLOB_HASH_LENGTH + sizeof(PayloadHeaderRaw);
+		if (len < MagicSize + entry_header_size + 8 + IndexFooterSize)
 			return false;
 
-		Entry entry;
-		if (!find_entry(tag, hash, entry))
+		uint8_t footer[IndexFooterSize];
+		if (!read_range(footer, len - IndexFooterSize, IndexFooterSize))
 			return false;
 
-		if (!blob_size)
+		convert_from_le64(&index_offset, footer + 0, 1);
+		convert_from_le(&version, footer + 8, 1);
+		if (memcmp(footer + 16, stream_index_magic, sizeof(stream_index_magic)) != 0 ||
+		    (version != IndexVersion && version != IndexVersionDictionaries && version != IndexVersionSegment))
 			return false;
 
-		uint32_t out_size = (flags & PAYLOAD_READ_RAW_FOSSILIZE_DB_BIT) != 0 ?
-		                    (entry.header.payload_size + sizeof(PayloadHeaderRaw)) :
-		                    entry.header.uncompressed_size;
+		if (index_offset < MagicSize || index_offset > len - entry_header_size - IndexFooterSize)
+			return false;
 
-		if (blob && *blob_size < out_size)
+		char bytes_to_read[FOSSILIZE_BLOB_HASH_LENGTH + sizeof(PayloadHeaderRaw)];
+		if (!read_range(bytes_to_read, index_offset, sizeof(bytes_to_read)))
 			return false;
-		*blob_size = out_size;
 
-		if (blob)
-		{
-			if ((flags & PAYLOAD_READ_RAW_FOSSILIZE_DB_BIT) != 0)
-			{
-				// Include the header.
-				ConditionalLockGuard holder(read_lock, (flags & PAYLOAD_READ_CONCURRENT_BIT) != 0);
-				if (fseek(file, entry.offset - sizeof(PayloadHeaderRaw), SEEK_SET) < 0)
-					return false;
+		char expected_name[FOSSILIZE_BLOB_HASH_LENGTH + 1];
+		format_entry_name(expected_name, IndexTag, 0);
+		if (memcmp(bytes_to_read, expected_name, FOSSILIZE_BLOB_HASH_LENGTH) != 0)
+			return false;
 
-				size_t read_size = entry.header.payload_size + sizeof(PayloadHeaderRaw);
-				if (fread(blob, 1, read_size, file) != read_size)
-					return false;
-			}
-			else
-			{
-				if (!decode_payload(blob, out_size, entry, (flags & PAYLOAD_READ_CONCURRENT_BIT) != 0))
-					return false;
-			}
-		}
+		header = get_converted_header(
+				*reinterpret_cast<const PayloadHeaderRaw *>(bytes_to_read + FOSSILIZE_BLOB_HASH_LENGTH));
 
-		return true;
+		return header.format == FOSSILIZE_COMPRESSION_NONE && header.crc != 0 &&
+		       header.payload_size == header.uncompressed_size &&
+		       index_offset + entry_header_size + header.payload_size == len &&
+		       header.payload_size >= 8 + get_index_trailer_size(version);
 	}
 
-	static void convert_from_le(uint32_t *output, const uint8_t *le_input, unsigned word_count)
+	// Size of everything after the records in an index payload.
+	static size_t get_index_trailer_size(uint32_t version)
 	{
-		for (unsigned i = 0; i < word_count; i++)
-		{
-			uint32_t v =
-					(uint32_t(le_input[0]) << 0) |
-					(uint32_t(le_input[1]) << 8) |
-					(uint32_t(le_input[2]) << 16) |
-					(uint32_t(le_input[3]) << 24);
-
-			*output++ = v;
-			le_input += 4;
-		}
+		return IndexFooterSize + (version == IndexVersionSegment ? IndexSegmentOffsetSize : 0);
 	}
 
-	static void convert_from_le(PayloadHeader &header, const PayloadHeaderRaw &raw)
+	// Checks that the per-tag record counts and dictionary records exactly fill the index payload.
+	static bool validate_index_record_counts(size_t payload_size, uint32_t version,
+	                                         const std::vector<uint64_t> &record_counts, uint32_t dictionary_count)
 	{
-		convert_from_le(&header.payload_size, raw.data + 0, 1);
-		convert_from_le(&header.format, raw.data + 4, 1);
-		convert_from_le(&header.crc, raw.data + 8, 1);
-		convert_from_le(&header.uncompressed_size, raw.data + 12, 1);
-	}
+		size_t records_size = payload_size - 8 - get_index_trailer_size(version);
+		if (record_counts.size() * sizeof(uint64_t) > records_size)
+			return false;
+		records_size -= record_counts.size() * sizeof(uint64_t);
 
-	static void convert_to_le(uint8_t *le_output, const uint32_t *value_input, unsigned count)
-	{
-		for (unsigned i = 0; i < count; i++)
+		uint64_t total_record_count = dictionary_count;
+		for (auto count : record_counts)
 		{
-			uint32_t v = value_input[i];
-			*le_output++ = uint8_t((v >> 0) & 0xffu);
-			*le_output++ = uint8_t((v >> 8) & 0xffu);
-			*le_output++ = uint8_t((v >> 16) & 0xffu);
-			*le_output++ = uint8_t((v >> 24) & 0xffu);
+			if (count > records_size / IndexRecordSize)
+				return false;
+			total_record_count += count;
 		}
-	}
 
-	static void convert_to_le(PayloadHeaderRaw &raw, const PayloadHeader &header)
-	{
-		uint8_t *le_output = raw.data;
-		convert_to_le(le_output + 0, &header.payload_size, 1);
-		convert_to_le(le_output + 4, &header.format, 1);
-		convert_to_le(le_output + 8, &header.crc, 1);
-		convert_to_le(le_output + 12, &header.uncompressed_size, 1);
+		return total_record_count * IndexRecordSize == records_size;
 	}
 
-	bool write_entry(ResourceTag tag, Hash hash, const void *blob, size_t size, PayloadWriteFlags flags) override
+	// Loads the index which ends at len, then every segment index it is chained to.
+	// Any inconsistency means the indices are stale or corrupt, and we fall back to scanning.
+	bool load_index_chain(size_t len)
 	{
-		if (!alive || mode == DatabaseMode::ReadOnly)
-			return false;
-
-		auto itr = seen_blobs[tag].find(hash);
-		if (itr != end(seen_blobs[tag]))
-			return true;
+		uint64_t begin_offset = len;
+		while (begin_offset > MagicSize)
+		{
+			if (!load_index(size_t(begin_offset), begin_offset))
+			{
+				for (auto &b : seen_blobs)
+					b.clear();
+				dictionary_entries.clear();
+				index_is_complete = true;
+				return false;
+			}
+		}
 
-		char str[FOSSILIZE_BLOB_HASH_LENGTH + 1]; // 40 digits + null
-		sprintf(str, "%0*x", FOSSILIZE_BLOB_HASH_LENGTH - 16, tag);
-		sprintf(str + FOSSILIZE_BLOB_HASH_LENGTH - 16, "%016" PRIx64, hash);
+		return true;
+	}
 
-		if (fwrite(str, 1, FOSSILIZE_BLOB_HASH_LENGTH, file) != FOSSILIZE_BLOB_HASH_LENGTH)
-			return false;
+	// Looks for the last index in the tail of the archive, for when the last session did not seal its entries.
+	// On success, begin_offset is where the unsealed entries begin, and everything before it is loaded.
+	bool find_last_sealed_segment(size_t len, size_t &begin_offset)
+	{
+		const size_t magic_size = sizeof(stream_index_magic);
+		const size_t search_begin = len > size_t(SegmentSearchLimit) + MagicSize ? len - size_t(SegmentSearchLimit) : size_t(MagicSize);
+		std::vector<uint8_t> chunk(64 * 1024 + magic_size);
+		size_t chunk_end = len;
 
-		if ((flags & PAYLOAD_WRITE_RAW_FOSSILIZE_DB_BIT) != 0)
+		while (chunk_end >= search_begin + magic_size)
 		{
-			// The raw payload already contains the header, so just dump it straight to disk.
-			if (size < sizeof(PayloadHeaderRaw))
+			if (shutdown_requested.load(std::memory_order_relaxed))
 				return false;
-			if (fwrite(blob, 1, size, file) != size)
+
+			// Overlap chunks so a footer magic which straddles two chunks is still found.
+			size_t chunk_begin = chunk_end - std::min<size_t>(chunk.size(), chunk_end - search_begin);
+			if (!read_range(chunk.data(), chunk_begin, chunk_end - chunk_begin))
 				return false;
-		}
-		else if ((flags & PAYLOAD_WRITE_COMPRESS_BIT) != 0)
-		{
-			auto compressed_bound = mz_compressBound(size);
 
-			if (zlib_buffer_size < compressed_bound)
+			for (size_t i = chunk_end - chunk_begin - magic_size + 1; i-- > 0; )
 			{
-				auto *new_zlib_buffer = static_cast<uint8_t *>(realloc(zlib_buffer, compressed_bound));
-				if (new_zlib_buffer)
-				{
-					zlib_buffer = new_zlib_buffer;
-					zlib_buffer_size = compressed_bound;
-				}
-				else
+				if (memcmp(chunk.data() + i, stream_index_magic, magic_size) != 0)
+					continue;
+
+				size_t candidate = chunk_begin + i + magic_size;
+				if (candidate != len && load_index_chain(candidate))
 				{
-					free(zlib_buffer);
-					zlib_buffer = nullptr;
-					zlib_buffer_size = 0;
+					begin_offset = candidate;
+					return true;
 				}
 			}
 
-			if (!zlib_buffer)
-				return false;
+			chunk_end = chunk_begin + magic_size - 1;
+		}
 
-			PayloadHeader header = {};
-			PayloadHeaderRaw header_raw = {};
-			header.uncompressed_size = uint32_t(size);
-			header.format = FOSSILIZE_COMPRESSION_DEFLATE;
+		return false;
+	}
 
-			mz_ulong zsize = zlib_buffer_size;
-			if (mz_compress2(zlib_buffer, &zsize, static_cast<const unsigned char *>(blob), size,
-			                 (flags & PAYLOAD_WRITE_BEST_COMPRESSION_BIT) != 0 ? MZ_BEST_COMPRESSION : MZ_BEST_SPEED) != MZ_OK)
-				return false;
+	// Populates seen_blobs from the index which ends at len.
+	// A full index describes every entry before it, and begin_offset is set to the beginning of the archive.
+	// A segment index only describes the entries from begin_offset, which is where the previous index ends.
+	bool load_index(size_t len, uint64_t &begin_offset)
+	{
+		const size_t entry_header_size = FOSSILIZE_BLOB_HASH_LENGTH + sizeof(PayloadHeaderRaw);
+		PayloadHeader header;
+		uint64_t index_offset;
+		uint32_t version;
+		if (!locate_index(len, index_offset, header, version))
+			return false;
 
-			header.payload_size = uint32_t(zsize);
-			if ((flags & PAYLOAD_WRITE_COMPUTE_CHECKSUM_BIT) != 0)
-				header.crc = uint32_t(mz_crc32(MZ_CRC32_INIT, zlib_buffer, zsize));
+		std::vector<uint8_t> payload(header.payload_size);
+		if (!read_range(payload.data(), index_offset + entry_header_size, payload.size()))
+			return false;
 
-			convert_to_le(header_raw, header);
-			if (fwrite(&header_raw, 1, sizeof(header_raw), file) != sizeof(header_raw))
-				return false;
+		if (compute_crc32(0, payload.data(), payload.size()) != header.crc)
+		{
+			LOGW_LEVEL("Archive index is corrupt, falling back to scanning the archive.\n");
+			return false;
+		}
 
-			if (fwrite(zlib_buffer, 1, header.payload_size, file) != header.payload_size)
+		uint32_t tag_count, dictionary_count;
+		convert_from_le(&tag_count, payload.data(), 1);
+		convert_from_le(&dictionary_count, payload.data() + 4, 1);
+		if (size_t(tag_count) * sizeof(uint64_t) > payload.size() - 8 - get_index_trailer_size(version))
+			return false;
+
+		std::vector<uint64_t> record_counts(tag_count);
+		convert_from_le64(record_counts.data(), payload.data() + 8, tag_count);
+		if (!validate_index_record_counts(payload.size(), version, record_counts, dictionary_count))
+			return false;
+
+		begin_offset = MagicSize;
+		if (version == IndexVersionSegment)
+		{
+			convert_from_le64(&begin_offset, payload.data() + payload.size() - get_index_trailer_size(version), 1);
+			// Segments must strictly move towards the start of the archive, or we could loop forever.
+			if (begin_offset < MagicSize || begin_offset >= index_offset)
+				return false;
+		}
+
+		const uint8_t *record = payload.data() + 8 + tag_count * sizeof(uint64_t);
+		const auto record_is_valid = [&](const Entry &entry) -> bool {
+			return entry.offset >= begin_offset + entry_header_size &&
+			       entry.offset + entry.header.payload_size <= index_offset;
+		};
+
+		for (uint32_t tag = 0; tag < tag_count; tag++)
+		{
+			if (tag >= RESOURCE_COUNT)
+			{
+				record += record_counts[tag] * IndexRecordSize;
+				continue;
+			}
+
+			auto &blobs = seen_blobs[tag];
+			blobs.reserve(record_counts[tag]);
+
+			for (uint64_t i = 0; i < record_counts[tag]; i++, record += IndexRecordSize)
+			{
+				Hash hash;
+				Entry entry;
+				convert_from_le64(&hash, record + 0, 1);
+				convert_from_le64(&entry.offset, record + 8, 1);
+				entry.header = get_converted_header(*reinterpret_cast<const PayloadHeaderRaw *>(record + 16));
+
+				if (!record_is_valid(entry))
+				{
+					for (auto &b : seen_blobs)
+						b.clear();
+					index_is_complete = true;
+					return false;
+				}
+
+				if (test_resource_filter(static_cast<ResourceTag>(tag), hash))
+					blobs.emplace(hash, entry);
+				else
+					index_is_complete = false;
+			}
+		}
+
+		for (uint32_t i = 0; i < dictionary_count; i++, record += IndexRecordSize)
+		{
+			Hash hash;
+			Entry entry;
+			convert_from_le64(&hash, record + 0, 1);
+			convert_from_le64(&entry.offset, record + 8, 1);
+			entry.header = get_converted_header(*reinterpret_cast<const PayloadHeaderRaw *>(record + 16));
+
+			if (!record_is_valid(entry))
+			{
+				for (auto &b : seen_blobs)
+					b.clear();
+				dictionary_entries.clear();
+				index_is_complete = true;
+				return false;
+			}
+
+			dictionary_entries.emplace(hash, entry);
+		}
+
+		return true;
+	}
+
+	// Opens the archive for walking entries in hash order through SortedEntryCursor.
+	// If the archive ends with a valid index, records are read from disk on demand rather than loaded up front,
+	// so memory use does not depend on the size of the archive. Otherwise, this falls back to prepare().
+	bool prepare_sorted_access()
+	{
+		if (alive || mode != DatabaseMode::ReadOnly || !impl->imported_metadata.empty())
+			return false;
+
+		file = fopen(path.c_str(), "rb");
+		if (!file)
+			return false;
+
+		if (load_sorted_index())
+		{
+			map_file();
+			alive = true;
+			return true;
+		}
+
+		fclose(file);
+		file = nullptr;
+		return prepare();
+	}
+
+	// True if prepare_sorted_access() found an index, so walking entries does not hold them in memory.
+	bool has_sorted_index() const
+	{
+		return sorted_index.valid;
+	}
+
+	bool load_sorted_index()
+	{
+		if (fseek(file, 0, SEEK_END) < 0)
+			return false;
+		long file_len = ftell(file);
+		if (file_len < long(MagicSize))
+			return false;
+		size_t len = size_t(file_len);
+
+		uint8_t magic[MagicSize];
+		if (!read_range(magic, 0, MagicSize) || memcmp(magic, stream_reference_magic_and_version, MagicSize - 1) != 0)
+			return false;
+		int version = magic[MagicSize - 1];
+		if (version > FOSSILIZE_FORMAT_DICTIONARY_VERSION || version < FOSSILIZE_FORMAT_MIN_COMPAT_VERSION)
+			return false;
+
+		uint64_t index_offset;
+		PayloadHeader header;
+		uint32_t index_version;
+		// A segment only describes part of the archive, so records cannot be walked straight from disk.
+		if (!locate_index(len, index_offset, header, index_version) || index_version == IndexVersionSegment)
+			return false;
+
+		// Verify the checksum without holding the entire index in memory.
+		const uint64_t payload_offset = index_offset + FOSSILIZE_BLOB_HASH_LENGTH + sizeof(PayloadHeaderRaw);
+		uint8_t chunk[64 * 1024];
+		uint32_t crc = 0;
+		for (size_t offset = 0; offset < header.payload_size; offset += sizeof(chunk))
+		{
+			size_t to_read = std::min<size_t>(sizeof(chunk), header.payload_size - offset);
+			if (!read_range(chunk, payload_offset + offset, to_read))
+				return false;
+			crc = compute_crc32(crc, chunk, to_read);
+		}
+
+		if (crc != header.crc)
+			return false;
+
+		uint32_t tag_count, dictionary_count;
+		if (!read_range(chunk, payload_offset, 8))
+			return false;
+		convert_from_le(&tag_count, chunk, 1);
+		convert_from_le(&dictionary_count, chunk + 4, 1);
+		if (size_t(tag_count) * sizeof(uint64_t) > header.payload_size - 8 - IndexFooterSize)
+			return false;
+
+		std::vector<uint8_t> counts_raw(tag_count * sizeof(uint64_t));
+		if (!read_range(counts_raw.data(), payload_offset + 8, counts_raw.size()))
+			return false;
+
+		sorted_index.record_counts.resize(tag_count);
+		convert_from_le64(sorted_index.record_counts.data(), counts_raw.data(), tag_count);
+		if (!validate_index_record_counts(header.payload_size, index_version, sorted_index.record_counts, dictionary_count))
+			return false;
+
+		sorted_index.index_offset = index_offset;
+		sorted_index.records_offset = payload_offset + 8 + counts_raw.size();
+		sorted_index.valid = true;
+		return true;
+	}
+
+	// Walks the entries of one tag in ascending hash order.
+	// The archive must have been opened with prepare_sorted_access().
+	struct SortedEntryCursor
+	{
+		enum { RecordsPerChunk = 1024 };
+
+		StreamArchive *archive = nullptr;
+		ResourceTag tag = RESOURCE_COUNT;
+		bool valid = false;
+		Hash hash = 0;
+		Entry entry = {};
+
+		// Records are read in chunks straight from the index.
+		uint64_t next_record_offset = 0;
+		uint64_t records_left = 0;
+		std::vector<uint8_t> records;
+		size_t chunk_index = 0;
+		size_t chunk_count = 0;
+
+		// Without an index, entries come from seen_blobs instead.
+		std::vector<Hash> hashes;
+		size_t hash_index = 0;
+
+		bool begin(StreamArchive &archive_, ResourceTag tag_)
+		{
+			archive = &archive_;
+			tag = tag_;
+			valid = false;
+			chunk_index = 0;
+			chunk_count = 0;
+			hash_index = 0;
+			hashes.clear();
+
+			auto &layout = archive->sorted_index;
+			if (layout.valid)
+			{
+				next_record_offset = layout.records_offset;
+				for (unsigned i = 0; i < tag && i < layout.record_counts.size(); i++)
+					next_record_offset += layout.record_counts[i] * IndexRecordSize;
+				records_left = tag < layout.record_counts.size() ? layout.record_counts[tag] : 0;
+			}
+			else
+			{
+				size_t hash_count = 0;
+				if (!archive->get_hash_list_for_resource_tag(tag, &hash_count, nullptr))
+					return false;
+				hashes.resize(hash_count);
+				if (!archive->get_hash_list_for_resource_tag(tag, &hash_count, hashes.data()))
+					return false;
+				records_left = hash_count;
+			}
+
+			return advance();
+		}
+
+		// Returns false on error. Once all entries have been visited, valid is false.
+		bool advance()
+		{
+			bool first = !valid;
+			Hash prev_hash = hash;
+			valid = false;
+
+			if (!records_left)
+				return true;
+
+			auto &layout = archive->sorted_index;
+			if (!layout.valid)
+			{
+				records_left--;
+				hash = hashes[hash_index++];
+				if (!archive->find_entry(tag, hash, entry))
+					return false;
+				valid = true;
+				return true;
+			}
+
+			if (chunk_index == chunk_count)
+			{
+				chunk_count = size_t(std::min<uint64_t>(records_left, RecordsPerChunk));
+				records.resize(chunk_count * IndexRecordSize);
+				if (!archive->read_range(records.data(), next_record_offset, records.size()))
+					return false;
+				next_record_offset += records.size();
+				chunk_index = 0;
+			}
+
+			const uint8_t *record = records.data() + chunk_index * IndexRecordSize;
+			chunk_index++;
+			records_left--;
+
+			convert_from_le64(&hash, record + 0, 1);
+			convert_from_le64(&entry.offset, record + 8, 1);
+			entry.header = archive->get_converted_header(*reinterpret_cast<const PayloadHeaderRaw *>(record + 16));
+
+			// The merge logic relies on strict ordering, so don't trust a broken index.
+			if ((!first && hash <= prev_hash) ||
+			    entry.offset < MagicSize + FOSSILIZE_BLOB_HASH_LENGTH + sizeof(PayloadHeaderRaw) ||
+			    entry.offset + entry.header.payload_size > layout.index_offset)
+			{
+				return false;
+			}
+
+			valid = true;
+			return true;
+		}
+	};
+
+	static bool find_entry_from_metadata(const ExportedMetadataHeader *header, ResourceTag tag, Hash hash, Entry *entry)
+	{
+		size_t count = header->lists[tag].count;
+		if (!count)
+			return false;
+
+		auto *hashes = reinterpret_cast<const Hash *>(
+				reinterpret_cast<const uint8_t *>(header) + header->lists[tag].offset);
+
+		size_t index = find_eytzinger(hashes, count, hash);
+		if (index == count)
+			return false;
+
+		if (entry)
+		{
+			auto *payloads = reinterpret_cast<const ExportedMetadataPayload *>(hashes + count);
+			entry->offset = payloads[index].file_offset;
+			entry->header = payloads[index].payload;
+		}
+		return true;
+	}
+
+	bool find_entry(ResourceTag tag, Hash hash, Entry &entry) const
+	{
+		if (imported_metadata)
+		{
+			return find_entry_from_metadata(imported_metadata, tag, hash, &entry);
+		}
+		else
+		{
+			auto *blob = seen_blobs[tag].find(hash);
+			if (!blob)
+				return false;
+
+			entry = *blob;
+			return true;
+		}
+	}
+
+	bool get_entry_range(ResourceTag tag, Hash hash, uint64_t *offset, uint64_t *size) override
+	{
+		sync_write_behind();
+
+		Entry entry;
+		if (!alive || !find_entry(tag, hash, entry))
+			return false;
+
+		const uint64_t entry_header_size = FOSSILIZE_BLOB_HASH_LENGTH + sizeof(PayloadHeaderRaw);
+		*offset = entry.offset - entry_header_size;
+		*size = entry_header_size + entry.header.payload_size;
+		return true;
+	}
+
+	void prefetch(ResourceTag tag, const Hash *hashes, size_t count) override
+	{
+		if (!alive || mode != DatabaseMode::ReadOnly || !file)
+			return;
+
+		std::vector<std::pair<uint64_t, uint64_t>> ranges;
+		ranges.reserve(count);
+		for (size_t i = 0; i < count; i++)
+		{
+			Entry entry;
+			if (find_entry(tag, hashes[i], entry))
+				ranges.emplace_back(entry.offset, entry.offset + entry.header.payload_size);
+		}
+
+		if (ranges.empty())
+			return;
+
+		// Most entries are small, so merge neighbouring entries into larger requests.
+		// Reading a small gap is cheaper than an extra seek.
+		constexpr uint64_t MaxPrefetchGap = 64 * 1024;
+		std::sort(ranges.begin(), ranges.end());
+
+		uint64_t range_begin = ranges.front().first;
+		uint64_t range_end = ranges.front().second;
+		for (auto &range : ranges)
+		{
+			if (range.first > range_end + MaxPrefetchGap)
+			{
+				prefetch_range(range_begin, range_end);
+				range_begin = range.first;
+			}
+			range_end = std::max(range_end, range.second);
+		}
+		prefetch_range(range_begin, range_end);
+	}
+
+	// This is only a hint, so failures are ignored.
+	void prefetch_range(uint64_t begin, uint64_t end)
+	{
+#ifdef _WIN32
+		// Nothing to do here, we rely on the OS cache.
+		(void)begin;
+		(void)end;
+#else
+		if (mapped_file)
+		{
+			end = std::min<uint64_t>(end, mapped_file_size);
+			if (begin >= end)
+				return;
+
+			uint64_t page_size = uint64_t(sysconf(_SC_PAGESIZE));
+			uint64_t aligned_begin = begin & ~(page_size - 1);
+			madvise(const_cast<uint8_t *>(mapped_file) + aligned_begin, size_t(end - aligned_begin), MADV_WILLNEED);
+		}
+#ifdef __linux__
+		else
+			posix_fadvise(fileno(file), off_t(begin), off_t(end - begin), POSIX_FADV_WILLNEED);
+#endif
+#endif
+	}
+
+	bool read_entry(ResourceTag tag, Hash hash, size_t *blob_size, void *blob, PayloadReadFlags flags) override
+	{
+		if (!alive || mode != DatabaseMode::ReadOnly)
+			return false;
+
+		Entry entry;
+		if (!find_entry(tag, hash, entry))
+			return false;
+
+		if (!blob_size)
+			return false;
+
+		uint32_t out_size = (flags & PAYLOAD_READ_RAW_FOSSILIZE_DB_BIT) != 0 ?
+		                    (entry.header.payload_size + sizeof(PayloadHeaderRaw)) :
+		                    entry.header.uncompressed_size;
+
+		if (blob && *blob_size < out_size)
+			return false;
+		*blob_size = out_size;
+
+		if (blob)
+		{
+			if ((flags & PAYLOAD_READ_RAW_FOSSILIZE_DB_BIT) != 0)
+			{
+				// Include the header.
+				size_t read_size = entry.header.payload_size + sizeof(PayloadHeaderRaw);
+				if (!read_range(blob, entry.offset - sizeof(PayloadHeaderRaw), read_size))
+					return false;
+			}
+			else
+			{
+				if (!decode_payload(blob, out_size, entry, (flags & PAYLOAD_READ_CONCURRENT_BIT) != 0))
+					return false;
+			}
+		}
+
+		return true;
+	}
+
+	static void convert_from_le(uint32_t *output, const uint8_t *le_input, unsigned word_count)
+	{
+		for (unsigned i = 0; i < word_count; i++)
+		{
+			uint32_t v =
+					(uint32_t(le_input[0]) << 0) |
+					(uint32_t(le_input[1]) << 8) |
+					(uint32_t(le_input[2]) << 16) |
+					(uint32_t(le_input[3]) << 24);
+
+			*output++ = v;
+			le_input += 4;
+		}
+	}
+
+	static void convert_from_le(PayloadHeader &header, const PayloadHeaderRaw &raw)
+	{
+		convert_from_le(&header.payload_size, raw.data + 0, 1);
+		convert_from_le(&header.format, raw.data + 4, 1);
+		convert_from_le(&header.crc, raw.data + 8, 1);
+		convert_from_le(&header.uncompressed_size, raw.data + 12, 1);
+	}
+
+	static void convert_to_le(uint8_t *le_output, const uint32_t *value_input, unsigned count)
+	{
+		for (unsigned i = 0; i < count; i++)
+		{
+			uint32_t v = value_input[i];
+			*le_output++ = uint8_t((v >> 0) & 0xffu);
+			*le_output++ = uint8_t((v >> 8) & 0xffu);
+			*le_output++ = uint8_t((v >> 16) & 0xffu);
+			*le_output++ = uint8_t((v >> 24) & 0xffu);
+		}
+	}
+
+	static void convert_to_le(PayloadHeaderRaw &raw, const PayloadHeader &header)
+	{
+		uint8_t *le_output = raw.data;
+		convert_to_le(le_output + 0, &header.payload_size, 1);
+		convert_to_le(le_output + 4, &header.format, 1);
+		convert_to_le(le_output + 8, &header.crc, 1);
+		convert_to_le(le_output + 12, &header.uncompressed_size, 1);
+	}
+
+	static void convert_from_le64(uint64_t *output, const uint8_t *le_input, unsigned word_count)
+	{
+		for (unsigned i = 0; i < word_count; i++)
+		{
+			uint32_t lo, hi;
+			convert_from_le(&lo, le_input + 0, 1);
+			convert_from_le(&hi, le_input + 4, 1);
+			*output++ = uint64_t(lo) | (uint64_t(hi) << 32);
+			le_input += 8;
+		}
+	}
+
+	static void convert_to_le64(uint8_t *le_output, const uint64_t *value_input, unsigned count)
+	{
+		for (unsigned i = 0; i < count; i++)
+		{
+			uint32_t lo = uint32_t(value_input[i]);
+			uint32_t hi = uint32_t(value_input[i] >> 32);
+			convert_to_le(le_output + 0, &lo, 1);
+			convert_to_le(le_output + 4, &hi, 1);
+			le_output += 8;
+		}
+	}
+
+	bool truncate_file(uint64_t size)
+	{
+		if (fflush(file) != 0)
+			return false;
+#ifdef _WIN32
+		if (_chsize_s(_fileno(file), int64_t(size)) != 0)
+			return false;
+#else
+		if (ftruncate(fileno(file), off_t(size)) < 0)
+			return false;
+#endif
+		return true;
+	}
+
+	// If we wrote an index in this session, new entries are written on top of it.
+	bool begin_write()
+	{
+		wrote_entries = true;
+		if (!index_truncate_pending)
+			return true;
+
+		if (!truncate_file(write_offset))
+			return false;
+		if (fseek(file, write_offset, SEEK_SET) < 0)
+			return false;
+
+		index_truncate_pending = false;
+		return true;
+	}
+
+	// Rewrites the version byte in the header if the archive is about to gain entries which need a newer reader.
+	bool require_archive_version(int version)
+	{
+		if (archive_version >= version)
+			return true;
+
+		uint8_t version_byte = uint8_t(version);
+		if (fseek(file, MagicSize - 1, SEEK_SET) < 0 ||
+		    fwrite(&version_byte, 1, 1, file) != 1 ||
+		    fseek(file, write_offset, SEEK_SET) < 0)
+		{
+			return false;
+		}
+
+		archive_version = version;
+		return true;
+	}
+
+	static int get_required_archive_version(uint32_t format)
+	{
+		if (format == FOSSILIZE_COMPRESSION_LZ4_DICTIONARY)
+			return FOSSILIZE_FORMAT_DICTIONARY_VERSION;
+		else if (format == FOSSILIZE_COMPRESSION_LZ4)
+			return FOSSILIZE_FORMAT_LZ4_VERSION;
+		else
+			return 0;
+	}
+
+	const CompressionDictionary *find_dictionary(Hash id) const
+	{
+		const uint32_t *index = dictionary_indices.find(id);
+		return index ? &dictionaries[*index] : nullptr;
+	}
+
+	void add_dictionary(Hash id, std::vector<uint8_t> data)
+	{
+		dictionary_indices.emplace(id, uint32_t(dictionaries.size()));
+		dictionaries.push_back({ id, {} });
+		dictionaries.back().dict.data = std::move(data);
+	}
+
+	// Dictionaries are small, so decode all of them up front rather than synchronizing lazy loads
+	// between threads reading with PAYLOAD_READ_CONCURRENT_BIT.
+	void load_dictionaries()
+	{
+		if (mode != DatabaseMode::ReadOnly)
+			return;
+
+		auto load = [this](Hash id, const Entry &entry) {
+			std::vector<uint8_t> data(entry.header.uncompressed_size);
+			if (!decode_payload(data.data(), data.size(), entry, false))
+				LOGW_LEVEL("Failed to load compression dictionary %016" PRIx64 ".\n", id);
+			else if (!find_dictionary(id))
+				add_dictionary(id, std::move(data));
+		};
+
+		if (imported_metadata)
+		{
+			size_t count = imported_metadata->dictionaries.count;
+			const auto *hashes = reinterpret_cast<const Hash *>(
+					reinterpret_cast<const uint8_t *>(imported_metadata) + imported_metadata->dictionaries.offset);
+			const auto *payloads = reinterpret_cast<const ExportedMetadataPayload *>(hashes + count);
+			for (size_t i = 0; i < count; i++)
+				load(hashes[i], { payloads[i].file_offset, payloads[i].payload });
+		}
+		else
+		{
+			dictionary_entries.for_each([&](Hash id, const Entry &entry) {
+				load(id, entry);
+			});
+		}
+	}
+
+	bool write_dictionary_entry(Hash id, const void *data, size_t size)
+	{
+		if (!begin_write() || !require_archive_version(FOSSILIZE_FORMAT_DICTIONARY_VERSION))
+			return false;
+
+		char str[FOSSILIZE_BLOB_HASH_LENGTH + 1]; // 40 digits + null
+		format_entry_name(str, DictionaryTag, id);
+
+		PayloadHeader header = { uint32_t(size), FOSSILIZE_COMPRESSION_NONE, compute_crc32(0, data, size), uint32_t(size) };
+		PayloadHeaderRaw header_raw = {};
+		convert_to_le(header_raw, header);
+
+		if (fwrite(str, 1, FOSSILIZE_BLOB_HASH_LENGTH, file) != FOSSILIZE_BLOB_HASH_LENGTH ||
+		    fwrite(&header_raw, 1, sizeof(header_raw), file) != sizeof(header_raw) ||
+		    fwrite(data, 1, size, file) != size)
+		{
+			index_is_complete = false;
+			return false;
+		}
+
+		write_offset += FOSSILIZE_BLOB_HASH_LENGTH + sizeof(header_raw);
+		dictionary_entries.emplace(id, { write_offset, header });
+		write_offset += size;
+		return true;
+	}
+
+	bool set_compression_dictionary(ResourceTag tag, const void *data, size_t size) override
+	{
+		// Workers read the dictionaries while encoding.
+		sync_write_behind();
+
+		if (!alive || mode == DatabaseMode::ReadOnly || unsigned(tag) >= RESOURCE_COUNT)
+			return false;
+
+		if (size == 0)
+		{
+			active_dictionaries[tag] = 0;
+			return true;
+		}
+
+		Hasher h;
+		h.data(static_cast<const uint8_t *>(data), size);
+		Hash id = h.get();
+
+		if (!dictionary_entries.count(id) && !write_dictionary_entry(id, data, size))
+			return false;
+
+		if (!find_dictionary(id))
+		{
+			auto *bytes = static_cast<const uint8_t *>(data);
+			add_dictionary(id, std::vector<uint8_t>(bytes, bytes + size));
+		}
+
+		uint32_t index = *dictionary_indices.find(id);
+		auto &dict = dictionaries[index].dict;
+		if (dict.table.empty())
+		{
+			// prepare_dictionary_lz4 keeps its own copy of the part within reach.
+			std::vector<uint8_t> dict_data = std::move(dict.data);
+			prepare_dictionary_lz4(dict, dict_data.data(), dict_data.size());
+		}
+
+		active_dictionaries[tag] = index + 1;
+		return true;
+	}
+
+	bool write_entry(ResourceTag tag, Hash hash, const void *blob, size_t size, PayloadWriteFlags flags) override
+	{
+		DatabaseWriteEntry entry = { tag, hash, blob, size, flags };
+		return write_entries(&entry, 1);
+	}
+
+	bool write_entries(const DatabaseWriteEntry *entries, size_t count) override
+	{
+		if (!alive || mode == DatabaseMode::ReadOnly)
+			return false;
+
+		if (write_behind)
+			return queue_write_behind(entries, count);
+
+		// Encode everything up front, so the whole batch hits the file in a single write.
+		write_batch_buffer.clear();
+		write_batch_entries.clear();
+		write_batch_hashes.clear();
+		bool ret = true;
+
+		for (size_t i = 0; i < count; i++)
+		{
+			auto &entry = entries[i];
+			if (seen_blobs[entry.tag].count(entry.hash))
+				continue;
+
+			// The same entry may appear more than once in a batch.
+			if (count > 1)
+			{
+				uint32_t tag_bit = 1u << entry.tag;
+				uint32_t *tag_mask = write_batch_hashes.find(entry.hash);
+				if (tag_mask && (*tag_mask & tag_bit) != 0)
+					continue;
+				else if (tag_mask)
+					*tag_mask |= tag_bit;
+				else
+					write_batch_hashes.emplace(entry.hash, tag_bit);
+			}
+
+			BatchedEntry pending = {};
+			pending.tag = entry.tag;
+			pending.hash = entry.hash;
+			pending.entry.offset = write_batch_buffer.size() + FOSSILIZE_BLOB_HASH_LENGTH + sizeof(PayloadHeaderRaw);
+			if (encode_entry(entry, pending.entry.header, write_batch_buffer, compress_scratch))
+				write_batch_entries.push_back(pending);
+			else
+				ret = false;
+		}
+
+		if (write_batch_buffer.empty())
+			return ret;
+
+		if (!begin_write())
+			return false;
+
+		for (auto &pending : write_batch_entries)
+			if (!require_archive_version(get_required_archive_version(pending.entry.header.format)))
+				return false;
+
+		if (fwrite(write_batch_buffer.data(), 1, write_batch_buffer.size(), file) != write_batch_buffer.size())
+		{
+			// We cannot know how much of the batch made it to disk, so offsets can no longer be trusted.
+			index_is_complete = false;
+			return false;
+		}
+
+		// Track where the payloads ended up, so that we can emit an index later.
+		for (auto &pending : write_batch_entries)
+		{
+			pending.entry.offset += write_offset;
+			seen_blobs[pending.tag].emplace(pending.hash, pending.entry);
+		}
+		write_offset += write_batch_buffer.size();
+
+		return ret;
+	}
+
+	// Write-behind: write_entries() only copies the entries into a queue.
+	// Workers encode them, and a dedicated I/O thread appends them to the file in submission order.
+	// Only the I/O thread touches the file while write-behind is running, and only the calling thread touches seen_blobs.
+	// The calling thread may only access the file and the rest of the write state after sync_write_behind().
+	void start_write_behind()
+	{
+		write_behind.reset(new WriteBehind);
+		write_behind->max_in_flight_bytes = write_behind_max_in_flight_bytes;
+		for (unsigned i = 0; i < write_behind_worker_count; i++)
+			write_behind->workers.emplace_back(&StreamArchive::write_behind_worker, this);
+		write_behind->io_thread = std::thread(&StreamArchive::write_behind_io, this);
+	}
+
+	void stop_write_behind()
+	{
+		if (!write_behind)
+			return;
+
+		{
+			std::lock_guard<std::mutex> holder{write_behind->lock};
+			write_behind->stop = true;
+			write_behind->cond.notify_all();
+		}
+
+		for (auto &worker : write_behind->workers)
+			worker.join();
+		write_behind->io_thread.join();
+
+		collect_write_behind_results();
+		write_behind.reset();
+	}
+
+	// Waits until everything queued so far is in the file.
+	// Returns false if any entry has failed to encode or write since write-behind started.
+	bool sync_write_behind()
+	{
+		if (!write_behind)
+			return true;
+
+		std::unique_lock<std::mutex> holder{write_behind->lock};
+		write_behind->cond.wait(holder, [this]() { return write_behind->in_flight_jobs == 0; });
+		collect_write_behind_results();
+		return !write_behind->failed;
+	}
+
+	// Must be called with the lock held, or once the threads are gone.
+	void collect_write_behind_results()
+	{
+		for (auto &result : write_behind->results)
+		{
+			if (result.entry.offset != 0)
+				seen_blobs[result.tag].emplace(result.hash, result.entry);
+			write_behind_pending[result.tag].erase(result.hash);
+		}
+		write_behind->results.clear();
+	}
+
+	bool queue_write_behind(const DatabaseWriteEntry *entries, size_t count)
+	{
+		auto &wb = *write_behind;
+
+		for (size_t i = 0; i < count; i++)
+		{
+			auto &entry = entries[i];
+			if (seen_blobs[entry.tag].count(entry.hash) || !write_behind_pending[entry.tag].insert(entry.hash).second)
+				continue;
+
+			// The caller's buffer is only valid until we return.
+			std::unique_ptr<WriteBehindJob> job(new WriteBehindJob);
+			job->tag = entry.tag;
+			job->hash = entry.hash;
+			job->flags = entry.flags;
+			job->blob_size = entry.size;
+			auto *bytes = static_cast<const uint8_t *>(entry.buffer);
+			job->blob.assign(bytes, bytes + entry.size);
+
+			std::unique_lock<std::mutex> holder{wb.lock};
+
+			// A single entry which is larger than the budget is still let through once the queue has drained.
+			wb.cond.wait(holder, [&]() {
+				return wb.in_flight_jobs == 0 || wb.in_flight_bytes + entry.size <= wb.max_in_flight_bytes;
+			});
+
+			collect_write_behind_results();
+			wb.in_flight_bytes += entry.size;
+			wb.in_flight_jobs++;
+			wb.encode_queue.push_back(job.get());
+			wb.write_queue.push_back(std::move(job));
+			wb.cond.notify_all();
+		}
+
+		// Failures happen after the entries were queued, so they surface on a later call.
+		std::lock_guard<std::mutex> holder{wb.lock};
+		return !wb.failed;
+	}
+
+	void write_behind_worker()
+	{
+		auto &wb = *write_behind;
+		std::vector<uint8_t> scratch;
+		std::unique_lock<std::mutex> holder{wb.lock};
+
+		for (;;)
+		{
+			wb.cond.wait(holder, [&]() { return wb.stop || !wb.encode_queue.empty(); });
+			if (wb.encode_queue.empty())
+				break;
+
+			auto *job = wb.encode_queue.front();
+			wb.encode_queue.pop_front();
+			holder.unlock();
+
+			DatabaseWriteEntry entry = { job->tag, job->hash, job->blob.data(), job->blob.size(), job->flags };
+			job->encoded_ok = encode_entry(entry, job->header, job->encoded, scratch);
+			std::vector<uint8_t>().swap(job->blob);
+
+			holder.lock();
+			job->done = true;
+			wb.cond.notify_all();
+		}
+	}
+
+	void write_behind_io()
+	{
+		auto &wb = *write_behind;
+		std::vector<std::unique_ptr<WriteBehindJob>> jobs;
+		std::unique_lock<std::mutex> holder{wb.lock};
+
+		for (;;)
+		{
+			wb.cond.wait(holder, [&]() {
+				return (wb.stop && wb.write_queue.empty()) || (!wb.write_queue.empty() && wb.write_queue.front()->done);
+			});
+			if (wb.write_queue.empty())
+				break;
+
+			// Take everything which is ready, but never skip ahead of an entry which is still being encoded.
+			jobs.clear();
+			while (!wb.write_queue.empty() && wb.write_queue.front()->done)
+			{
+				jobs.push_back(std::move(wb.write_queue.front()));
+				wb.write_queue.pop_front();
+			}
+			holder.unlock();
+
+			for (auto &job : jobs)
+			{
+				job->entry.offset = 0;
+				if (!job->encoded_ok)
+				{
+					LOGE_LEVEL("Failed to encode entry %016" PRIx64 ".\n", job->hash);
+					continue;
+				}
+
+				if (!begin_write() || !require_archive_version(get_required_archive_version(job->header.format)))
+				{
+					index_is_complete = false;
+					continue;
+				}
+
+				if (fwrite(job->encoded.data(), 1, job->encoded.size(), file) != job->encoded.size())
+				{
+					LOGE_LEVEL("Failed to write entry %016" PRIx64 ".\n", job->hash);
+					// We cannot know how much made it to disk, so offsets can no longer be trusted.
+					index_is_complete = false;
+					continue;
+				}
+
+				job->entry.offset = write_offset + FOSSILIZE_BLOB_HASH_LENGTH + sizeof(PayloadHeaderRaw);
+				job->entry.header = job->header;
+				write_offset += job->encoded.size();
+			}
+
+			holder.lock();
+			for (auto &job : jobs)
+			{
+				if (job->entry.offset == 0)
+					wb.failed = true;
+				wb.in_flight_bytes -= job->blob_size;
+				wb.in_flight_jobs--;
+				wb.results.push_back({ job->tag, job->hash, job->entry });
+			}
+			wb.cond.notify_all();
+		}
+	}
+
+	// Appends name, payload header and payload to buffer.
+	// On failure, the buffer is left as it was.
+	// Only reads archive state, so write-behind workers can encode concurrently as long as dictionaries do not change.
+	bool encode_entry(const DatabaseWriteEntry &entry, PayloadHeader &header,
+	                  std::vector<uint8_t> &buffer, std::vector<uint8_t> &scratch) const
+	{
+		size_t base_offset = buffer.size();
+		size_t payload_offset = base_offset + FOSSILIZE_BLOB_HASH_LENGTH + sizeof(PayloadHeaderRaw);
+		auto *blob = static_cast<const unsigned char *>(entry.buffer);
+		size_t size = entry.size;
+
+		if ((entry.flags & PAYLOAD_WRITE_RAW_FOSSILIZE_DB_BIT) != 0)
+		{
+			if (size < sizeof(PayloadHeaderRaw))
+				return false;
+			convert_from_le(header, *static_cast<const PayloadHeaderRaw *>(entry.buffer));
+			if (size_t(header.payload_size) + sizeof(PayloadHeaderRaw) != size)
 				return false;
+
+			if (header.format == FOSSILIZE_COMPRESSION_LZ4_DICTIONARY)
+			{
+				// The payload is useless unless this archive also holds the dictionary it refers to.
+				uint64_t id = 0;
+				if (header.payload_size >= sizeof(id))
+					convert_from_le64(&id, blob + sizeof(PayloadHeaderRaw), 1);
+				if (header.payload_size < sizeof(id) || !dictionary_entries.count(id))
+				{
+					LOGE_LEVEL("Raw payload refers to compression dictionary %016" PRIx64 " which is not in the archive.\n", id);
+					return false;
+				}
+			}
+
+			// The raw payload already contains the header, so just copy it straight through.
+			buffer.resize(payload_offset - sizeof(PayloadHeaderRaw));
+			buffer.insert(buffer.end(), blob, blob + size);
+		}
+		else if ((entry.flags & PAYLOAD_WRITE_COMPRESS_BIT) != 0)
+		{
+			// Compress straight into the batch buffer and shrink it afterwards.
+			size_t zsize;
+			uint32_t format;
+
+			const CompressionDictionary *dictionary = nullptr;
+			if ((entry.flags & PAYLOAD_WRITE_DICTIONARY_BIT) != 0 && unsigned(entry.tag) < RESOURCE_COUNT &&
+			    active_dictionaries[entry.tag] != 0)
+			{
+				dictionary = &dictionaries[active_dictionaries[entry.tag] - 1];
+			}
+
+			if (dictionary)
+			{
+				// The payload is the ID of the dictionary followed by the LZ4 block.
+				size_t bound = compute_max_size_lz4(size);
+				buffer.resize(payload_offset + sizeof(Hash) + bound);
+				convert_to_le64(buffer.data() + payload_offset, &dictionary->id, 1);
+				zsize = encode_lz4_dictionary(buffer.data() + payload_offset + sizeof(Hash), bound,
+				                              blob, size, dictionary->dict);
+				if (zsize == 0)
+				{
+					buffer.resize(base_offset);
+					return false;
+				}
+				zsize += sizeof(Hash);
+				format = FOSSILIZE_COMPRESSION_LZ4_DICTIONARY;
+
+				// Deflate is a lot better than LZ4 without a dictionary, so it can still win for large payloads.
+				if ((entry.flags & PAYLOAD_WRITE_BEST_COMPRESSION_BIT) != 0)
+				{
+					mz_ulong mz_size = mz_compressBound(size);
+					scratch.resize(mz_size);
+					if (mz_compress2(scratch.data(), &mz_size, blob, size, MZ_BEST_COMPRESSION) == MZ_OK &&
+					    mz_size < zsize)
+					{
+						memcpy(buffer.data() + payload_offset, scratch.data(), mz_size);
+						zsize = mz_size;
+						format = FOSSILIZE_COMPRESSION_DEFLATE;
+					}
+				}
+			}
+			else if ((entry.flags & PAYLOAD_WRITE_FAST_COMPRESSION_BIT) != 0)
+			{
+				size_t bound = compute_max_size_lz4(size);
+				buffer.resize(payload_offset + bound);
+				zsize = encode_lz4(buffer.data() + payload_offset, bound, blob, size);
+				if (zsize == 0)
+				{
+					buffer.resize(base_offset);
+					return false;
+				}
+				format = FOSSILIZE_COMPRESSION_LZ4;
+			}
+			else
+			{
+				mz_ulong mz_size = mz_compressBound(size);
+				buffer.resize(payload_offset + mz_size);
+
+				if (mz_compress2(buffer.data() + payload_offset, &mz_size, blob, size,
+				                 (entry.flags & PAYLOAD_WRITE_BEST_COMPRESSION_BIT) != 0 ? MZ_BEST_COMPRESSION : MZ_BEST_SPEED) != MZ_OK)
+				{
+					buffer.resize(base_offset);
+					return false;
+				}
+				zsize = mz_size;
+				format = FOSSILIZE_COMPRESSION_DEFLATE;
+			}
+
+			header = {};
+			header.payload_size = uint32_t(zsize);
+			header.format = format;
+			header.uncompressed_size = uint32_t(size);
+			if ((entry.flags & PAYLOAD_WRITE_COMPUTE_CHECKSUM_BIT) != 0)
+				header.crc = compute_crc32(0, buffer.data() + payload_offset, zsize);
+
+			buffer.resize(payload_offset + zsize);
+			convert_to_le(*reinterpret_cast<PayloadHeaderRaw *>(buffer.data() + payload_offset - sizeof(PayloadHeaderRaw)),
+			              header);
 		}
 		else
 		{
 			uint32_t crc = 0;
-			if ((flags & PAYLOAD_WRITE_COMPUTE_CHECKSUM_BIT) != 0)
-				crc = uint32_t(mz_crc32(MZ_CRC32_INIT, static_cast<const unsigned char *>(blob), size));
+			if ((entry.flags & PAYLOAD_WRITE_COMPUTE_CHECKSUM_BIT) != 0)
+				crc = compute_crc32(0, blob, size);
+
+			header = { uint32_t(size), FOSSILIZE_COMPRESSION_NONE, crc, uint32_t(size) };
+			buffer.resize(payload_offset);
+			convert_to_le(*reinterpret_cast<PayloadHeaderRaw *>(buffer.data() + payload_offset - sizeof(PayloadHeaderRaw)),
+			              header);
+			buffer.insert(buffer.end(), blob, blob + size);
+		}
+
+		char str[FOSSILIZE_BLOB_HASH_LENGTH + 1]; // 40 digits + null
+		format_entry_name(str, entry.tag, entry.hash);
+		memcpy(buffer.data() + base_offset, str, FOSSILIZE_BLOB_HASH_LENGTH);
+		return true;
+	}
+
+	bool write_index() override
+	{
+		if (!alive || mode == DatabaseMode::ReadOnly || !supports_index())
+			return false;
+
+		sync_write_behind();
+
+		// If entries were filtered out or a write failed, we cannot describe the archive faithfully.
+		if (!index_is_complete)
+			return false;
+
+		// Nothing was written since we wrote the index, so it is still valid.
+		if (index_truncate_pending)
+			return true;
+
+		// If the archive already had an index when we opened it, that index is kept,
+		// and only the entries after it are described by a segment chained to it.
+		const bool segment = segment_offset > MagicSize;
+		if (segment && write_offset == segment_offset)
+			return true;
+
+		const auto in_segment = [&](const Entry &entry) -> bool {
+			return entry.offset > segment_offset;
+		};
+
+		std::vector<uint64_t> record_counts(RESOURCE_COUNT);
+		size_t dictionary_count = 0;
+		for (unsigned tag = 0; tag < RESOURCE_COUNT; tag++)
+		{
+			seen_blobs[tag].for_each([&](Hash, const Entry &entry) {
+				if (in_segment(entry))
+					record_counts[tag]++;
+			});
+		}
+		dictionary_entries.for_each([&](Hash, const Entry &entry) {
+			if (in_segment(entry))
+				dictionary_count++;
+		});
+
+		size_t record_count = dictionary_count;
+		for (auto count : record_counts)
+			record_count += count;
+
+		const uint32_t version = segment ? uint32_t(IndexVersionSegment) :
+		                         // Readers which only know about version 1 would not know to skip the dictionary records.
+		                         dictionary_count ? uint32_t(IndexVersionDictionaries) : uint32_t(IndexVersion);
+
+		size_t payload_size = 8 + RESOURCE_COUNT * sizeof(uint64_t) + record_count * IndexRecordSize +
+		                      get_index_trailer_size(version);
+		if (payload_size > UINT32_MAX)
+			return false;
+
+		std::vector<uint8_t> payload(payload_size);
+		uint8_t *ptr = payload.data();
+
+		uint32_t tag_count = RESOURCE_COUNT;
+		uint32_t dictionary_count_le = uint32_t(dictionary_count);
+		convert_to_le(ptr, &tag_count, 1);
+		convert_to_le(ptr + 4, &dictionary_count_le, 1);
+		ptr += 8;
+
+		convert_to_le64(ptr, record_counts.data(), RESOURCE_COUNT);
+		ptr += RESOURCE_COUNT * sizeof(uint64_t);
+
+		std::vector<std::pair<Hash, Entry>> sorted_entries;
+		for (unsigned tag = 0; tag < RESOURCE_COUNT; tag++)
+		{
+			sorted_entries.clear();
+			sorted_entries.reserve(record_counts[tag]);
+			seen_blobs[tag].for_each([&](Hash hash, const Entry &entry) {
+				if (in_segment(entry))
+					sorted_entries.emplace_back(hash, entry);
+			});
+
+			std::sort(sorted_entries.begin(), sorted_entries.end(),
+			          [](const std::pair<Hash, Entry> &a, const std::pair<Hash, Entry> &b) {
+				          return a.first < b.first;
+			          });
+
+			for (auto &blob : sorted_entries)
+			{
+				convert_to_le64(ptr + 0, &blob.first, 1);
+				convert_to_le64(ptr + 8, &blob.second.offset, 1);
+				convert_to_le(*reinterpret_cast<PayloadHeaderRaw *>(ptr + 16), blob.second.header);
+				ptr += IndexRecordSize;
+			}
+		}
+
+		dictionary_entries.for_each([&](Hash hash, const Entry &entry) {
+			if (!in_segment(entry))
+				return;
+			convert_to_le64(ptr + 0, &hash, 1);
+			convert_to_le64(ptr + 8, &entry.offset, 1);
+			convert_to_le(*reinterpret_cast<PayloadHeaderRaw *>(ptr + 16), entry.header);
+			ptr += IndexRecordSize;
+		});
+
+		if (segment)
+		{
+			convert_to_le64(ptr, &segment_offset, 1);
+			ptr += IndexSegmentOffsetSize;
+		}
+
+		uint64_t index_offset = write_offset;
+		convert_to_le64(ptr + 0, &index_offset, 1);
+		convert_to_le(ptr + 8, &version, 1);
+		memcpy(ptr + 16, stream_index_magic, sizeof(stream_index_magic));
+
+		PayloadHeader header = {};
+		header.payload_size = uint32_t(payload_size);
+		header.format = FOSSILIZE_COMPRESSION_NONE;
+		header.crc = compute_crc32(0, payload.data(), payload.size());
+		header.uncompressed_size = uint32_t(payload_size);
+		PayloadHeaderRaw header_raw = {};
+		convert_to_le(header_raw, header);
+
+		char str[FOSSILIZE_BLOB_HASH_LENGTH + 1]; // 40 digits + null
+		format_entry_name(str, IndexTag, 0);
+
+		if (fwrite(str, 1, FOSSILIZE_BLOB_HASH_LENGTH, file) != FOSSILIZE_BLOB_HASH_LENGTH ||
+		    fwrite(&header_raw, 1, sizeof(header_raw), file) != sizeof(header_raw) ||
+		    fwrite(payload.data(), 1, payload.size(), file) != payload.size())
+		{
+			index_is_complete = false;
+			return false;
+		}
+
+		// If we appended on top of a sliced entry, drop whatever was left of it, since the index must end the file.
+		if (!truncate_file(index_offset + FOSSILIZE_BLOB_HASH_LENGTH + sizeof(header_raw) + payload.size()))
+			return false;
+
+		// Any further writes will replace the index we just wrote.
+		index_truncate_pending = true;
+		return true;
+	}
+
+	// Appends every entry in source which we don't have yet, without decoding anything.
+	// Entries which are stored back to back in the source are copied as one range.
+	bool append_raw_entries_from(StreamArchive &source)
+	{
+		if (!alive || mode == DatabaseMode::ReadOnly || !source.alive || source.imported_metadata)
+			return false;
+
+		sync_write_behind();
+
+		struct SourceEntry
+		{
+			ResourceTag tag;
+			Hash hash;
+			Entry entry;
+		};
+		std::vector<SourceEntry> entries;
+
+		for (unsigned i = 0; i < RESOURCE_COUNT; i++)
+		{
+			auto tag = static_cast<ResourceTag>(i);
+			source.seen_blobs[i].for_each([&](Hash hash, const Entry &entry) {
+				if (!seen_blobs[i].count(hash))
+					entries.push_back({ tag, hash, entry });
+			});
+		}
+
+		std::sort(entries.begin(), entries.end(), [](const SourceEntry &a, const SourceEntry &b) {
+			return a.entry.offset < b.entry.offset;
+		});
+
+		if (!entries.empty() && !begin_write())
+			return false;
+
+		for (auto &entry : entries)
+			if (!require_archive_version(get_required_archive_version(entry.entry.header.format)))
+				return false;
+
+		// Copied payloads may refer to dictionaries of the source, so those have to come along.
+		bool needs_dictionaries = std::any_of(entries.begin(), entries.end(), [](const SourceEntry &entry) {
+			return entry.entry.header.format == FOSSILIZE_COMPRESSION_LZ4_DICTIONARY;
+		});
+
+		bool ret = true;
+		source.dictionary_entries.for_each([&](Hash id, const Entry &) {
+			if (!ret || !needs_dictionaries || dictionary_entries.count(id))
+				return;
+
+			auto *dictionary = source.find_dictionary(id);
+			if (!dictionary)
+			{
+				LOGE_LEVEL("Compression dictionary %016" PRIx64 " could not be loaded from source.\n", id);
+				ret = false;
+			}
+			else if (!write_dictionary_entry(id, dictionary->dict.data.data(), dictionary->dict.data.size()))
+				ret = false;
+		});
+
+		if (!ret)
+			return false;
 
-			PayloadHeader header = { uint32_t(size), FOSSILIZE_COMPRESSION_NONE, crc, uint32_t(size) };
-			PayloadHeaderRaw raw = {};
-			convert_to_le(raw, header);
+		constexpr uint64_t EntryHeaderSize = FOSSILIZE_BLOB_HASH_LENGTH + sizeof(PayloadHeaderRaw);
+		size_t run_begin = 0;
+		while (run_begin < entries.size())
+		{
+			uint64_t range_begin = entries[run_begin].entry.offset - EntryHeaderSize;
+			uint64_t range_end = entries[run_begin].entry.offset + entries[run_begin].entry.header.payload_size;
+
+			// Duplicates and entries we don't understand break up the run.
+			size_t run_end = run_begin + 1;
+			while (run_end < entries.size() && entries[run_end].entry.offset - EntryHeaderSize == range_end)
+			{
+				range_end = entries[run_end].entry.offset + entries[run_end].entry.header.payload_size;
+				run_end++;
+			}
 
-			if (fwrite(&raw, 1, sizeof(raw), file) != sizeof(raw))
+			if (!copy_range_from(source, range_begin, range_end - range_begin))
+			{
+				index_is_complete = false;
 				return false;
+			}
+
+			for (size_t i = run_begin; i < run_end; i++)
+			{
+				Entry entry = entries[i].entry;
+				entry.offset = entry.offset - range_begin + write_offset;
+				seen_blobs[entries[i].tag].emplace(entries[i].hash, entry);
+			}
+
+			write_offset += range_end - range_begin;
+			run_begin = run_end;
+		}
+
+		return true;
+	}
+
+	bool copy_range_from(StreamArchive &source, uint64_t offset, uint64_t size)
+	{
+		if (!begin_write())
+			return false;
+
+#if defined(__linux__) && defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+		// Let the kernel move the data directly between the files.
+		if (fflush(file) != 0)
+			return false;
+
+		loff_t src_offset = loff_t(offset);
+		loff_t dst_offset = loff_t(write_offset);
+		while (size)
+		{
+			ssize_t copied = copy_file_range(fileno(source.file), &src_offset, fileno(file), &dst_offset, size, 0);
+			if (copied < 0 && errno == EINTR)
+				continue;
+			if (copied <= 0)
+				break;
+			size -= uint64_t(copied);
+		}
+
+		// The FILE position does not know about the copy.
+		if (fseek(file, long(dst_offset), SEEK_SET) < 0)
+			return false;
+
+		// If the kernel cannot copy between these files, e.g. across file systems, fall back to a bounce buffer.
+		offset = uint64_t(src_offset);
+#endif
 
-			if (fwrite(blob, 1, size, file) != size)
+		constexpr size_t ChunkSize = 1024 * 1024;
+		write_batch_buffer.resize(size_t(std::min<uint64_t>(size, ChunkSize)));
+		while (size)
+		{
+			size_t to_copy = size_t(std::min<uint64_t>(size, ChunkSize));
+			if (!source.read_range(write_batch_buffer.data(), offset, to_copy))
 				return false;
+			if (fwrite(write_batch_buffer.data(), 1, to_copy, file) != to_copy)
+				return false;
+			offset += to_copy;
+			size -= to_copy;
 		}
 
-		// The entry is irrelevant, we're not going to read from this archive any time soon.
-		seen_blobs[tag].emplace(hash, Entry{});
 		return true;
 	}
 
@@ -1491,11 +3494,13 @@ struct StreamArchive : DatabaseInterface
 		if (imported_metadata)
 			return find_entry_from_metadata(imported_metadata, tag, hash, nullptr);
 		else
-			return seen_blobs[tag].count(hash) != 0;
+			return seen_blobs[tag].count(hash) != 0 || (write_behind && write_behind_pending[tag].count(hash) != 0);
 	}
 
 	bool get_hash_list_for_resource_tag(ResourceTag tag, size_t *hash_count, Hash *hashes) override
 	{
+		sync_write_behind();
+
 		if (imported_metadata)
 		{
 			size_t size = imported_metadata->lists[tag].count;
@@ -1509,10 +3514,12 @@ struct StreamArchive : DatabaseInterface
 
 			if (hashes)
 			{
-				const auto *blocks = reinterpret_cast<const ExportedMetadataBlock *>(
+				const auto *imported_hashes = reinterpret_cast<const Hash *>(
 						reinterpret_cast<const uint8_t *>(imported_metadata) + imported_metadata->lists[tag].offset);
-				for (size_t i = 0; i < size; i++)
-					hashes[i] = blocks[i].hash;
+				Hash *iter = hashes;
+				traverse_eytzinger_in_order(size, [&](size_t index) {
+					*iter++ = imported_hashes[index];
+				});
 			}
 		}
 		else
@@ -1529,8 +3536,9 @@ struct StreamArchive : DatabaseInterface
 			if (hashes)
 			{
 				Hash *iter = hashes;
-				for (auto &blob : seen_blobs[tag])
-					*iter++ = blob.first;
+				seen_blobs[tag].for_each([&](Hash hash, const Entry &) {
+					*iter++ = hash;
+				});
 
 				// Make replay more deterministic.
 				sort(hashes, hashes + size);
@@ -1540,24 +3548,79 @@ struct StreamArchive : DatabaseInterface
 		return true;
 	}
 
-	bool decode_payload_uncompressed(void *blob, size_t blob_size, const Entry &entry, bool concurrent)
+	static void add_entry_statistics(DatabaseTagStatistics &stats, const PayloadHeader &header)
 	{
-		if (entry.header.uncompressed_size != blob_size || entry.header.payload_size != blob_size)
+		uint32_t uncompressed_size =
+				header.format == FOSSILIZE_COMPRESSION_NONE ? header.payload_size : header.uncompressed_size;
+
+		stats.entry_count++;
+		if (header.format != FOSSILIZE_COMPRESSION_NONE)
+			stats.compressed_entry_count++;
+		stats.stored_bytes += header.payload_size;
+		stats.uncompressed_bytes += uncompressed_size;
+
+		unsigned bucket = 0;
+		while (bucket + 1 < DatabaseStatisticsHistogramBuckets && (uncompressed_size >> (bucket + 1)) != 0)
+			bucket++;
+		stats.size_histogram[bucket]++;
+	}
+
+	bool get_statistics(DatabaseStatistics *stats) override
+	{
+		if (!alive)
 			return false;
 
+		sync_write_behind();
+		*stats = {};
+
+		if (imported_metadata)
 		{
-			ConditionalLockGuard holder(read_lock, concurrent);
-			if (fseek(file, entry.offset, SEEK_SET) < 0)
-				return false;
+			const auto *base = reinterpret_cast<const uint8_t *>(imported_metadata);
+			for (unsigned tag = 0; tag < RESOURCE_COUNT; tag++)
+			{
+				auto &list = imported_metadata->lists[tag];
+				auto *payloads = reinterpret_cast<const ExportedMetadataPayload *>(
+						base + list.offset + list.count * sizeof(Hash));
+				for (uint64_t i = 0; i < list.count; i++)
+					add_entry_statistics(stats->tags[tag], payloads[i].payload);
+			}
 
-			size_t read_size = entry.header.payload_size;
-			if (fread(blob, 1, read_size, file) != read_size)
-				return false;
+			auto &list = imported_metadata->dictionaries;
+			auto *payloads = reinterpret_cast<const ExportedMetadataPayload *>(
+					base + list.offset + list.count * sizeof(Hash));
+			for (uint64_t i = 0; i < list.count; i++)
+				stats->dictionary_bytes += payloads[i].payload.payload_size;
+			stats->dictionary_count = list.count;
+		}
+		else
+		{
+			for (unsigned tag = 0; tag < RESOURCE_COUNT; tag++)
+			{
+				seen_blobs[tag].for_each([&](Hash, const Entry &entry) {
+					add_entry_statistics(stats->tags[tag], entry.header);
+				});
+			}
+
+			dictionary_entries.for_each([&](Hash, const Entry &entry) {
+				stats->dictionary_bytes += entry.header.payload_size;
+			});
+			stats->dictionary_count = dictionary_entries.size();
 		}
 
+		return true;
+	}
+
+	bool decode_payload_uncompressed(void *blob, size_t blob_size, const Entry &entry)
+	{
+		if (entry.header.uncompressed_size != blob_size || entry.header.payload_size != blob_size)
+			return false;
+
+		if (!read_range(blob, entry.offset, entry.header.payload_size))
+			return false;
+
 		if (entry.header.crc != 0) // Verify checksum.
 		{
-			auto disk_crc = uint32_t(mz_crc32(MZ_CRC32_INIT, static_cast<unsigned char *>(blob), blob_size));
+			auto disk_crc = compute_crc32(0, blob, blob_size);
 			if (disk_crc != entry.header.crc)
 			{
 				LOGE_LEVEL("CRC mismatch!\n");
@@ -1568,20 +3631,29 @@ struct StreamArchive : DatabaseInterface
 		return true;
 	}
 
-	bool decode_payload_deflate(void *blob, size_t blob_size, const Entry &entry, bool concurrent)
+	// Returns the stored payload of a compressed entry, either straight from the mapping or read into a scratch buffer.
+	// The checksum is verified before returning.
+	const uint8_t *read_compressed_payload(const Entry &entry, bool concurrent)
 	{
-		if (entry.header.uncompressed_size != blob_size)
-			return false;
-
-		uint8_t *dst_zlib_buffer = nullptr;
-		std::unique_ptr<uint8_t[]> zlib_buffer_holder;
+		const uint8_t *payload = nullptr;
 
+		if (mapped_file)
+		{
+			// Decode straight from the mapping. No need to copy anything.
+			payload = get_mapped_range(entry.offset, entry.header.payload_size);
+			if (!payload)
+				return nullptr;
+		}
+		else
 		{
-			ConditionalLockGuard holder(read_lock, concurrent);
+			uint8_t *read_buffer = nullptr;
 			if (concurrent)
 			{
-				dst_zlib_buffer = new uint8_t[entry.header.payload_size];
-				zlib_buffer_holder.reset(dst_zlib_buffer);
+				// zlib_buffer is shared by all threads, so use a scratch buffer owned by the calling thread.
+				static thread_local std::vector<uint8_t> concurrent_zlib_buffer;
+				if (concurrent_zlib_buffer.size() < entry.header.payload_size)
+					concurrent_zlib_buffer.resize(entry.header.payload_size);
+				read_buffer = concurrent_zlib_buffer.data();
 			}
 			else if (zlib_buffer_size < entry.header.payload_size)
 			{
@@ -1599,44 +3671,94 @@ struct StreamArchive : DatabaseInterface
 				}
 
 				if (!zlib_buffer)
-					return false;
+					return nullptr;
 
-				dst_zlib_buffer = zlib_buffer;
+				read_buffer = zlib_buffer;
 			}
 			else
-				dst_zlib_buffer = zlib_buffer;
+				read_buffer = zlib_buffer;
 
-			if (fseek(file, entry.offset, SEEK_SET) < 0)
-				return false;
-			if (fread(dst_zlib_buffer, 1, entry.header.payload_size, file) != entry.header.payload_size)
-				return false;
+			if (!read_range(read_buffer, entry.offset, entry.header.payload_size))
+				return nullptr;
+			payload = read_buffer;
 		}
 
 		if (entry.header.crc != 0) // Verify checksum.
 		{
-			auto disk_crc = uint32_t(mz_crc32(MZ_CRC32_INIT, dst_zlib_buffer, entry.header.payload_size));
+			auto disk_crc = compute_crc32(0, payload, entry.header.payload_size);
 			if (disk_crc != entry.header.crc)
 			{
 				LOGE_LEVEL("CRC mismatch!\n");
-				return false;
+				return nullptr;
 			}
 		}
 
+		return payload;
+	}
+
+	bool decode_payload_deflate(void *blob, size_t blob_size, const Entry &entry, bool concurrent)
+	{
+		if (entry.header.uncompressed_size != blob_size)
+			return false;
+
+		const uint8_t *dst_zlib_buffer = read_compressed_payload(entry, concurrent);
+		if (!dst_zlib_buffer)
+			return false;
+
 		mz_ulong zsize = blob_size;
 		if (mz_uncompress(static_cast<unsigned char *>(blob), &zsize, dst_zlib_buffer, entry.header.payload_size) != MZ_OK)
 			return false;
-		if (zsize != blob_size)
+		if (zsize != blob_size)
+			return false;
+
+		return true;
+	}
+
+	bool decode_payload_lz4(void *blob, size_t blob_size, const Entry &entry, bool concurrent)
+	{
+		if (entry.header.uncompressed_size != blob_size)
+			return false;
+
+		const uint8_t *dst_lz4_buffer = read_compressed_payload(entry, concurrent);
+		if (!dst_lz4_buffer)
+			return false;
+
+		return decode_lz4(static_cast<uint8_t *>(blob), blob_size, dst_lz4_buffer, entry.header.payload_size);
+	}
+
+	bool decode_payload_lz4_dictionary(void *blob, size_t blob_size, const Entry &entry, bool concurrent)
+	{
+		if (entry.header.uncompressed_size != blob_size || entry.header.payload_size < sizeof(Hash))
+			return false;
+
+		const uint8_t *dst_lz4_buffer = read_compressed_payload(entry, concurrent);
+		if (!dst_lz4_buffer)
+			return false;
+
+		Hash id;
+		convert_from_le64(&id, dst_lz4_buffer, 1);
+		auto *dictionary = find_dictionary(id);
+		if (!dictionary)
+		{
+			LOGE_LEVEL("Compression dictionary %016" PRIx64 " is missing.\n", id);
 			return false;
+		}
 
-		return true;
+		return decode_lz4_dictionary(static_cast<uint8_t *>(blob), blob_size,
+		                             dst_lz4_buffer + sizeof(Hash), entry.header.payload_size - sizeof(Hash),
+		                             dictionary->dict.data.data(), dictionary->dict.data.size());
 	}
 
 	bool decode_payload(void *blob, size_t blob_size, const Entry &entry, bool concurrent)
 	{
 		if (entry.header.format == FOSSILIZE_COMPRESSION_NONE)
-			return decode_payload_uncompressed(blob, blob_size, entry, concurrent);
+			return decode_payload_uncompressed(blob, blob_size, entry);
 		else if (entry.header.format == FOSSILIZE_COMPRESSION_DEFLATE)
 			return decode_payload_deflate(blob, blob_size, entry, concurrent);
+		else if (entry.header.format == FOSSILIZE_COMPRESSION_LZ4)
+			return decode_payload_lz4(blob, blob_size, entry, concurrent);
+		else if (entry.header.format == FOSSILIZE_COMPRESSION_LZ4_DICTIONARY)
+			return decode_payload_lz4_dictionary(blob, blob_size, entry, concurrent);
 		else
 			return false;
 	}
@@ -1653,7 +3775,8 @@ struct StreamArchive : DatabaseInterface
 	{
 		size_t size = sizeof(ExportedMetadataHeader);
 		for (auto &blobs : seen_blobs)
-			size += blobs.size() * sizeof(ExportedMetadataBlock);
+			size += blobs.size() * (sizeof(Hash) + sizeof(ExportedMetadataPayload));
+		size += dictionary_entries.size() * (sizeof(Hash) + sizeof(ExportedMetadataPayload));
 		return size;
 	}
 
@@ -1672,33 +3795,51 @@ struct StreamArchive : DatabaseInterface
 		{
 			header->lists[i].offset = offset;
 			header->lists[i].count = seen_blobs[i].size();
-			offset += header->lists[i].count * sizeof(ExportedMetadataBlock);
+			offset += header->lists[i].count * (sizeof(Hash) + sizeof(ExportedMetadataPayload));
 		}
 
+		header->filter = {};
+		header->dictionaries.offset = offset;
+		header->dictionaries.count = dictionary_entries.size();
+		offset += header->dictionaries.count * (sizeof(Hash) + sizeof(ExportedMetadataPayload));
+
 		if (offset != size)
 			return false;
 
-		for (unsigned i = 0; i < RESOURCE_COUNT; i++)
 		{
-			auto *blocks = reinterpret_cast<ExportedMetadataBlock *>(data + header->lists[i].offset);
-			auto *pblocks = blocks;
+			auto *hashes = reinterpret_cast<Hash *>(data + header->dictionaries.offset);
+			auto *payloads = reinterpret_cast<ExportedMetadataPayload *>(hashes + header->dictionaries.count);
+			dictionary_entries.for_each([&](Hash hash, const Entry &entry) {
+				*hashes++ = hash;
+				payloads->file_offset = entry.offset;
+				payloads->payload = entry.header;
+				payloads++;
+			});
+		}
 
-			for (auto &blob : seen_blobs[i])
-			{
-				auto &block = *pblocks;
-				block.hash = blob.first;
-				block.file_offset = blob.second.offset;
-				block.payload = blob.second.header;
-				pblocks++;
-			}
+		for (unsigned i = 0; i < RESOURCE_COUNT; i++)
+		{
+			std::vector<std::pair<Hash, Entry>> sorted_entries;
+			sorted_entries.reserve(seen_blobs[i].size());
+			seen_blobs[i].for_each([&](Hash hash, const Entry &entry) {
+				sorted_entries.emplace_back(hash, entry);
+			});
 
-			// Sorting here is somewhat important, since we will be using binary search when looking up exported metadata.
-			// Conserving memory is also somewhat important, so we should only have one copy of the data structures we need
-			// in immutable shared memory.
-			// For hashmaps we would either need to make a completely custom SHM compatible hashmap implementation, which
-			// would likely consume more memory either way.
-			std::sort(blocks, blocks + seen_blobs[i].size(), [](const ExportedMetadataBlock &a, const ExportedMetadataBlock &b) {
-				return a.hash < b.hash;
+			// We need a search tree in immutable shared memory. Hashmaps would require a completely custom
+			// SHM compatible implementation, which would likely consume more memory either way.
+			std::sort(sorted_entries.begin(), sorted_entries.end(),
+			          [](const std::pair<Hash, Entry> &a, const std::pair<Hash, Entry> &b) {
+				          return a.first < b.first;
+			          });
+
+			size_t count = sorted_entries.size();
+			auto *hashes = reinterpret_cast<Hash *>(data + header->lists[i].offset);
+			auto *payloads = reinterpret_cast<ExportedMetadataPayload *>(hashes + count);
+
+			build_eytzinger_order(count, 1, 0, [&](size_t dst, size_t src) {
+				hashes[dst] = sorted_entries[src].first;
+				payloads[dst].file_offset = sorted_entries[src].second.offset;
+				payloads[dst].payload = sorted_entries[src].second.header;
 			});
 		}
 
@@ -1719,13 +3860,85 @@ struct StreamArchive : DatabaseInterface
 
 	const ExportedMetadataHeader *imported_metadata = nullptr;
 	FILE *file = nullptr;
+	const uint8_t *mapped_file = nullptr;
+	size_t mapped_file_size = 0;
+	uint64_t write_offset = 0;
+	int archive_version = FOSSILIZE_FORMAT_VERSION;
+	bool index_truncate_pending = false;
+	bool index_is_complete = true;
+	// Entries before this offset are described by indices which stay in the archive.
+	uint64_t segment_offset = MagicSize;
+	bool wrote_entries = false;
+	bool seal_on_close = false;
 	string path;
-	unordered_map<Hash, Entry> seen_blobs[RESOURCE_COUNT];
+	FlatHashMap<Entry> seen_blobs[RESOURCE_COUNT];
+	FlatHashMap<Entry> dictionary_entries;
 	DatabaseMode mode;
 	uint8_t *zlib_buffer = nullptr;
 	size_t zlib_buffer_size = 0;
 	bool alive = false;
-	std::mutex read_lock;
+
+	struct BatchedEntry
+	{
+		ResourceTag tag;
+		Hash hash;
+		Entry entry;
+	};
+	std::vector<uint8_t> write_batch_buffer;
+	std::vector<BatchedEntry> write_batch_entries;
+	FlatHashMap<uint32_t> write_batch_hashes;
+
+	std::vector<CompressionDictionary> dictionaries;
+	FlatHashMap<uint32_t> dictionary_indices;
+	// Index + 1 into dictionaries, 0 if the tag has no dictionary.
+	uint32_t active_dictionaries[RESOURCE_COUNT] = {};
+	std::vector<uint8_t> compress_scratch;
+
+	struct WriteBehindJob
+	{
+		ResourceTag tag;
+		Hash hash;
+		PayloadWriteFlags flags;
+		size_t blob_size;
+		std::vector<uint8_t> blob;
+		std::vector<uint8_t> encoded;
+		PayloadHeader header;
+		Entry entry;
+		bool encoded_ok = false;
+		bool done = false;
+	};
+
+	struct WriteBehind
+	{
+		std::mutex lock;
+		std::condition_variable cond;
+		// Jobs in submission order, which is also the order they are written in.
+		std::deque<std::unique_ptr<WriteBehindJob>> write_queue;
+		std::deque<WriteBehindJob *> encode_queue;
+		// Written entries, or entries with offset 0 if they failed. Moved into seen_blobs by the calling thread.
+		std::vector<BatchedEntry> results;
+		std::vector<std::thread> workers;
+		std::thread io_thread;
+		size_t in_flight_bytes = 0;
+		size_t in_flight_jobs = 0;
+		size_t max_in_flight_bytes = 0;
+		bool stop = false;
+		// Sticky, so that callers learn about failures even though write_entries() returned before they happened.
+		bool failed = false;
+	};
+	std::unique_ptr<WriteBehind> write_behind;
+	// Entries which are queued, but not yet in seen_blobs.
+	std::unordered_set<Hash> write_behind_pending[RESOURCE_COUNT];
+	unsigned write_behind_worker_count = 0;
+	size_t write_behind_max_in_flight_bytes = 0;
+
+	struct
+	{
+		uint64_t index_offset = 0;
+		uint64_t records_offset = 0;
+		std::vector<uint64_t> record_counts;
+		bool valid = false;
+	} sorted_index;
 
 protected:
 	virtual PayloadHeader get_converted_header(PayloadHeaderRaw header_raw)
@@ -1765,7 +3978,7 @@ struct DumbFileDatabase : StreamArchive
 	DumbFileDatabase(const string& path_, DatabaseMode mode_) : StreamArchive(path_, mode_)
 	{}
 
-	bool read_entry(ResourceTag tag, Hash hash, size_t *blob_size, void *blob, PayloadReadFlags flags) override
+	bool read_entry(ResourceTag tag, Hash hash, size_t *blob_size, void *blob, PayloadReadFlags) override
 	{
 		if (!alive || mode != DatabaseMode::ReadOnly)
 			return false;
@@ -1785,12 +3998,7 @@ struct DumbFileDatabase : StreamArchive
 
 		if (blob)
 		{
-			// Include the header.
-			ConditionalLockGuard holder(read_lock, (flags & PAYLOAD_READ_CONCURRENT_BIT) != 0);
-			if (fseek(file, entry.offset, SEEK_SET) < 0)
-				return false;
-
-			if (fread(blob, 1, out_size, file) != out_size)
+			if (!read_range(blob, entry.offset, out_size))
 				return false;
 		}
 
@@ -1802,8 +4010,7 @@ struct DumbFileDatabase : StreamArchive
 		if (!alive || mode == DatabaseMode::ReadOnly)
 			return false;
 
-		auto itr = seen_blobs[tag].find(hash);
-		if (itr != end(seen_blobs[tag]))
+		if (seen_blobs[tag].count(hash))
 			return true;
 
 		char str[FOSSILIZE_BLOB_HASH_LENGTH + 1]; // 40 digits + null
@@ -1815,7 +4022,7 @@ struct DumbFileDatabase : StreamArchive
 
 		uint32_t crc = 0;
 		if ((flags & PAYLOAD_WRITE_COMPUTE_CHECKSUM_BIT) != 0)
-			crc = uint32_t(mz_crc32(MZ_CRC32_INIT, static_cast<const unsigned char*>(blob), size));
+			crc = compute_crc32(0, blob, size);
 
 		PayloadHeader header = { uint32_t(size), FOSSILIZE_COMPRESSION_NONE, crc, uint32_t(size) };
 		PayloadHeaderRaw raw = {};
@@ -1832,7 +4039,30 @@ struct DumbFileDatabase : StreamArchive
 		return true;
 	}
 
+	bool write_entries(const DatabaseWriteEntry *entries, size_t count) override
+	{
+		// Entries are written in the text based format, so don't use the stream archive encoder.
+		return DatabaseInterface::write_entries(entries, count);
+	}
+
+	// Write-behind queues entries for the encoder, which this format bypasses.
+	bool set_write_behind(unsigned, size_t) override
+	{
+		return false;
+	}
+
+	// The text format has no room for the binary dictionary record.
+	bool set_compression_dictionary(ResourceTag, const void *, size_t) override
+	{
+		return false;
+	}
+
 protected:
+	bool supports_index() const override
+	{
+		return false;
+	}
+
 	PayloadHeader get_converted_header(PayloadHeaderRaw header_raw) override
 	{
 		PayloadHeader header;
@@ -1902,13 +4132,13 @@ struct ConcurrentDatabase : DatabaseInterface
 		}
 	}
 
-	void flush() override
+	bool flush() override
 	{
-		if (writeonly_interface)
-			writeonly_interface->flush();
+		return !writeonly_interface || writeonly_interface->flush();
 	}
 
-	void prime_read_only_hashes(DatabaseInterface &interface)
+	// Called from multiple threads, one per sub-database. Only reads shared state.
+	void collect_read_only_hashes(DatabaseInterface &interface, std::vector<Hash> *hashes_per_tag) const
 	{
 		for (unsigned i = 0; i < RESOURCE_COUNT; i++)
 		{
@@ -1916,14 +4146,67 @@ struct ConcurrentDatabase : DatabaseInterface
 			size_t num_hashes;
 			if (!interface.get_hash_list_for_resource_tag(tag, &num_hashes, nullptr))
 				return;
-			std::vector<Hash> hashes(num_hashes);
+			auto &hashes = hashes_per_tag[i];
+			hashes.resize(num_hashes);
 			if (!interface.get_hash_list_for_resource_tag(tag, &num_hashes, hashes.data()))
+			{
+				hashes.clear();
 				return;
+			}
+
+			hashes.erase(std::remove_if(hashes.begin(), hashes.end(), [&](Hash hash) {
+				return !test_resource_filter(tag, hash);
+			}), hashes.end());
+		}
+	}
+
+	void prime_read_only_hashes(const std::vector<DatabaseInterface *> &interfaces)
+	{
+		std::vector<std::vector<Hash>> hash_lists(interfaces.size() * RESOURCE_COUNT);
+		parallel_for(interfaces.size(), [&](size_t index) {
+			collect_read_only_hashes(*interfaces[index], &hash_lists[index * RESOURCE_COUNT]);
+		});
+
+		size_t total_primed_hashes = 0;
+		for (unsigned i = 0; i < RESOURCE_COUNT; i++)
+		{
+			size_t total_hashes = 0;
+			for (size_t index = 0; index < interfaces.size(); index++)
+				total_hashes += hash_lists[index * RESOURCE_COUNT + i].size();
+
+			auto &primed = primed_hashes[i];
+			primed.reserve(total_hashes);
+			for (size_t index = 0; index < interfaces.size(); index++)
+			{
+				auto &hashes = hash_lists[index * RESOURCE_COUNT + i];
+				primed.insert(primed.end(), hashes.begin(), hashes.end());
+				std::vector<Hash>().swap(hashes);
+			}
 
-			for (auto &hash : hashes)
-				if (test_resource_filter(tag, hash))
-					primed_hashes[i].insert(hash);
+			std::sort(primed.begin(), primed.end());
+			primed.erase(std::unique(primed.begin(), primed.end()), primed.end());
+			primed.shrink_to_fit();
+			total_primed_hashes += primed.size();
 		}
+
+		primed_filter.reset(total_primed_hashes);
+		for (unsigned i = 0; i < RESOURCE_COUNT; i++)
+			for (auto hash : primed_hashes[i])
+				primed_filter.insert(get_filter_key(ResourceTag(i), hash));
+	}
+
+	// All tags share one filter.
+	static uint64_t get_filter_key(ResourceTag tag, Hash hash)
+	{
+		return hash + uint64_t(tag) * 0x9e3779b97f4a7c15ull;
+	}
+
+	// Most lookups are for entries we have never seen, and the filter rejects those without a search.
+	bool is_primed(ResourceTag tag, Hash hash) const
+	{
+		if (!primed_filter.may_contain(get_filter_key(tag, hash)))
+			return false;
+		return std::binary_search(primed_hashes[tag].begin(), primed_hashes[tag].end(), hash);
 	}
 
 	bool setup_bucket()
@@ -1998,21 +4281,30 @@ struct ConcurrentDatabase : DatabaseInterface
 
 		if (!has_prepared_readonly)
 		{
-			// Prepare everything.
+			// Prepare everything. Many read-only archives can be passed in, so prepare them in parallel.
 			// It's okay if the database doesn't exist.
-			if (readonly_interface && !readonly_interface->prepare())
-				readonly_interface.reset();
+			std::vector<std::unique_ptr<DatabaseInterface> *> sub_databases;
+			if (readonly_interface)
+				sub_databases.push_back(&readonly_interface);
 
 			for (auto &extra : extra_readonly)
 			{
 				if (extra)
 				{
 					static_cast<StreamArchive &>(*extra).resolve_path(base_path);
-					if (!extra->prepare())
-						extra.reset();
+					sub_databases.push_back(&extra);
 				}
 			}
 
+			std::vector<uint8_t> prepared(sub_databases.size());
+			parallel_for(sub_databases.size(), [&](size_t index) {
+				prepared[index] = (*sub_databases[index])->prepare();
+			});
+
+			for (size_t i = 0; i < sub_databases.size(); i++)
+				if (!prepared[i])
+					sub_databases[i]->reset();
+
 			// Promote databases to whitelist.
 			for (unsigned index : impl->sub_databases_in_whitelist)
 			{
@@ -2030,12 +4322,14 @@ struct ConcurrentDatabase : DatabaseInterface
 			// Prime the hashmaps, however, we'll rely on concurrent metadata if we have it to avoid memory bloat.
 			if (!impl->imported_concurrent_metadata)
 			{
+				std::vector<DatabaseInterface *> interfaces;
 				if (readonly_interface)
-					prime_read_only_hashes(*readonly_interface);
-
+					interfaces.push_back(readonly_interface.get());
 				for (auto &extra : extra_readonly)
 					if (extra)
-						prime_read_only_hashes(*extra);
+						interfaces.push_back(extra.get());
+
+				prime_read_only_hashes(interfaces);
 			}
 
 			// We only need the database for priming purposes.
@@ -2080,14 +4374,16 @@ struct ConcurrentDatabase : DatabaseInterface
 		return false;
 	}
 
-	bool write_entry(ResourceTag tag, Hash hash, const void *blob, size_t blob_size, PayloadWriteFlags flags) override
+	bool can_write() const
 	{
-		if (mode != DatabaseMode::Append &&
-		    mode != DatabaseMode::AppendWithReadOnlyAccess &&
-		    mode != DatabaseMode::OverWrite)
-			return false;
+		return mode == DatabaseMode::Append ||
+		       mode == DatabaseMode::AppendWithReadOnlyAccess ||
+		       mode == DatabaseMode::OverWrite;
+	}
 
-		if (primed_hashes[tag].count(hash))
+	bool write_entry_exists(ResourceTag tag, Hash hash)
+	{
+		if (is_primed(tag, hash))
 			return true;
 
 		// All threads must have called prepare and synchronized readonly_interface from that,
@@ -2098,6 +4394,11 @@ struct ConcurrentDatabase : DatabaseInterface
 		if (writeonly_interface && writeonly_interface->has_entry(tag, hash))
 			return true;
 
+		return false;
+	}
+
+	DatabaseInterface *get_writeonly_database()
+	{
 		if (need_writeonly_database)
 		{
 			// Lazily create a new database. Open the database file exclusively to work concurrently with other processes.
@@ -2106,6 +4407,8 @@ struct ConcurrentDatabase : DatabaseInterface
 			{
 				std::string write_path = base_path + "." + std::to_string(index) + ".foz";
 				writeonly_interface.reset(create_stream_archive_database(write_path.c_str(), DatabaseMode::ExclusiveOverWrite));
+				if (write_behind_worker_count)
+					writeonly_interface->set_write_behind(write_behind_worker_count, write_behind_max_in_flight_bytes);
 				if (!writeonly_interface->prepare())
 					writeonly_interface.reset();
 			}
@@ -2113,15 +4416,63 @@ struct ConcurrentDatabase : DatabaseInterface
 			need_writeonly_database = false;
 		}
 
-		if (writeonly_interface)
-			return writeonly_interface->write_entry(tag, hash, blob, blob_size, flags);
+		return writeonly_interface.get();
+	}
+
+	bool write_entry(ResourceTag tag, Hash hash, const void *blob, size_t blob_size, PayloadWriteFlags flags) override
+	{
+		if (!can_write())
+			return false;
+
+		if (write_entry_exists(tag, hash))
+			return true;
+
+		auto *iface = get_writeonly_database();
+		if (iface)
+			return iface->write_entry(tag, hash, blob, blob_size, flags);
+		else
+			return false;
+	}
+
+	bool write_entries(const DatabaseWriteEntry *entries, size_t count) override
+	{
+		if (!can_write())
+			return false;
+
+		write_batch.clear();
+		for (size_t i = 0; i < count; i++)
+			if (!write_entry_exists(entries[i].tag, entries[i].hash))
+				write_batch.push_back(entries[i]);
+
+		if (write_batch.empty())
+			return true;
+
+		auto *iface = get_writeonly_database();
+		if (iface)
+			return iface->write_entries(write_batch.data(), write_batch.size());
 		else
 			return false;
 	}
 
+	void prefetch(ResourceTag tag, const Hash *hashes, size_t count) override
+	{
+		// Each archive only prefetches the entries it actually contains.
+		if (readonly_interface)
+			readonly_interface->prefetch(tag, hashes, count);
+		for (auto &extra : extra_readonly)
+			if (extra)
+				extra->prefetch(tag, hashes, count);
+	}
+
 	static bool find_entry_in_concurrent_metadata(const ExportedMetadataHeader *header, ResourceTag tag, Hash hash)
 	{
-		auto *begin_range = reinterpret_cast<const uint8_t *>(header) + header->lists[tag].offset;
+		auto *filter = reinterpret_cast<const BloomFilterBlock *>(
+				reinterpret_cast<const uint8_t *>(header) + header->filter.offset);
+		if (!BloomFilter::may_contain(filter, header->filter.count, get_filter_key(tag, hash)))
+			return false;
+
+		auto *begin_range = reinterpret_cast<const ExportedMetadataConcurrentPrimedBlock *>(
+				reinterpret_cast<const uint8_t *>(header) + header->lists[tag].offset);
 		auto *end_range = begin_range + header->lists[tag].count;
 		return std::binary_search(begin_range, end_range, hash);
 	}
@@ -2135,7 +4486,7 @@ struct ConcurrentDatabase : DatabaseInterface
 		if (!test_resource_filter(tag, hash))
 			return false;
 
-		if (primed_hashes[tag].count(hash))
+		if (is_primed(tag, hash))
 			return true;
 
 		// All threads must have called prepare and synchronized readonly_interface from that,
@@ -2234,6 +4585,45 @@ struct ConcurrentDatabase : DatabaseInterface
 		return true;
 	}
 
+	bool get_statistics(DatabaseStatistics *stats) override
+	{
+		*stats = {};
+
+		std::vector<DatabaseInterface *> sub_databases;
+		if (readonly_interface)
+			sub_databases.push_back(readonly_interface.get());
+		for (auto &extra : extra_readonly)
+			if (extra)
+				sub_databases.push_back(extra.get());
+		if (writeonly_interface)
+			sub_databases.push_back(writeonly_interface.get());
+
+		// Archives which could not be prepared do not contribute anything.
+		for (auto *db : sub_databases)
+		{
+			DatabaseStatistics sub_stats;
+			if (!db->get_statistics(&sub_stats))
+				continue;
+
+			for (unsigned tag = 0; tag < RESOURCE_COUNT; tag++)
+			{
+				auto &dst = stats->tags[tag];
+				auto &src = sub_stats.tags[tag];
+				dst.entry_count += src.entry_count;
+				dst.compressed_entry_count += src.compressed_entry_count;
+				dst.stored_bytes += src.stored_bytes;
+				dst.uncompressed_bytes += src.uncompressed_bytes;
+				for (unsigned i = 0; i < DatabaseStatisticsHistogramBuckets; i++)
+					dst.size_histogram[i] += src.size_histogram[i];
+			}
+
+			stats->dictionary_count += sub_stats.dictionary_count;
+			stats->dictionary_bytes += sub_stats.dictionary_bytes;
+		}
+
+		return true;
+	}
+
 	size_t get_total_num_hashes_for_tag(ResourceTag tag) const
 	{
 		size_t count = 0;
@@ -2274,7 +4664,9 @@ struct ConcurrentDatabase : DatabaseInterface
 
 		size_t size = 0;
 
-		size += sizeof(ExportedMetadataHeader) + get_total_num_hashes() * sizeof(ExportedMetadataConcurrentPrimedBlock);
+		size_t total_hashes = get_total_num_hashes();
+		size += sizeof(ExportedMetadataHeader) + total_hashes * sizeof(ExportedMetadataConcurrentPrimedBlock);
+		size += BloomFilter::compute_block_count(total_hashes) * sizeof(BloomFilterBlock);
 
 		if (readonly_interface)
 			size += readonly_interface->compute_exported_metadata_size();
@@ -2342,13 +4734,18 @@ struct ConcurrentDatabase : DatabaseInterface
 	bool write_exported_concurrent_metadata(uint8_t *&data, size_t &size) const
 	{
 		size_t total_hashes = get_total_num_hashes();
-		size_t required = sizeof(ExportedMetadataHeader) + total_hashes * sizeof(ExportedMetadataConcurrentPrimedBlock);
+		size_t filter_offset = sizeof(ExportedMetadataHeader) + total_hashes * sizeof(ExportedMetadataConcurrentPrimedBlock);
+		size_t filter_block_count = BloomFilter::compute_block_count(total_hashes);
+		size_t required = filter_offset + filter_block_count * sizeof(BloomFilterBlock);
 		if (size < required)
 			return false;
 
 		auto *header = reinterpret_cast<ExportedMetadataHeader *>(data);
 		header->magic = ExportedMetadataMagicConcurrent;
 		header->size = required;
+		header->dictionaries = {};
+		header->filter.offset = filter_offset;
+		header->filter.count = filter_block_count;
 
 		size_t offset = sizeof(*header);
 		for (unsigned i = 0; i < RESOURCE_COUNT; i++)
@@ -2363,6 +4760,16 @@ struct ConcurrentDatabase : DatabaseInterface
 			offset += header->lists[i].count * sizeof(ExportedMetadataConcurrentPrimedBlock);
 		}
 
+		// Duplicates are pruned from the lists, so the filter is sized for the upper bound.
+		auto *filter = reinterpret_cast<BloomFilterBlock *>(data + filter_offset);
+		std::fill(filter, filter + filter_block_count, BloomFilterBlock{});
+		for (unsigned i = 0; i < RESOURCE_COUNT; i++)
+		{
+			auto *hashes = reinterpret_cast<const ExportedMetadataConcurrentPrimedBlock *>(data + header->lists[i].offset);
+			for (uint64_t j = 0; j < header->lists[i].count; j++)
+				BloomFilter::insert(filter, filter_block_count, get_filter_key(ResourceTag(i), hashes[j]));
+		}
+
 		data += required;
 		size -= required;
 		return true;
@@ -2391,6 +4798,8 @@ struct ConcurrentDatabase : DatabaseInterface
 			header->magic = ExportedMetadataMagic;
 			header->size = sizeof(*header);
 			memset(header->lists, 0, sizeof(header->lists));
+			header->dictionaries = {};
+			header->filter = {};
 			data += sizeof(ExportedMetadataHeader);
 			size -= sizeof(ExportedMetadataHeader);
 		}
@@ -2418,6 +4827,16 @@ struct ConcurrentDatabase : DatabaseInterface
 		bucket_info = json;
 	}
 
+	bool set_write_behind(unsigned worker_count, size_t max_in_flight_bytes) override
+	{
+		if (mode == DatabaseMode::ReadOnly || writeonly_interface)
+			return false;
+
+		write_behind_worker_count = worker_count;
+		write_behind_max_in_flight_bytes = max_in_flight_bytes;
+		return true;
+	}
+
 	std::string base_path;
 	std::string bucket_dirname;
 	std::string bucket_basename;
@@ -2426,9 +4845,14 @@ struct ConcurrentDatabase : DatabaseInterface
 	std::unique_ptr<DatabaseInterface> readonly_interface;
 	std::unique_ptr<DatabaseInterface> writeonly_interface;
 	std::vector<std::unique_ptr<DatabaseInterface>> extra_readonly;
-	std::unordered_set<Hash> primed_hashes[RESOURCE_COUNT];
+	// Sorted, so that they take no more memory than the hashes themselves.
+	std::vector<Hash> primed_hashes[RESOURCE_COUNT];
+	BloomFilter primed_filter;
 	bool has_prepared_readonly = false;
 	bool need_writeonly_database = true;
+	std::vector<DatabaseWriteEntry> write_batch;
+	unsigned write_behind_worker_count = 0;
+	size_t write_behind_max_in_flight_bytes = 0;
 };
 
 DatabaseInterface *create_concurrent_database(const char *base_path, DatabaseMode mode,
@@ -2463,118 +4887,256 @@ void DatabaseInterface::request_shutdown()
 	shutdown_requested.store(true, std::memory_order_relaxed);
 }
 
-bool merge_concurrent_databases_last_use(const char *append_archive, const char * const *source_paths, size_t num_source_paths,
-                                         bool skip_missing_inputs)
+static bool replace_file(const std::string &src, const char *dst)
 {
-	std::unordered_map<Hash, uint64_t> timestamps[RESOURCE_COUNT];
+#ifdef _WIN32
+	return MoveFileExA(src.c_str(), dst, MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+	return rename(src.c_str(), dst) == 0;
+#endif
+}
+
+// Keeps the highest timestamp for every hash in the archives, which must have been opened with prepare_sorted_access(),
+// and writes the result to a new archive with an index.
+// Every archive yields its hashes in sorted order, so a k-way merge sees all timestamps
+// for a hash back to back. Only the cursors are in flight, not a map over every hash.
+static bool merge_last_use_sorted(const std::string &output_path,
+                                  const std::vector<std::unique_ptr<StreamArchive>> &source_dbs)
+{
+	auto write_db = std::unique_ptr<DatabaseInterface>(create_stream_archive_database(output_path.c_str(), DatabaseMode::OverWrite));
+	if (!write_db->prepare())
+		return false;
 
-	for (size_t source = 0; source < num_source_paths + 1; source++)
+	std::vector<StreamArchive::SortedEntryCursor> cursors(source_dbs.size());
+	using HeapEntry = std::pair<Hash, size_t>;
+	std::vector<HeapEntry> heap;
+	const auto heap_compare = [](const HeapEntry &a, const HeapEntry &b) { return a.first > b.first; };
+
+	for (unsigned i = 0; i < RESOURCE_COUNT; i++)
 	{
-		const char *path = source ? source_paths[source - 1] : append_archive;
-		auto source_db = std::unique_ptr<DatabaseInterface>(create_stream_archive_database(path, DatabaseMode::ReadOnly));
-		if (!source_db->prepare())
+		auto tag = static_cast<ResourceTag>(i);
+		heap.clear();
+
+		for (size_t source = 0; source < source_dbs.size(); source++)
 		{
-			if (source == 0)
-				continue;
-			else
+			if (!cursors[source].begin(*source_dbs[source], tag))
+				return false;
+			if (cursors[source].valid)
+				heap.emplace_back(cursors[source].hash, source);
+		}
+		std::make_heap(heap.begin(), heap.end(), heap_compare);
+
+		while (!heap.empty())
+		{
+			Hash hash = heap.front().first;
+			uint64_t max_timestamp = 0;
+
+			while (!heap.empty() && heap.front().first == hash)
 			{
-				if (!skip_missing_inputs)
+				size_t source = heap.front().second;
+				std::pop_heap(heap.begin(), heap.end(), heap_compare);
+				heap.pop_back();
+
+				auto &cursor = cursors[source];
+				uint64_t timestamp = 0;
+				if (!source_dbs[source]->decode_payload(&timestamp, sizeof(timestamp), cursor.entry, false) ||
+				    !cursor.advance())
+				{
 					return false;
+				}
 
-				LOGW("Archive %s could not be prepared, skipping.\n", path);
-				continue;
+				max_timestamp = std::max<uint64_t>(max_timestamp, timestamp);
+
+				if (cursor.valid)
+				{
+					heap.emplace_back(cursor.hash, source);
+					std::push_heap(heap.begin(), heap.end(), heap_compare);
+				}
 			}
+
+			if (!write_db->write_entry(tag, hash, &max_timestamp, sizeof(max_timestamp), PAYLOAD_WRITE_COMPUTE_CHECKSUM_BIT))
+				return false;
 		}
+	}
 
-		for (unsigned i = 0; i < RESOURCE_COUNT; i++)
+	return write_db->write_index();
+}
+
+static bool open_sorted_archives(std::vector<std::unique_ptr<StreamArchive>> &dbs, const std::string *paths, size_t count)
+{
+	dbs.resize(count);
+	std::vector<uint8_t> prepared(count);
+	parallel_for(count, [&](size_t index) {
+		dbs[index].reset(new StreamArchive(paths[index], DatabaseMode::ReadOnly));
+		prepared[index] = dbs[index]->prepare_sorted_access();
+	});
+
+	for (size_t index = 0; index < count; index++)
+	{
+		if (!prepared[index])
 		{
-			auto tag = static_cast<ResourceTag>(i);
+			LOGE("Failed to open %s for merging.\n", paths[index].c_str());
+			return false;
+		}
+	}
 
-			size_t hash_count = 0;
-			if (!source_db->get_hash_list_for_resource_tag(tag, &hash_count, nullptr))
-				return false;
-			std::vector<Hash> hashes(hash_count);
-			if (!source_db->get_hash_list_for_resource_tag(tag, &hash_count, hashes.data()))
-				return false;
+	return true;
+}
+
+bool merge_concurrent_databases_last_use(const char *append_archive, const char * const *source_paths, size_t num_source_paths,
+                                         bool skip_missing_inputs)
+{
+	// Never keep more archives than this open at once.
+	enum { SourceBatchSize = 64 };
+
+	// Indexed archives which take part in the final k-way merge.
+	std::vector<std::string> run_paths;
+	std::vector<std::string> temporary_paths;
+	const auto add_temporary_path = [&]() -> std::string {
+		temporary_paths.push_back(std::string(append_archive) + ".run" + std::to_string(temporary_paths.size()) + ".tmp");
+		return temporary_paths.back();
+	};
+
+	// Archives which end with an index can be streamed from disk. The rest must be loaded into memory,
+	// which is the usual case for the per-process archives, as those are never sealed.
+	// Those are merged a batch at a time into temporary indexed runs, so that neither memory use
+	// nor the number of open files grows with the number of inputs.
+	const size_t num_inputs = num_source_paths + 1;
+	bool ret = true;
+	for (size_t batch_begin = 0; batch_begin < num_inputs && ret; batch_begin += SourceBatchSize)
+	{
+		size_t batch_count = std::min<size_t>(SourceBatchSize, num_inputs - batch_begin);
+		const auto get_path = [&](size_t index) {
+			size_t input = batch_begin + index;
+			return input ? source_paths[input - 1] : append_archive;
+		};
+
+		std::vector<std::unique_ptr<StreamArchive>> batch_dbs(batch_count);
+		std::vector<uint8_t> prepared(batch_count);
+		parallel_for(batch_count, [&](size_t index) {
+			batch_dbs[index].reset(new StreamArchive(get_path(index), DatabaseMode::ReadOnly));
+			prepared[index] = batch_dbs[index]->prepare_sorted_access();
+		});
 
-			for (auto &hash : hashes)
+		std::vector<std::unique_ptr<StreamArchive>> unindexed_dbs;
+		for (size_t index = 0; index < batch_count && ret; index++)
+		{
+			if (!prepared[index])
 			{
-				size_t timestamp_size = sizeof(uint64_t);
-				uint64_t timestamp = 0;
-				if (!source_db->read_entry(tag, hash, &timestamp_size, &timestamp, PAYLOAD_READ_NO_FLAGS) ||
-				    timestamp_size != sizeof(uint64_t))
-					return false;
+				// The append archive does not have to exist yet.
+				if (batch_begin + index == 0)
+					continue;
 
-				auto &entry = timestamps[i][hash];
-				entry = std::max<uint64_t>(entry, timestamp);
+				if (!skip_missing_inputs)
+				{
+					ret = false;
+					break;
+				}
+
+				LOGW("Archive %s could not be prepared, skipping.\n", get_path(index));
+				continue;
 			}
+
+			if (batch_dbs[index]->has_sorted_index())
+				run_paths.push_back(get_path(index));
+			else
+				unindexed_dbs.push_back(std::move(batch_dbs[index]));
+		}
+
+		// Indexed archives are reopened for the final merge.
+		batch_dbs.clear();
+
+		if (ret && !unindexed_dbs.empty())
+		{
+			auto run_path = add_temporary_path();
+			ret = merge_last_use_sorted(run_path, unindexed_dbs);
+			run_paths.push_back(run_path);
 		}
 	}
 
-	auto write_db = std::unique_ptr<DatabaseInterface>(create_stream_archive_database(append_archive, DatabaseMode::OverWrite));
-	if (!write_db->prepare())
-		return false;
+	// With more runs than can be open at once, merge them in groups until they fit.
+	while (ret && run_paths.size() > SourceBatchSize)
+	{
+		std::vector<std::string> merged_paths;
+		for (size_t group_begin = 0; group_begin < run_paths.size() && ret; group_begin += SourceBatchSize)
+		{
+			size_t group_count = std::min<size_t>(SourceBatchSize, run_paths.size() - group_begin);
+			std::vector<std::unique_ptr<StreamArchive>> run_dbs;
+			ret = open_sorted_archives(run_dbs, run_paths.data() + group_begin, group_count);
+			if (ret)
+			{
+				auto merged_path = add_temporary_path();
+				ret = merge_last_use_sorted(merged_path, run_dbs);
+				merged_paths.push_back(merged_path);
+			}
+		}
+		run_paths = std::move(merged_paths);
+	}
 
-	for (unsigned i = 0; i < RESOURCE_COUNT; i++)
+	// Write to the side, since the append archive may be one of the runs.
+	std::string write_path = std::string(append_archive) + ".tmp";
+	if (ret)
 	{
-		auto tag = static_cast<ResourceTag>(i);
-		auto &ts = timestamps[i];
+		std::vector<std::unique_ptr<StreamArchive>> run_dbs;
+		ret = open_sorted_archives(run_dbs, run_paths.data(), run_paths.size()) &&
+		      merge_last_use_sorted(write_path, run_dbs);
+	}
 
-		for (auto &t : ts)
-			if (!write_db->write_entry(tag, t.first, &t.second, sizeof(t.second), PAYLOAD_WRITE_COMPUTE_CHECKSUM_BIT))
-				return false;
+	for (auto &path : temporary_paths)
+		remove(path.c_str());
+
+	if (ret && !replace_file(write_path, append_archive))
+	{
+		LOGE("Failed to replace %s.\n", append_archive);
+		ret = false;
 	}
 
-	return true;
+	if (!ret)
+		remove(write_path.c_str());
+
+	return ret;
 }
 
 bool merge_concurrent_databases(const char *append_archive, const char * const *source_paths, size_t num_source_paths,
                                 bool skip_missing_inputs)
 {
-	auto append_db = std::unique_ptr<DatabaseInterface>(create_stream_archive_database(append_archive, DatabaseMode::Append));
+	auto append_db = std::unique_ptr<StreamArchive>(new StreamArchive(append_archive, DatabaseMode::Append));
 	if (!append_db->prepare())
 		return false;
 
-	for (size_t source = 0; source < num_source_paths; source++)
+	// Prepare sources in parallel, but in batches so we don't keep too many files open at once.
+	enum { SourceBatchSize = 64 };
+	for (size_t batch_begin = 0; batch_begin < num_source_paths; batch_begin += SourceBatchSize)
 	{
-		const char *path = source_paths[source];
-		auto source_db = std::unique_ptr<DatabaseInterface>(create_stream_archive_database(path, DatabaseMode::ReadOnly));
-		if (!source_db->prepare())
-		{
-			if (!skip_missing_inputs)
-				return false;
+		size_t batch_count = std::min<size_t>(SourceBatchSize, num_source_paths - batch_begin);
+		std::vector<std::unique_ptr<StreamArchive>> source_dbs(batch_count);
+		std::vector<uint8_t> prepared(batch_count);
 
-			LOGW("Archive %s could not be prepared, skipping.\n", path);
-			continue;
-		}
+		parallel_for(batch_count, [&](size_t index) {
+			source_dbs[index].reset(new StreamArchive(source_paths[batch_begin + index], DatabaseMode::ReadOnly));
+			prepared[index] = source_dbs[index]->prepare();
+		});
 
-		for (unsigned i = 0; i < RESOURCE_COUNT; i++)
+		for (size_t index = 0; index < batch_count; index++)
 		{
-			auto tag = static_cast<ResourceTag>(i);
-
-			size_t hash_count = 0;
-			if (!source_db->get_hash_list_for_resource_tag(tag, &hash_count, nullptr))
-				return false;
-			std::vector<Hash> hashes(hash_count);
-			if (!source_db->get_hash_list_for_resource_tag(tag, &hash_count, hashes.data()))
-				return false;
-
-			for (auto &hash : hashes)
+			if (!prepared[index])
 			{
-				size_t blob_size = 0;
-				if (!source_db->read_entry(tag, hash, &blob_size, nullptr, PAYLOAD_READ_RAW_FOSSILIZE_DB_BIT))
-					return false;
-				std::vector<uint8_t> blob(blob_size);
-				if (!source_db->read_entry(tag, hash, &blob_size, blob.data(), PAYLOAD_READ_RAW_FOSSILIZE_DB_BIT))
+				if (!skip_missing_inputs)
 					return false;
 
-				if (!append_db->write_entry(tag, hash, blob.data(), blob.size(), PAYLOAD_WRITE_RAW_FOSSILIZE_DB_BIT))
-					return false;
+				LOGW("Archive %s could not be prepared, skipping.\n", source_paths[batch_begin + index]);
+				continue;
 			}
+
+			if (!append_db->append_raw_entries_from(*source_dbs[index]))
+				return false;
+
+			// Release the mapping and file handle early.
+			source_dbs[index].reset();
 		}
 	}
 
-	return true;
+	return append_db->write_index();
 }
 
 }
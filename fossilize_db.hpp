@@ -46,6 +46,17 @@ enum PayloadWriteFlagBits
 	// Compute checksum of payload for more robustness.
 	PAYLOAD_WRITE_COMPUTE_CHECKSUM_BIT = 1 << 3,
 
+	// If WRITE_COMPRESS_BIT is set, use a much faster codec than deflate at the cost of compression ratio.
+	// For the stream archive, this is LZ4, which requires readers to support archive version 7.
+	// Takes precedence over BEST_COMPRESSION_BIT.
+	PAYLOAD_WRITE_FAST_COMPRESSION_BIT = 1 << 4,
+
+	// If WRITE_COMPRESS_BIT is set, compress against the dictionary set with set_compression_dictionary() for the tag.
+	// For the stream archive, this is LZ4 with the dictionary as a prefix, which requires readers to support archive version 8.
+	// If BEST_COMPRESSION_BIT is also set, deflate is used instead when it turns out smaller.
+	// Tags without a dictionary are compressed as if this bit was not set.
+	PAYLOAD_WRITE_DICTIONARY_BIT = 1 << 5,
+
 	PAYLOAD_WRITE_MAX_ENUM = 0x7fffffff
 };
 
@@ -60,6 +71,8 @@ enum PayloadReadFlagBits
 
 	// Allows read_entry to be called concurrently from multiple threads.
 	// Might cause locking when reading from database depending on implementation.
+	// For the stream archive, reads are lock-free, either through a memory mapping or positional reads.
+	// Zip archives are also read lock-free with positional reads.
 	// Decompression if needed is always lock-free.
 	// *NOTE*: Only tested with the Fossilize database format.
 	PAYLOAD_READ_CONCURRENT_BIT = 1 << 1,
@@ -81,6 +94,39 @@ enum class DatabaseMode
 	ExclusiveOverWrite
 };
 
+// One entry for DatabaseInterface::write_entries.
+struct DatabaseWriteEntry
+{
+	ResourceTag tag;
+	Hash hash;
+	const void *buffer;
+	size_t size;
+	PayloadWriteFlags flags;
+};
+
+// Entry sizes are bucketed by their highest set bit.
+// Bucket i counts entries with uncompressed sizes in [2^i, 2^(i+1)). Empty entries go in bucket 0.
+enum { DatabaseStatisticsHistogramBuckets = 32 };
+
+struct DatabaseTagStatistics
+{
+	uint64_t entry_count;
+	// Entries which are stored with any form of compression.
+	uint64_t compressed_entry_count;
+	// Payload bytes as stored in the database, excluding per-entry headers.
+	uint64_t stored_bytes;
+	uint64_t uncompressed_bytes;
+	uint64_t size_histogram[DatabaseStatisticsHistogramBuckets];
+};
+
+struct DatabaseStatistics
+{
+	DatabaseTagStatistics tags[RESOURCE_COUNT];
+	// Compression dictionaries stored in the database.
+	uint64_t dictionary_count;
+	uint64_t dictionary_bytes;
+};
+
 struct ExportedMetadataHeader;
 
 // This is an interface to interact with an external database for blob modules.
@@ -140,14 +186,53 @@ public:
 	// Writes an entry to database.
 	virtual bool write_entry(ResourceTag tag, Hash hash, const void *buffer, size_t size, PayloadWriteFlags flags) = 0;
 
+	// Writes many entries at once. The stream archive assembles the whole batch in memory
+	// and submits it with a single write. Entries which already exist are skipped.
+	// Returns false if any entry could not be written. Other entries in the batch may still have been written.
+	virtual bool write_entries(const DatabaseWriteEntry *entries, size_t count);
+
+	// Sets the dictionary which entries of a tag are compressed against when written with PAYLOAD_WRITE_DICTIONARY_BIT.
+	// The dictionary is stored in the database itself, and the same dictionary may be used for multiple tags.
+	// Passing size 0 clears the dictionary for the tag.
+	// Only the stream archive supports this, in Append or OverWrite mode.
+	virtual bool set_compression_dictionary(ResourceTag tag, const void *data, size_t size);
+
+	// Moves compression and file writes off the calling thread.
+	// write_entry() and write_entries() then only copy entries into a queue and return.
+	// worker_count threads compress queued entries, and an I/O thread appends them to the file in the order they were queued.
+	// Writing blocks while more than max_in_flight_bytes of entries are queued.
+	// flush() waits until everything queued so far has been written.
+	// Entries fail after write_entries() has returned, so a failure is reported by the next write_entries() or flush(),
+	// and by every call after that. Failures also prevent write_index() from succeeding.
+	// This must be called before prepare().
+	// Only the stream archive supports this when writing, and the concurrent database, which uses it for the archive it writes to.
+	virtual bool set_write_behind(unsigned worker_count, size_t max_in_flight_bytes);
+
 	// Checks if entry already exists in database, i.e. no need to serialize.
 	virtual bool has_entry(ResourceTag tag, Hash hash) = 0;
 
+	// Hints that the entries will be read soon, so I/O can be started ahead of time.
+	// The stream archive coalesces the entries into larger ranges and asks the OS to read them ahead.
+	// Can only be used in ReadOnly mode, and is a no-op for backends which don't support it.
+	// Same thread-safety rules as read_entry with PAYLOAD_READ_CONCURRENT_BIT.
+	virtual void prefetch(ResourceTag tag, const Hash *hashes, size_t count);
+
+	// Returns the file offset of an entry's header, and the size of the header and stored payload together.
+	// Only meaningful for the stream archive, where tools use it to analyze the archive layout.
+	virtual bool get_entry_range(ResourceTag tag, Hash hash, uint64_t *offset, uint64_t *size);
+
 	// Arguments are similar to Vulkan, call the query function twice.
 	virtual bool get_hash_list_for_resource_tag(ResourceTag tag, size_t *num_hashes, Hash *hash) = 0;
 
+	// Fills in per-tag statistics from the entry headers gathered by prepare(), or from imported metadata.
+	// No payload is read or decoded, so this is cheap even for large archives.
+	// Only the stream archive supports this. The concurrent database sums the statistics of its archives,
+	// so entries which are present in more than one archive are counted once per archive.
+	virtual bool get_statistics(DatabaseStatistics *stats);
+
 	// Ensures all file writes are flushed, ala fflush(). Might be noop depending on the implementation.
-	virtual void flush() = 0;
+	// Returns false if earlier writes could not be completed.
+	virtual bool flush() = 0;
 
 	virtual const char *get_db_path_for_hash(ResourceTag tag, Hash hash) = 0;
 
@@ -202,6 +287,15 @@ public:
 	// This info does not have semantic meaning for parsing of an archive and can be discarded.
 	virtual void set_bucket_info(const char *json);
 
+	// Appends an index of all entries to the end of the database, so that
+	// later calls to prepare() in ReadOnly or Append mode can skip scanning through the entire archive.
+	// Only the stream archive supports this. Writing new entries after the index in the same session replaces it.
+	// If the archive already ended with an index when opened in Append mode, that index is kept,
+	// and only the entries written since are indexed, in a segment chained to it.
+	// Append mode databases do this automatically when destroyed if any entries were written.
+	// Call this after all entries have been written. Returns false if the index was not written.
+	virtual bool write_index();
+
 	// Request termination of prepare() which can take a long time for very
 	// large archives.  This is useful if running prepare() on a thread and the need
 	// arises to stop loading the database.
@@ -264,6 +358,10 @@ bool merge_concurrent_databases(const char *append_database_path,
 
 // Merges stream archives found in source_paths into append_database_path.
 // When there are duplicates in append database and any other database, picks the entry with the highest 8 byte timestamp payload.
+// Archives are merged one hash at a time in sorted order. Archives which end with an index are streamed from disk.
+// Archives without one are loaded in batches and merged into temporary indexed archives next to append_database_path,
+// so neither memory use nor the number of open files grows with the number of inputs.
+// The result has an index, and is written next to append_database_path and renamed over it once complete.
 bool merge_concurrent_databases_last_use(const char *append_database_path,
                                          const char * const *source_paths, size_t num_source_paths,
                                          bool skip_missing_inputs = false);
@@ -164,6 +164,18 @@ static std::string getSystemProperty(const char *key)
 #define FOSSILIZE_DUMP_SYNC_ENV "FOSSILIZE_DUMP_SYNC"
 #endif
 
+#ifndef FOSSILIZE_FAST_COMPRESSION_ENV
+#define FOSSILIZE_FAST_COMPRESSION_ENV "FOSSILIZE_FAST_COMPRESSION"
+#endif
+
+#ifndef FOSSILIZE_BINARY_ENCODING_ENV
+#define FOSSILIZE_BINARY_ENCODING_ENV "FOSSILIZE_BINARY_ENCODING"
+#endif
+
+#ifndef FOSSILIZE_WRITE_BEHIND_THREADS_ENV
+#define FOSSILIZE_WRITE_BEHIND_THREADS_ENV "FOSSILIZE_WRITE_BEHIND_THREADS"
+#endif
+
 #ifndef FOSSILIZE_IDENTIFIER_DUMP_PATH_ENV
 #define FOSSILIZE_IDENTIFIER_DUMP_PATH_ENV "FOSSILIZE_IDENTIFIER_DUMP_PATH"
 #endif
@@ -338,6 +350,19 @@ Instance::Instance()
 	const char *sync = getenv(FOSSILIZE_DUMP_SYNC_ENV);
 	if (sync && strtoul(sync, nullptr, 0) != 0)
 		synchronized = true;
+
+	const char *fast = getenv(FOSSILIZE_FAST_COMPRESSION_ENV);
+	if (fast && strtoul(fast, nullptr, 0) != 0)
+		fastCompression = true;
+
+	const char *binary = getenv(FOSSILIZE_BINARY_ENCODING_ENV);
+	if (binary && strtoul(binary, nullptr, 0) != 0)
+		binaryEncoding = true;
+
+	// Write-behind defeats the point of synchronized recording.
+	const char *writeBehind = getenv(FOSSILIZE_WRITE_BEHIND_THREADS_ENV);
+	if (writeBehind && !synchronized)
+		writeBehindThreads = unsigned(strtoul(writeBehind, nullptr, 0));
 #endif
 
 	enablePrecompileQA = queryPrecompileQA();
@@ -419,6 +444,9 @@ StateRecorder *Instance::getStateRecorderForDevice(const VkPhysicalDevicePropert
 	                                                                          DatabaseMode::Append,
 	                                                                          extraPaths));
 
+	if (writeBehindThreads)
+		entry.interface->set_write_behind(writeBehindThreads, 32 * 1024 * 1024);
+
 	if (lastUseTag)
 	{
 		entry.last_use_interface.reset(create_concurrent_database(
@@ -505,6 +533,8 @@ StateRecorder *Instance::getStateRecorderForDevice(const VkPhysicalDevicePropert
 	entry.recorder.reset(new StateRecorder);
 	auto *recorder = entry.recorder.get();
 	recorder->set_database_enable_compression(true);
+	recorder->set_database_enable_fast_compression(fastCompression);
+	recorder->set_database_enable_binary_encoding(binaryEncoding);
 	recorder->set_database_enable_checksum(true);
 	recorder->set_application_info_filter(infoFilter);
 
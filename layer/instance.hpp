@@ -100,6 +100,9 @@ private:
 	ApplicationInfoFilter *infoFilter = nullptr;
 	bool enableCrashHandler = false;
 	bool synchronized = false;
+	bool fastCompression = false;
+	bool binaryEncoding = false;
+	unsigned writeBehindThreads = 0;
 	bool enablePrecompileQA = false;
 	bool shouldRecordImmutableSamplers = true;
 	bool shouldRecordPipelineUses = false;
@@ -0,0 +1,453 @@
+/* Copyright (c) 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "lz4_block.hpp"
+#include "util/flat_hash_map.hpp"
+#include <string.h>
+#include <algorithm>
+
+namespace Fossilize
+{
+// Constraints from the LZ4 block format specification.
+enum
+{
+	MinMatch = 4,
+	// The last match must start at least this many bytes before the end of the block.
+	MatchFindLimit = 12,
+	// The last bytes of a block are always literals.
+	LastLiterals = 5,
+	MaxDistance = 65535,
+	MaxInputSize = 0x7e000000,
+	HashLog = 12,
+	// After 2^SkipTrigger failed match attempts, start skipping ahead faster through incompressible data.
+	SkipTrigger = 6
+};
+
+static inline uint32_t read32(const uint8_t *ptr)
+{
+	uint32_t v;
+	memcpy(&v, ptr, sizeof(v));
+	return v;
+}
+
+static inline uint64_t read64(const uint8_t *ptr)
+{
+	uint64_t v;
+	memcpy(&v, ptr, sizeof(v));
+	return v;
+}
+
+static inline uint32_t hash_sequence(uint32_t sequence)
+{
+	return (sequence * 2654435761u) >> (32 - HashLog);
+}
+
+static uint8_t *write_length(uint8_t *op, size_t len)
+{
+	while (len >= 255)
+	{
+		*op++ = 255;
+		len -= 255;
+	}
+	*op++ = uint8_t(len);
+	return op;
+}
+
+static uint8_t *write_literals(uint8_t *op, uint8_t *token, const uint8_t *literals, size_t len)
+{
+	if (len >= 15)
+	{
+		*token = 15 << 4;
+		op = write_length(op, len - 15);
+	}
+	else
+		*token = uint8_t(len << 4);
+
+	if (len)
+		memcpy(op, literals, len);
+	return op + len;
+}
+
+size_t compute_max_size_lz4(size_t src_size)
+{
+	return src_size + src_size / 255 + 16;
+}
+
+// Compresses base[prefix_size, prefix_size + src_size). Matches may reach back into the prefix.
+// table holds positions relative to base. Stale or zero entries are harmless, every candidate is verified.
+static size_t encode_lz4_prefix(uint8_t *dst, size_t dst_size, const uint8_t *base, size_t prefix_size,
+                                size_t src_size, uint32_t *table)
+{
+	if (src_size > MaxInputSize)
+		return 0;
+
+	const uint8_t *src = base + prefix_size;
+	uint8_t *op = dst;
+	uint8_t *oend = dst + dst_size;
+	const uint8_t *ip = src;
+	const uint8_t *anchor = src;
+	const uint8_t *iend = src + src_size;
+
+	if (src_size > MatchFindLimit)
+	{
+		const uint8_t *mflimit = iend - MatchFindLimit;
+		const uint8_t *matchlimit = iend - LastLiterals;
+
+		// Without a prefix, there is nothing to match the first position against.
+		if (!prefix_size)
+			ip++;
+
+		for (;;)
+		{
+			const uint8_t *match;
+			unsigned attempts = 1u << SkipTrigger;
+
+			for (;;)
+			{
+				if (ip > mflimit)
+					goto last_literals;
+
+				uint32_t h = hash_sequence(read32(ip));
+				match = base + table[h];
+				table[h] = uint32_t(ip - base);
+
+				if (size_t(ip - match) <= MaxDistance && match < ip && read32(match) == read32(ip))
+					break;
+
+				ip += attempts++ >> SkipTrigger;
+			}
+
+			// Catch up with bytes we skipped over.
+			while (ip > anchor && match > base && ip[-1] == match[-1])
+			{
+				ip--;
+				match--;
+			}
+
+			const uint8_t *p = ip + MinMatch;
+			const uint8_t *m = match + MinMatch;
+			while (p + 8 <= matchlimit && read64(p) == read64(m))
+			{
+				p += 8;
+				m += 8;
+			}
+			while (p < matchlimit && *p == *m)
+			{
+				p++;
+				m++;
+			}
+
+			size_t literal_len = size_t(ip - anchor);
+			size_t match_len = size_t(p - ip) - MinMatch;
+
+			// Token + literals + offset + extended lengths.
+			if (size_t(oend - op) < 1 + literal_len + literal_len / 255 + 1 + 2 + match_len / 255 + 1)
+				return 0;
+
+			uint8_t *token = op++;
+			op = write_literals(op, token, anchor, literal_len);
+
+			size_t offset = size_t(ip - match);
+			*op++ = uint8_t(offset & 0xff);
+			*op++ = uint8_t(offset >> 8);
+
+			if (match_len >= 15)
+			{
+				*token |= 15;
+				op = write_length(op, match_len - 15);
+			}
+			else
+				*token |= uint8_t(match_len);
+
+			ip = p;
+			anchor = ip;
+
+			if (ip > mflimit)
+				break;
+
+			// Seed the table with a position inside the match, it improves the ratio on repetitive data.
+			table[hash_sequence(read32(ip - 2))] = uint32_t(ip - 2 - base);
+		}
+	}
+
+last_literals:
+	size_t literal_len = size_t(iend - anchor);
+	if (size_t(oend - op) < 1 + literal_len + literal_len / 255 + 1)
+		return 0;
+
+	uint8_t *token = op++;
+	op = write_literals(op, token, anchor, literal_len);
+	return size_t(op - dst);
+}
+
+size_t encode_lz4(uint8_t *dst, size_t dst_size, const uint8_t *src, size_t src_size)
+{
+	uint32_t table[1 << HashLog] = {};
+	return encode_lz4_prefix(dst, dst_size, src, 0, src_size, table);
+}
+
+void prepare_dictionary_lz4(LZ4Dictionary &dict, const uint8_t *data, size_t size)
+{
+	if (size > MaxDistance)
+	{
+		data += size - MaxDistance;
+		size = MaxDistance;
+	}
+
+	dict.data.assign(data, data + size);
+	dict.table.assign(1u << HashLog, 0);
+	for (size_t i = 0; i + sizeof(uint32_t) <= size; i++)
+		dict.table[hash_sequence(read32(data + i))] = uint32_t(i);
+}
+
+size_t encode_lz4_dictionary(uint8_t *dst, size_t dst_size, const uint8_t *src, size_t src_size,
+                             const LZ4Dictionary &dict)
+{
+	if (dict.data.empty())
+		return encode_lz4(dst, dst_size, src, src_size);
+
+	// The compressor wants the dictionary and payload back to back.
+	static thread_local std::vector<uint8_t> scratch;
+	scratch.resize(dict.data.size() + src_size);
+	memcpy(scratch.data(), dict.data.data(), dict.data.size());
+	if (src_size)
+		memcpy(scratch.data() + dict.data.size(), src, src_size);
+
+	uint32_t table[1 << HashLog];
+	memcpy(table, dict.table.data(), sizeof(table));
+	return encode_lz4_prefix(dst, dst_size, scratch.data(), dict.data.size(), src_size, table);
+}
+
+static bool read_length(const uint8_t *&ip, const uint8_t *iend, size_t &len, size_t max_len)
+{
+	uint8_t v;
+	do
+	{
+		if (ip >= iend)
+			return false;
+		v = *ip++;
+		len += v;
+		// Guards against overflow as well as nonsensical lengths.
+		if (len > max_len)
+			return false;
+	} while (v == 255);
+
+	return true;
+}
+
+bool decode_lz4_dictionary(uint8_t *dst, size_t dst_size, const uint8_t *src, size_t src_size,
+                           const uint8_t *dict, size_t dict_size)
+{
+	const uint8_t *ip = src;
+	const uint8_t *iend = src + src_size;
+	uint8_t *op = dst;
+	uint8_t *oend = dst + dst_size;
+
+	for (;;)
+	{
+		if (ip >= iend)
+			return false;
+
+		unsigned token = *ip++;
+
+		size_t literal_len = token >> 4;
+		if (literal_len == 15 && !read_length(ip, iend, literal_len, dst_size))
+			return false;
+		if (size_t(iend - ip) < literal_len || size_t(oend - op) < literal_len)
+			return false;
+
+		if (literal_len)
+			memcpy(op, ip, literal_len);
+		op += literal_len;
+		ip += literal_len;
+
+		// The last sequence has no match.
+		if (ip == iend)
+			return op == oend;
+
+		if (iend - ip < 2)
+			return false;
+		size_t offset = size_t(ip[0]) | (size_t(ip[1]) << 8);
+		ip += 2;
+		if (offset == 0 || offset > size_t(op - dst) + dict_size)
+			return false;
+
+		size_t match_len = token & 15;
+		if (match_len == 15 && !read_length(ip, iend, match_len, dst_size))
+			return false;
+		match_len += MinMatch;
+		if (size_t(oend - op) < match_len)
+			return false;
+
+		const uint8_t *match;
+		if (offset > size_t(op - dst))
+		{
+			// The match starts in the dictionary and might continue into the output.
+			size_t back = offset - size_t(op - dst);
+			size_t from_dict = std::min(back, match_len);
+			memcpy(op, dict + dict_size - back, from_dict);
+			op += from_dict;
+			match_len -= from_dict;
+			match = dst;
+		}
+		else
+			match = op - offset;
+
+		if (offset >= 8)
+		{
+			// Each 8 byte chunk only reads bytes which have already been written.
+			while (match_len >= 8)
+			{
+				memcpy(op, match, 8);
+				op += 8;
+				match += 8;
+				match_len -= 8;
+			}
+		}
+
+		// Overlapping copies repeat the pattern, so they have to go byte by byte.
+		while (match_len--)
+			*op++ = *match++;
+	}
+}
+
+bool decode_lz4(uint8_t *dst, size_t dst_size, const uint8_t *src, size_t src_size)
+{
+	return decode_lz4_dictionary(dst, dst_size, src, src_size, nullptr, 0);
+}
+
+// A simplified take on the COVER algorithm from zstd's dictionary builder.
+// Samples are split into epochs, one per dictionary segment. From each epoch we pick the segment
+// whose 8 byte sequences appear in the most samples, then forget about those sequences,
+// so later segments cover something new.
+size_t train_dictionary_lz4(uint8_t *dict, size_t dict_size,
+                            const uint8_t * const *samples, const size_t *sample_sizes, size_t sample_count)
+{
+	enum { SequenceSize = 8, SegmentSize = 256 };
+
+	struct SequenceCount
+	{
+		uint32_t count;
+		uint32_t last_sample;
+	};
+
+	dict_size = std::min<size_t>(dict_size, MaxDistance);
+
+	FlatHashMap<SequenceCount> counts;
+	size_t total_size = 0;
+	for (size_t i = 0; i < sample_count; i++)
+	{
+		total_size += sample_sizes[i];
+		for (size_t j = 0; j + SequenceSize <= sample_sizes[i]; j++)
+		{
+			uint64_t sequence = read64(samples[i] + j);
+			auto *c = counts.find(sequence);
+			if (!c)
+				counts.emplace(sequence, { 1, uint32_t(i) });
+			else if (c->last_sample != uint32_t(i))
+			{
+				// Repeats within one sample do not make a sequence more worthwhile to share.
+				c->count++;
+				c->last_sample = uint32_t(i);
+			}
+		}
+	}
+
+	size_t segment_count = std::min<size_t>(dict_size / SegmentSize, total_size / SegmentSize);
+	if (segment_count == 0)
+		return 0;
+	size_t epoch_size = total_size / segment_count;
+
+	struct Segment
+	{
+		const uint8_t *data;
+		uint64_t score;
+	};
+	std::vector<Segment> segments;
+	segments.reserve(segment_count);
+
+	const auto score_sequence = [&](const uint8_t *ptr) -> uint64_t {
+		auto *c = counts.find(read64(ptr));
+		// A sequence which only occurs in one sample is not worth anything.
+		return c && c->count > 1 ? c->count : 0;
+	};
+
+	size_t sample_index = 0;
+	for (size_t epoch = 0; epoch < segment_count && sample_index < sample_count; epoch++)
+	{
+		Segment best = { nullptr, 0 };
+		size_t epoch_bytes = 0;
+
+		while (sample_index < sample_count && epoch_bytes < epoch_size)
+		{
+			const uint8_t *sample = samples[sample_index];
+			size_t size = sample_sizes[sample_index];
+			epoch_bytes += size;
+			sample_index++;
+
+			if (size < SegmentSize)
+				continue;
+
+			// Sliding window over all sequences which start within the segment.
+			const size_t window = SegmentSize - SequenceSize + 1;
+			uint64_t score = 0;
+			for (size_t i = 0; i < window; i++)
+				score += score_sequence(sample + i);
+
+			for (size_t i = 0; ; i++)
+			{
+				if (score > best.score)
+					best = { sample + i, score };
+				if (i + SegmentSize >= size)
+					break;
+				score -= score_sequence(sample + i);
+				score += score_sequence(sample + i + window);
+			}
+		}
+
+		if (!best.data)
+			continue;
+
+		segments.push_back(best);
+		for (size_t i = 0; i + SequenceSize <= SegmentSize; i++)
+		{
+			auto *c = counts.find(read64(best.data + i));
+			if (c)
+				c->count = 0;
+		}
+	}
+
+	// The most valuable segments go last, closest to the payload.
+	std::stable_sort(segments.begin(), segments.end(), [](const Segment &a, const Segment &b) {
+		return a.score < b.score;
+	});
+
+	uint8_t *ptr = dict;
+	for (auto &segment : segments)
+	{
+		memcpy(ptr, segment.data, SegmentSize);
+		ptr += SegmentSize;
+	}
+
+	return size_t(ptr - dict);
+}
+}
@@ -0,0 +1,63 @@
+/* Copyright (c) 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+namespace Fossilize
+{
+// Compressor and decompressor for the LZ4 block format.
+// Payloads are small and always decoded in one go, so there is no frame format or streaming support.
+// The compressor favors speed over ratio. It is meant for the recording thread, where deflate is too slow.
+
+// Worst case compressed size for an input of src_size bytes.
+size_t compute_max_size_lz4(size_t src_size);
+
+// Returns the compressed size, or 0 if dst_size is too small or the input is too large.
+size_t encode_lz4(uint8_t *dst, size_t dst_size, const uint8_t *src, size_t src_size);
+
+// Input is untrusted. Succeeds only if the decoded output is exactly dst_size bytes.
+bool decode_lz4(uint8_t *dst, size_t dst_size, const uint8_t *src, size_t src_size);
+
+// A dictionary is treated as if it immediately preceded the payload, so matches can reach back into it.
+// Only the last 64 KiB of a dictionary are within reach of LZ4 offsets.
+struct LZ4Dictionary
+{
+	std::vector<uint8_t> data;
+	std::vector<uint32_t> table;
+};
+
+// Hashes the dictionary up front, so that compressing many small payloads against it stays cheap.
+void prepare_dictionary_lz4(LZ4Dictionary &dict, const uint8_t *data, size_t size);
+size_t encode_lz4_dictionary(uint8_t *dst, size_t dst_size, const uint8_t *src, size_t src_size,
+                             const LZ4Dictionary &dict);
+bool decode_lz4_dictionary(uint8_t *dst, size_t dst_size, const uint8_t *src, size_t src_size,
+                           const uint8_t *dict, size_t dict_size);
+
+// Builds a dictionary out of the byte sequences which occur in the most samples.
+// Every sample position is tracked while training, so keep the total sample size to some tens of MiB.
+// Returns the size of the dictionary, at most dict_size.
+size_t train_dictionary_lz4(uint8_t *dict, size_t dict_size,
+                            const uint8_t * const *samples, const size_t *sample_sizes, size_t sample_count);
+}
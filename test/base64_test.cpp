@@ -0,0 +1,148 @@
+/* Copyright (c) 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "base64.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace Fossilize;
+
+static bool check_round_trip(const uint8_t *data, size_t size)
+{
+	size_t encoded_size = compute_base64_encoded_size(size);
+	std::string portable(encoded_size, '\0');
+	std::string dispatched(encoded_size + 1, '#');
+	encode_base64_portable(&portable[0], data, size);
+	encode_base64(&dispatched[0], data, size);
+
+	if (dispatched.back() != '#' || dispatched.compare(0, encoded_size, portable) != 0)
+	{
+		fprintf(stderr, "Base64 encode mismatch for size %zu with %s.\n", size, get_base64_implementation_name());
+		return false;
+	}
+
+	// Decode into an exactly sized buffer, followed by a guard byte.
+	std::vector<uint8_t> decoded(size + 1, 0xaa);
+	std::vector<uint8_t> decoded_portable(size + 1, 0xaa);
+	size_t decoded_size = decode_base64(decoded.data(), size, portable.data(), encoded_size);
+	size_t decoded_portable_size = decode_base64_portable(decoded_portable.data(), size, portable.data(), encoded_size);
+
+	if (decoded_size != size || decoded_portable_size != size ||
+	    memcmp(decoded.data(), data, size) != 0 || memcmp(decoded_portable.data(), data, size) != 0 ||
+	    decoded[size] != 0xaa || decoded_portable[size] != 0xaa)
+	{
+		fprintf(stderr, "Base64 round trip failed for size %zu with %s.\n", size, get_base64_implementation_name());
+		return false;
+	}
+
+	return true;
+}
+
+// Malformed input has to decode exactly like the scalar path does.
+static bool check_decode(const char *data, size_t length, size_t out_size)
+{
+	std::vector<uint8_t> portable(out_size + 1, 0xaa);
+	std::vector<uint8_t> dispatched(out_size + 1, 0xaa);
+	size_t portable_size = decode_base64_portable(portable.data(), out_size, data, length);
+	size_t dispatched_size = decode_base64(dispatched.data(), out_size, data, length);
+
+	if (portable_size != dispatched_size || portable_size > out_size ||
+	    memcmp(portable.data(), dispatched.data(), portable_size) != 0 || dispatched[out_size] != 0xaa)
+	{
+		fprintf(stderr, "Base64 decode mismatch for length %zu with %s.\n", length, get_base64_implementation_name());
+		return false;
+	}
+
+	return true;
+}
+
+int main()
+{
+	std::mt19937 rnd;
+	std::vector<uint8_t> buffer(64 * 1024);
+	for (auto &b : buffer)
+		b = uint8_t(rnd());
+
+	static const char *vectors[][2] = {
+		{ "", "" },
+		{ "f", "Zg==" },
+		{ "fo", "Zm8=" },
+		{ "foo", "Zm9v" },
+		{ "foob", "Zm9vYg==" },
+		{ "fooba", "Zm9vYmE=" },
+		{ "foobar", "Zm9vYmFy" },
+	};
+
+	for (auto &v : vectors)
+	{
+		size_t size = strlen(v[0]);
+		std::string encoded(compute_base64_encoded_size(size), '\0');
+		encode_base64(&encoded[0], v[0], size);
+		if (encoded != v[1])
+		{
+			fprintf(stderr, "Base64 of \"%s\" is \"%s\", expected \"%s\".\n", v[0], encoded.c_str(), v[1]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	// Every small size, at every alignment, covers the head and tail handling of all paths.
+	for (size_t size = 0; size <= 512; size++)
+		for (size_t offset = 0; offset < 16; offset++)
+			if (!check_round_trip(buffer.data() + offset, size))
+				return EXIT_FAILURE;
+
+	for (unsigned i = 0; i < 1000; i++)
+	{
+		size_t offset = rnd() % 64;
+		size_t size = rnd() % (buffer.size() - offset);
+		if (!check_round_trip(buffer.data() + offset, size))
+			return EXIT_FAILURE;
+	}
+
+	// Decoding stops once the output is full.
+	std::string encoded(compute_base64_encoded_size(1024), '\0');
+	encode_base64(&encoded[0], buffer.data(), 1024);
+	for (size_t out_size = 0; out_size <= 1024; out_size++)
+		if (!check_decode(encoded.data(), encoded.size(), out_size))
+			return EXIT_FAILURE;
+
+	// Corrupt valid input with characters from outside the alphabet, padding in the middle,
+	// and truncated groups. All of these must hit the fallback the same way on every path.
+	static const char corruptions[] = { '=', '\0', '-', '_', ' ', '\n', char(0x80), char(0xff), '@', '[', '`', '{' };
+	for (unsigned i = 0; i < 10000; i++)
+	{
+		std::string corrupted = encoded;
+		unsigned count = 1 + rnd() % 4;
+		for (unsigned j = 0; j < count; j++)
+			corrupted[rnd() % corrupted.size()] = corruptions[rnd() % sizeof(corruptions)];
+
+		size_t length = rnd() % (corrupted.size() + 1);
+		if (!check_decode(corrupted.data(), length, rnd() % 1100))
+			return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
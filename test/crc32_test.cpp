@@ -0,0 +1,78 @@
+/* Copyright (c) 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "crc32.hpp"
+#include "miniz.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <random>
+#include <vector>
+
+using namespace Fossilize;
+
+static bool check(uint32_t crc, const uint8_t *data, size_t size)
+{
+	uint32_t expected = uint32_t(mz_crc32(crc, data, size));
+	uint32_t portable = compute_crc32_portable(crc, data, size);
+	uint32_t dispatched = compute_crc32(crc, data, size);
+
+	if (portable != expected || dispatched != expected)
+	{
+		fprintf(stderr, "CRC32 mismatch for size %zu: expected %08x, portable %08x, %s %08x.\n",
+		        size, expected, portable, get_crc32_implementation_name(), dispatched);
+		return false;
+	}
+
+	return true;
+}
+
+int main()
+{
+	std::mt19937 rnd;
+	std::vector<uint8_t> buffer(256 * 1024);
+	for (auto &b : buffer)
+		b = uint8_t(rnd());
+
+	// Every small size, at every alignment, covers the head and tail handling of all paths.
+	for (size_t size = 0; size <= 512; size++)
+		for (size_t offset = 0; offset < 16; offset++)
+			if (!check(0, buffer.data() + offset, size))
+				return EXIT_FAILURE;
+
+	for (unsigned i = 0; i < 1000; i++)
+	{
+		size_t offset = rnd() % 64;
+		size_t size = rnd() % (buffer.size() - offset);
+		if (!check(uint32_t(rnd()), buffer.data() + offset, size))
+			return EXIT_FAILURE;
+	}
+
+	// Continuing a checksum must give the same result as computing it in one go.
+	uint32_t crc = 0;
+	for (size_t offset = 0; offset < buffer.size(); offset += 1000)
+		crc = compute_crc32(crc, buffer.data() + offset, std::min<size_t>(1000, buffer.size() - offset));
+	if (crc != uint32_t(mz_crc32(MZ_CRC32_INIT, buffer.data(), buffer.size())))
+		return EXIT_FAILURE;
+
+	return EXIT_SUCCESS;
+}
@@ -2732,6 +2732,219 @@ static void record_descriptor_heap(StateRecorder &recorder)
 	}
 }
 
+// Blob contents for database tests, which can be generated again to check what is read back.
+static std::vector<uint32_t> make_test_blob(Hash hash, size_t word_count)
+{
+	std::vector<uint32_t> blob(word_count);
+	for (size_t i = 0; i < word_count; i++)
+		blob[i] = uint32_t(hash * 1000 + (i & 0xff));
+	return blob;
+}
+
+// Removes anything an earlier run left behind and creates an empty stream archive.
+// The archive is not prepared yet, so that options can be set first.
+static std::unique_ptr<DatabaseInterface> create_test_archive(const char *path)
+{
+	remove(path);
+	return std::unique_ptr<DatabaseInterface>(create_stream_archive_database(path, DatabaseMode::OverWrite));
+}
+
+static bool test_write_behind_archive()
+{
+	static const char *path = ".__test_write_behind.foz";
+
+	{
+		auto db = create_test_archive(path);
+		// A small budget, so writing has to wait for the queue to drain.
+		if (!db || !db->set_write_behind(3, 4096) || !db->prepare())
+			return false;
+
+		std::vector<uint8_t> dictionary(2048);
+		for (size_t i = 0; i < dictionary.size(); i++)
+			dictionary[i] = uint8_t(i * 7);
+
+		for (Hash hash = 1; hash <= 2000; hash++)
+		{
+			if (hash == 1000 && !db->set_compression_dictionary(RESOURCE_SHADER_MODULE, dictionary.data(), dictionary.size()))
+				return false;
+
+			PayloadWriteFlags flags = PAYLOAD_WRITE_COMPUTE_CHECKSUM_BIT;
+			if (hash % 3 == 1)
+				flags |= PAYLOAD_WRITE_COMPRESS_BIT;
+			else if (hash % 3 == 2)
+				flags |= PAYLOAD_WRITE_COMPRESS_BIT | PAYLOAD_WRITE_FAST_COMPRESSION_BIT | PAYLOAD_WRITE_DICTIONARY_BIT;
+
+			// Queued entries must be visible right away, so the duplicate is dropped.
+			auto blob = make_test_blob(hash, 16 + hash % 300);
+			for (unsigned i = 0; i < 2; i++)
+				if (!db->write_entry(RESOURCE_SHADER_MODULE, hash, blob.data(), blob.size() * sizeof(uint32_t), flags))
+					return false;
+			if (!db->has_entry(RESOURCE_SHADER_MODULE, hash))
+				return false;
+		}
+
+		if (!db->flush() || !db->write_index())
+			return false;
+	}
+
+	auto db = std::unique_ptr<DatabaseInterface>(create_stream_archive_database(path, DatabaseMode::ReadOnly));
+	if (!db->prepare())
+		return false;
+
+	size_t hash_count = 0;
+	if (!db->get_hash_list_for_resource_tag(RESOURCE_SHADER_MODULE, &hash_count, nullptr) || hash_count != 2000)
+		return false;
+
+	// Entries must land back to back in the file, in the order they were written.
+	// The only gap is the dictionary entry, which is written before hash 1000.
+	uint64_t last_end = 0;
+	for (Hash hash = 1; hash <= 2000; hash++)
+	{
+		auto reference = make_test_blob(hash, 16 + hash % 300);
+		std::vector<uint32_t> blob(reference.size());
+		size_t size = blob.size() * sizeof(uint32_t);
+		uint64_t offset = 0, entry_size = 0;
+		if (!db->read_entry(RESOURCE_SHADER_MODULE, hash, &size, blob.data(), 0) || blob != reference)
+			return false;
+		if (!db->get_entry_range(RESOURCE_SHADER_MODULE, hash, &offset, &entry_size))
+			return false;
+		if (offset < last_end || (hash != 1 && hash != 1000 && offset != last_end))
+			return false;
+		last_end = offset + entry_size;
+	}
+
+	db.reset();
+	remove(path);
+
+#ifdef __linux__
+	// Writes to /dev/full fail on the I/O thread after write_entry() has returned.
+	// The failure must reach the caller through later writes and flush().
+	db.reset(create_stream_archive_database("/dev/full", DatabaseMode::OverWrite));
+	if (db->set_write_behind(2, 1024 * 1024) && db->prepare())
+	{
+		std::vector<uint8_t> blob(64 * 1024, 1);
+		bool write_failed = false;
+		for (Hash hash = 1; hash <= 64; hash++)
+			if (!db->write_entry(RESOURCE_SHADER_MODULE, hash, blob.data(), blob.size(), 0))
+				write_failed = true;
+
+		if (db->flush() || !write_failed)
+			return false;
+		if (db->write_entry(RESOURCE_SHADER_MODULE, 1000, blob.data(), blob.size(), 0))
+			return false;
+	}
+#endif
+
+	return true;
+}
+
+static bool test_zip_database()
+{
+	static const char *path = ".__test_zip.zip";
+	remove(path);
+
+	// Mix stored and deflated entries, and sizes which span several deflate blocks.
+	{
+		auto db = std::unique_ptr<DatabaseInterface>(create_zip_archive_database(path, DatabaseMode::OverWrite));
+		if (!db->prepare())
+			return false;
+
+		for (Hash hash = 1; hash <= 64; hash++)
+		{
+			auto blob = make_test_blob(hash, hash * 97);
+			if (!db->write_entry(RESOURCE_SHADER_MODULE, hash, blob.data(), blob.size() * sizeof(uint32_t),
+			                     (hash & 1) ? PAYLOAD_WRITE_COMPRESS_BIT : 0))
+				return false;
+		}
+	}
+
+	auto db = std::unique_ptr<DatabaseInterface>(create_zip_archive_database(path, DatabaseMode::ReadOnly));
+	if (!db->prepare())
+		return false;
+
+	std::vector<std::future<bool>> tasks;
+	for (unsigned i = 0; i < 4; i++)
+	{
+		tasks.push_back(std::async(std::launch::async, [&]() {
+			for (Hash hash = 1; hash <= 64; hash++)
+			{
+				auto reference = make_test_blob(hash, hash * 97);
+				size_t size = 0;
+				if (!db->read_entry(RESOURCE_SHADER_MODULE, hash, &size, nullptr, PAYLOAD_READ_CONCURRENT_BIT))
+					return false;
+				if (size != reference.size() * sizeof(uint32_t))
+					return false;
+
+				std::vector<uint32_t> blob(reference.size());
+				if (!db->read_entry(RESOURCE_SHADER_MODULE, hash, &size, blob.data(), PAYLOAD_READ_CONCURRENT_BIT))
+					return false;
+				if (blob != reference)
+					return false;
+			}
+			return true;
+		}));
+	}
+
+	bool success = true;
+	for (auto &task : tasks)
+		if (!task.get())
+			success = false;
+
+	db.reset();
+	remove(path);
+	return success;
+}
+
+static bool test_folder_database()
+{
+	static const char *dir = ".__test_folder_db";
+
+	{
+		auto db = std::unique_ptr<DatabaseInterface>(create_dumb_folder_database(dir, DatabaseMode::OverWrite));
+		db->set_overwrite_db_clear(true);
+		if (!db->prepare())
+			return false;
+
+		for (Hash hash = 1; hash <= 1000; hash++)
+			if (!db->write_entry(RESOURCE_SAMPLER, hash * 0x9e3779b97f4a7c15ull, &hash, sizeof(hash), 0))
+				return false;
+	}
+
+	// Entries go into a subdirectory named after the first two hex digits of the hash.
+	if (!Path::is_file(std::string(dir) + "/9e/01.9e3779b97f4a7c15.json"))
+		return false;
+
+	// Databases from before sharding have every entry at the top level.
+	FILE *file = fopen((std::string(dir) + "/01.0000000000000002.json").c_str(), "wb");
+	if (!file)
+		return false;
+	fputs("flat", file);
+	fclose(file);
+
+	auto db = std::unique_ptr<DatabaseInterface>(create_dumb_folder_database(dir, DatabaseMode::ReadOnly));
+	if (!db->prepare())
+		return false;
+
+	size_t hash_count = 0;
+	if (!db->get_hash_list_for_resource_tag(RESOURCE_SAMPLER, &hash_count, nullptr) || hash_count != 1001)
+		return false;
+
+	for (Hash hash = 1; hash <= 1000; hash++)
+	{
+		Hash value = 0;
+		size_t size = sizeof(value);
+		if (!db->read_entry(RESOURCE_SAMPLER, hash * 0x9e3779b97f4a7c15ull, &size, &value, 0) || value != hash)
+			return false;
+	}
+
+	char flat[4] = {};
+	size_t flat_size = sizeof(flat);
+	if (!db->read_entry(RESOURCE_SAMPLER, 2, &flat_size, flat, 0) || memcmp(flat, "flat", 4) != 0)
+		return false;
+
+	return true;
+}
+
 static bool test_database()
 {
 	remove(".__test_tmp.foz");
@@ -3657,6 +3870,77 @@ static bool test_filter()
 	return true;
 }
 
+static bool verify_archive_statistics(DatabaseInterface &db)
+{
+	DatabaseStatistics stats;
+	if (!db.get_statistics(&stats))
+		return false;
+
+	auto &modules = stats.tags[RESOURCE_SHADER_MODULE];
+	if (modules.entry_count != 3 || modules.compressed_entry_count != 1 || modules.uncompressed_bytes != 4 + 1000 + 5000)
+		return false;
+	// The compressible entry is stored in far fewer bytes than it takes up.
+	if (modules.stored_bytes >= modules.uncompressed_bytes || modules.stored_bytes <= 4 + 1000)
+		return false;
+	if (modules.size_histogram[2] != 1 || modules.size_histogram[9] != 1 || modules.size_histogram[12] != 1)
+		return false;
+
+	auto &samplers = stats.tags[RESOURCE_SAMPLER];
+	if (samplers.entry_count != 1 || samplers.stored_bytes != 0 || samplers.size_histogram[0] != 1)
+		return false;
+
+	for (unsigned i = 0; i < RESOURCE_COUNT; i++)
+		if (i != RESOURCE_SHADER_MODULE && i != RESOURCE_SAMPLER && stats.tags[i].entry_count != 0)
+			return false;
+
+	return stats.dictionary_count == 0;
+}
+
+static bool test_archive_statistics()
+{
+	static const char *path = ".__test_statistics.foz";
+	char export_path[DatabaseInterface::OSHandleNameSize];
+	DatabaseInterface::get_unique_os_export_name(export_path, sizeof(export_path));
+
+	{
+		auto db = create_test_archive(path);
+		if (!db || !db->prepare())
+			return false;
+
+		uint32_t value = 1;
+		std::vector<uint8_t> incompressible(1000);
+		for (size_t i = 0; i < incompressible.size(); i++)
+			incompressible[i] = uint8_t((i * 2654435761u) >> 13);
+		std::vector<uint8_t> zeros(5000);
+
+		if (!db->write_entry(RESOURCE_SHADER_MODULE, 1, &value, sizeof(value), 0) ||
+		    !db->write_entry(RESOURCE_SHADER_MODULE, 2, incompressible.data(), incompressible.size(), 0) ||
+		    !db->write_entry(RESOURCE_SHADER_MODULE, 3, zeros.data(), zeros.size(), PAYLOAD_WRITE_COMPRESS_BIT) ||
+		    !db->write_entry(RESOURCE_SAMPLER, 1, nullptr, 0, 0))
+			return false;
+	}
+
+	intptr_t handle;
+	{
+		auto db = std::unique_ptr<DatabaseInterface>(create_stream_archive_database(path, DatabaseMode::ReadOnly));
+		if (!db || !db->prepare() || !verify_archive_statistics(*db))
+			return false;
+
+		handle = db->export_metadata_to_os_handle(export_path);
+		if (!DatabaseInterface::metadata_handle_is_valid(handle))
+			return false;
+	}
+
+	// The same statistics must come out of imported metadata.
+	auto db = std::unique_ptr<DatabaseInterface>(create_stream_archive_database(path, DatabaseMode::ReadOnly));
+	if (!db || !db->import_metadata_from_os_handle(handle) || !db->prepare() || !verify_archive_statistics(*db))
+		return false;
+
+	db.reset();
+	remove(path);
+	return true;
+}
+
 static bool test_export_single_archive()
 {
 	static const uint16_t one = 1;
@@ -3787,6 +4071,534 @@ static bool test_export_single_archive()
 	return true;
 }
 
+static bool verify_archive_index_entries(const char *path, unsigned count)
+{
+	auto db = std::unique_ptr<DatabaseInterface>(create_stream_archive_database(path, DatabaseMode::ReadOnly));
+	if (!db || !db->prepare())
+		return false;
+
+	size_t hash_count = 0;
+	if (!db->get_hash_list_for_resource_tag(RESOURCE_SHADER_MODULE, &hash_count, nullptr) || hash_count != count)
+		return false;
+
+	for (unsigned i = 0; i < count; i++)
+	{
+		uint64_t value = 0;
+		size_t blob_size = sizeof(value);
+		if (!db->read_entry(RESOURCE_SHADER_MODULE, i + 1, &blob_size, &value, 0) || value != 1000 + i)
+			return false;
+	}
+
+	return !db->has_entry(RESOURCE_SHADER_MODULE, count + 1);
+}
+
+static bool archive_has_index(const char *path)
+{
+	FILE *file = fopen(path, "rb");
+	if (!file)
+		return false;
+	char magic[8] = {};
+	bool ret = fseek(file, -long(sizeof(magic)), SEEK_END) == 0 &&
+	           fread(magic, 1, sizeof(magic), file) == sizeof(magic) &&
+	           memcmp(magic, "FOZINDEX", sizeof(magic)) == 0;
+	fclose(file);
+	return ret;
+}
+
+static bool test_archive_index()
+{
+	static const char *path = ".__test_archive_index.foz";
+
+	{
+		auto db = create_test_archive(path);
+		if (!db || !db->prepare())
+			return false;
+
+		for (unsigned i = 0; i < 3; i++)
+		{
+			uint64_t value = 1000 + i;
+			if (!db->write_entry(RESOURCE_SHADER_MODULE, i + 1, &value, sizeof(value),
+			                     i & 1 ? (PAYLOAD_WRITE_COMPRESS_BIT | PAYLOAD_WRITE_COMPUTE_CHECKSUM_BIT) : 0))
+				return false;
+		}
+
+		if (!db->write_index())
+			return false;
+	}
+
+	if (!archive_has_index(path) || !verify_archive_index_entries(path, 3))
+		return false;
+
+	// Appending keeps the index, and write_index() chains a segment index to it.
+	{
+		auto db = std::unique_ptr<DatabaseInterface>(create_stream_archive_database(path, DatabaseMode::Append));
+		if (!db || !db->prepare())
+			return false;
+		uint64_t value = 1003;
+		if (!db->write_entry(RESOURCE_SHADER_MODULE, 4, &value, sizeof(value), 0))
+			return false;
+		if (!db->write_index())
+			return false;
+	}
+
+	if (!archive_has_index(path) || !verify_archive_index_entries(path, 4))
+		return false;
+
+	// Closing an Append database seals what it wrote, even without an explicit write_index().
+	{
+		auto db = std::unique_ptr<DatabaseInterface>(create_stream_archive_database(path, DatabaseMode::Append));
+		if (!db || !db->prepare())
+			return false;
+		uint64_t value = 1004;
+		if (!db->write_entry(RESOURCE_SHADER_MODULE, 5, &value, sizeof(value), 0))
+			return false;
+	}
+
+	if (!archive_has_index(path) || !verify_archive_index_entries(path, 5))
+		return false;
+
+	{
+		auto db = std::unique_ptr<DatabaseInterface>(create_stream_archive_database(path, DatabaseMode::Append));
+		if (!db || !db->prepare() || !db->write_index())
+			return false;
+	}
+
+	if (!archive_has_index(path) || !verify_archive_index_entries(path, 5))
+		return false;
+
+	// Drop the last segment index, as if the session which wrote entry 5 was killed before it could seal it.
+	// The next Append session only has to scan that entry, and seals it along with its own.
+	{
+		std::vector<uint8_t> data;
+		FILE *file = fopen(path, "rb");
+		if (!file)
+			return false;
+		fseek(file, 0, SEEK_END);
+		data.resize(size_t(ftell(file)));
+		rewind(file);
+		bool read_ok = fread(data.data(), 1, data.size(), file) == data.size();
+		fclose(file);
+
+		size_t segment_size = 40 + 16 + 8 + RESOURCE_COUNT * 8 + 32 + 8 + 24;
+		if (!read_ok || data.size() < segment_size)
+			return false;
+
+		file = fopen(path, "wb");
+		if (!file)
+			return false;
+		bool write_ok = fwrite(data.data(), 1, data.size() - segment_size, file) == data.size() - segment_size;
+		fclose(file);
+		if (!write_ok)
+			return false;
+	}
+
+	if (archive_has_index(path) || !verify_archive_index_entries(path, 5))
+		return false;
+
+	{
+		auto db = std::unique_ptr<DatabaseInterface>(create_stream_archive_database(path, DatabaseMode::Append));
+		if (!db || !db->prepare())
+			return false;
+		uint64_t value = 1005;
+		if (!db->write_entry(RESOURCE_SHADER_MODULE, 6, &value, sizeof(value), 0))
+			return false;
+	}
+
+	if (!archive_has_index(path) || !verify_archive_index_entries(path, 6))
+		return false;
+
+	// A corrupt index must be ignored.
+	{
+		FILE *file = fopen(path, "r+b");
+		if (!file)
+			return false;
+		// Hits the record_count array of the last segment index, which describes entries 5 and 6.
+		if (fseek(file, -(24 + 8 + 2 * 32 + 8), SEEK_END) != 0 || fputc(0xff, file) == EOF)
+		{
+			fclose(file);
+			return false;
+		}
+		fclose(file);
+	}
+
+	if (!verify_archive_index_entries(path, 6))
+		return false;
+
+	remove(path);
+	return true;
+}
+
+static int get_archive_version(const char *path)
+{
+	FILE *file = fopen(path, "rb");
+	if (!file)
+		return -1;
+	uint8_t magic[16];
+	int version = fread(magic, 1, sizeof(magic), file) == sizeof(magic) ? magic[15] : -1;
+	fclose(file);
+	return version;
+}
+
+static bool test_lz4_archive()
+{
+	static const char *path = ".__test_lz4_archive.foz";
+
+	std::vector<uint8_t> blobs[4];
+	for (unsigned i = 0; i < 4; i++)
+	{
+		blobs[i].resize(1000 + 4000 * i);
+		for (size_t j = 0; j < blobs[i].size(); j++)
+			blobs[i][j] = uint8_t((j % (17 + i)) ^ (j >> 9));
+	}
+
+	{
+		auto db = create_test_archive(path);
+		if (!db || !db->prepare())
+			return false;
+		if (!db->write_entry(RESOURCE_SHADER_MODULE, 1, blobs[0].data(), blobs[0].size(),
+		                     PAYLOAD_WRITE_COMPRESS_BIT | PAYLOAD_WRITE_COMPUTE_CHECKSUM_BIT))
+			return false;
+	}
+
+	// Only archives which actually contain LZ4 payloads require the newer version.
+	if (get_archive_version(path) != FOSSILIZE_FORMAT_VERSION)
+		return false;
+
+	{
+		auto db = std::unique_ptr<DatabaseInterface>(create_stream_archive_database(path, DatabaseMode::Append));
+		if (!db || !db->prepare())
+			return false;
+		for (unsigned i = 1; i < 4; i++)
+		{
+			if (!db->write_entry(RESOURCE_SHADER_MODULE, i + 1, blobs[i].data(), blobs[i].size(),
+			                     PAYLOAD_WRITE_COMPRESS_BIT | PAYLOAD_WRITE_FAST_COMPRESSION_BIT |
+			                     (i & 1 ? PAYLOAD_WRITE_COMPUTE_CHECKSUM_BIT : PAYLOAD_WRITE_NO_FLAGS)))
+				return false;
+		}
+		if (!db->write_index())
+			return false;
+	}
+
+	if (get_archive_version(path) != 7)
+		return false;
+
+	for (auto flags : { PAYLOAD_READ_NO_FLAGS, PAYLOAD_READ_CONCURRENT_BIT })
+	{
+		auto db = std::unique_ptr<DatabaseInterface>(create_stream_archive_database(path, DatabaseMode::ReadOnly));
+		if (!db || !db->prepare())
+			return false;
+
+		for (unsigned i = 0; i < 4; i++)
+		{
+			size_t blob_size = 0;
+			if (!db->read_entry(RESOURCE_SHADER_MODULE, i + 1, &blob_size, nullptr, flags))
+				return false;
+			std::vector<uint8_t> blob(blob_size);
+			if (!db->read_entry(RESOURCE_SHADER_MODULE, i + 1, &blob_size, blob.data(), flags))
+				return false;
+			if (blob != blobs[i])
+				return false;
+		}
+	}
+
+	remove(path);
+	return true;
+}
+
+static bool verify_archive_entries(const char *path, const std::vector<uint8_t> *blobs, unsigned count,
+                                   PayloadReadFlags flags)
+{
+	auto db = std::unique_ptr<DatabaseInterface>(create_stream_archive_database(path, DatabaseMode::ReadOnly));
+	if (!db || !db->prepare())
+		return false;
+
+	for (unsigned i = 0; i < count; i++)
+	{
+		size_t blob_size = 0;
+		if (!db->read_entry(RESOURCE_SHADER_MODULE, i + 1, &blob_size, nullptr, flags))
+			return false;
+		std::vector<uint8_t> blob(blob_size);
+		if (!db->read_entry(RESOURCE_SHADER_MODULE, i + 1, &blob_size, blob.data(), flags))
+			return false;
+		if (blob != blobs[i])
+			return false;
+	}
+
+	return true;
+}
+
+static bool test_dictionary_archive()
+{
+	static const char *path = ".__test_dictionary_archive.foz";
+	static const char *merged_path = ".__test_dictionary_archive_merged.foz";
+
+	// Every blob is mostly made up of snippets from the dictionary.
+	std::vector<uint8_t> dict(16 * 1024);
+	for (size_t i = 0; i < dict.size(); i++)
+		dict[i] = uint8_t((i * 2654435761u) >> 13);
+
+	std::vector<uint8_t> blobs[8];
+	for (unsigned i = 0; i < 8; i++)
+	{
+		for (unsigned j = 0; j < 20 + 10 * i; j++)
+		{
+			size_t offset = (j * 7919 + i * 104729) % (dict.size() - 32);
+			blobs[i].insert(blobs[i].end(), dict.begin() + offset, dict.begin() + offset + 32);
+			blobs[i].push_back(uint8_t(i + j));
+		}
+	}
+
+	const PayloadWriteFlags flags = PAYLOAD_WRITE_COMPRESS_BIT | PAYLOAD_WRITE_DICTIONARY_BIT |
+	                                PAYLOAD_WRITE_COMPUTE_CHECKSUM_BIT;
+
+	{
+		auto db = create_test_archive(path);
+		if (!db || !db->prepare())
+			return false;
+		if (!db->set_compression_dictionary(RESOURCE_SHADER_MODULE, dict.data(), dict.size()))
+			return false;
+		for (unsigned i = 0; i < 4; i++)
+			if (!db->write_entry(RESOURCE_SHADER_MODULE, i + 1, blobs[i].data(), blobs[i].size(), flags))
+				return false;
+		if (!db->write_index())
+			return false;
+	}
+
+	if (get_archive_version(path) != 8)
+		return false;
+
+	// Setting the same dictionary again must reuse the stored one.
+	{
+		auto db = std::unique_ptr<DatabaseInterface>(create_stream_archive_database(path, DatabaseMode::Append));
+		if (!db || !db->prepare())
+			return false;
+		if (!db->set_compression_dictionary(RESOURCE_SHADER_MODULE, dict.data(), dict.size()))
+			return false;
+		for (unsigned i = 4; i < 8; i++)
+			if (!db->write_entry(RESOURCE_SHADER_MODULE, i + 1, blobs[i].data(), blobs[i].size(), flags))
+				return false;
+		if (!db->write_index())
+			return false;
+	}
+
+	if (!verify_archive_entries(path, blobs, 8, PAYLOAD_READ_NO_FLAGS) ||
+	    !verify_archive_entries(path, blobs, 8, PAYLOAD_READ_CONCURRENT_BIT))
+		return false;
+
+	// Raw payloads cannot be copied to an archive which lacks their dictionary.
+	{
+		auto src = std::unique_ptr<DatabaseInterface>(create_stream_archive_database(path, DatabaseMode::ReadOnly));
+		auto dst = create_test_archive(merged_path);
+		if (!src || !src->prepare() || !dst || !dst->prepare())
+			return false;
+
+		size_t blob_size = 0;
+		if (!src->read_entry(RESOURCE_SHADER_MODULE, 1, &blob_size, nullptr, PAYLOAD_READ_RAW_FOSSILIZE_DB_BIT))
+			return false;
+		std::vector<uint8_t> raw(blob_size);
+		if (!src->read_entry(RESOURCE_SHADER_MODULE, 1, &blob_size, raw.data(), PAYLOAD_READ_RAW_FOSSILIZE_DB_BIT))
+			return false;
+		if (dst->write_entry(RESOURCE_SHADER_MODULE, 1, raw.data(), raw.size(), PAYLOAD_WRITE_RAW_FOSSILIZE_DB_BIT))
+			return false;
+	}
+	remove(merged_path);
+
+	// Merging carries the dictionary along with the entries.
+	const char *inputs[] = { path };
+	if (!merge_concurrent_databases(merged_path, inputs, 1, false))
+		return false;
+	if (get_archive_version(merged_path) != 8)
+		return false;
+	if (!verify_archive_entries(merged_path, blobs, 8, PAYLOAD_READ_NO_FLAGS))
+		return false;
+	remove(merged_path);
+
+	// Without a dictionary for the tag, the flag is ignored and entries are deflated as usual.
+	{
+		auto db = create_test_archive(merged_path);
+		if (!db || !db->prepare())
+			return false;
+		for (unsigned i = 0; i < 8; i++)
+			if (!db->write_entry(RESOURCE_SHADER_MODULE, i + 1, blobs[i].data(), blobs[i].size(), flags))
+				return false;
+	}
+
+	if (get_archive_version(merged_path) >= 7)
+		return false;
+	if (!verify_archive_entries(merged_path, blobs, 8, PAYLOAD_READ_NO_FLAGS))
+		return false;
+
+	remove(path);
+	remove(merged_path);
+	return true;
+}
+
+static bool test_merge_last_use()
+{
+	static const char *append_path = ".__test_merge_last_use.foz";
+	static const char *missing_path = ".__test_merge_last_use_missing.foz";
+	// More sources than the merge keeps open at once, so unindexed sources are merged in several batches.
+	enum { SourceCount = 80, HashCount = 200 };
+	static const ResourceTag tags[] = { RESOURCE_SHADER_MODULE, RESOURCE_GRAPHICS_PIPELINE };
+
+	std::vector<std::string> source_paths;
+	for (unsigned i = 0; i < SourceCount; i++)
+		source_paths.push_back(".__test_merge_last_use." + std::to_string(i) + ".foz");
+
+	const auto remove_all = [&]() {
+		remove(append_path);
+		remove(missing_path);
+		for (auto &path : source_paths)
+			remove(path.c_str());
+	};
+	remove_all();
+
+	// Highest timestamp seen for each hash, or 0 if no archive has it.
+	std::vector<uint64_t> expected[2];
+	for (auto &e : expected)
+		e.resize(HashCount);
+
+	const auto write_archive = [&](const char *path, unsigned seed, bool index) -> bool {
+		auto db = create_test_archive(path);
+		if (!db || !db->prepare())
+			return false;
+
+		// Every archive has a different subset of the same hashes, so most hashes are in several archives.
+		for (Hash hash = 1; hash <= HashCount; hash++)
+		{
+			if ((hash * 7 + seed) % 3 == 0)
+				continue;
+
+			for (unsigned i = 0; i < 2; i++)
+			{
+				uint64_t timestamp = 1 + (hash * 2654435761u + seed * 40503u + i * 977u) % 100000;
+				if (!db->write_entry(tags[i], hash, &timestamp, sizeof(timestamp), PAYLOAD_WRITE_COMPUTE_CHECKSUM_BIT))
+					return false;
+				expected[i][hash - 1] = std::max(expected[i][hash - 1], timestamp);
+			}
+		}
+
+		return !index || db->write_index();
+	};
+
+	// Only some sources are sealed with an index, like per-process archives written in ExclusiveOverWrite mode are not.
+	if (!write_archive(append_path, 0, true))
+		return false;
+	for (unsigned i = 0; i < SourceCount; i++)
+		if (!write_archive(source_paths[i].c_str(), i + 1, i % 3 == 0))
+			return false;
+
+	std::vector<const char *> inputs;
+	for (auto &path : source_paths)
+		inputs.push_back(path.c_str());
+	inputs.insert(inputs.begin() + SourceCount / 2, missing_path);
+
+	const std::string tmp_path = std::string(append_path) + ".tmp";
+
+	// A missing input fails the merge unless it is allowed to be skipped.
+	if (merge_concurrent_databases_last_use(append_path, inputs.data(), inputs.size(), false))
+		return false;
+	if (file_exists(tmp_path.c_str()))
+		return false;
+	if (!merge_concurrent_databases_last_use(append_path, inputs.data(), inputs.size(), true))
+		return false;
+
+	if (!archive_has_index(append_path) || file_exists(tmp_path.c_str()) ||
+	    file_exists((std::string(append_path) + ".run0.tmp").c_str()))
+		return false;
+
+	auto db = std::unique_ptr<DatabaseInterface>(create_stream_archive_database(append_path, DatabaseMode::ReadOnly));
+	if (!db || !db->prepare())
+		return false;
+
+	for (unsigned i = 0; i < 2; i++)
+	{
+		for (Hash hash = 1; hash <= HashCount; hash++)
+		{
+			uint64_t expected_timestamp = expected[i][hash - 1];
+			if (!expected_timestamp)
+			{
+				if (db->has_entry(tags[i], hash))
+					return false;
+				continue;
+			}
+
+			uint64_t timestamp = 0;
+			size_t size = sizeof(timestamp);
+			if (!db->read_entry(tags[i], hash, &size, &timestamp, PAYLOAD_READ_NO_FLAGS) ||
+			    size != sizeof(timestamp) || timestamp != expected_timestamp)
+			{
+				return false;
+			}
+		}
+	}
+
+	db.reset();
+	remove_all();
+	return true;
+}
+
+static bool test_concurrent_primed_hashes()
+{
+	static const char *base_path = ".__test_primed";
+	static const char *read_only_path = ".__test_primed.foz";
+	static const char *extra_path = ".__test_primed_extra.foz";
+	static const char *write_path = ".__test_primed.1.foz";
+	remove(write_path);
+
+	static const uint32_t payload = 1;
+	for (auto *path : { read_only_path, extra_path })
+	{
+		auto db = create_test_archive(path);
+		if (!db || !db->prepare())
+			return false;
+
+		// Overlapping ranges, so that some hashes are in both archives.
+		Hash base = path == read_only_path ? 1 : 3001;
+		for (Hash hash = base; hash < base + 4000; hash++)
+		{
+			auto tag = (hash & 1) ? RESOURCE_SHADER_MODULE : RESOURCE_GRAPHICS_PIPELINE;
+			if (!db->write_entry(tag, hash * 0x100000001b3ull, &payload, sizeof(payload), 0))
+				return false;
+		}
+	}
+
+	{
+		const char *extra_paths[] = { extra_path };
+		auto db = std::unique_ptr<DatabaseInterface>(
+				create_concurrent_database(base_path, DatabaseMode::Append, extra_paths, 1));
+		if (!db || !db->prepare())
+			return false;
+
+		for (Hash hash = 1; hash < 7001; hash++)
+		{
+			auto tag = (hash & 1) ? RESOURCE_SHADER_MODULE : RESOURCE_GRAPHICS_PIPELINE;
+			auto other_tag = (hash & 1) ? RESOURCE_GRAPHICS_PIPELINE : RESOURCE_SHADER_MODULE;
+			if (!db->has_entry(tag, hash * 0x100000001b3ull) || db->has_entry(other_tag, hash * 0x100000001b3ull))
+				return false;
+		}
+
+		for (Hash hash = 7001; hash < 100000; hash++)
+			if (db->has_entry(RESOURCE_SHADER_MODULE, hash * 0x100000001b3ull))
+				return false;
+
+		// Everything is already known, so nothing should be written.
+		if (!db->write_entry(RESOURCE_SHADER_MODULE, 0x100000001b3ull, &payload, sizeof(payload), 0))
+			return false;
+	}
+
+	FILE *file = fopen(write_path, "rb");
+	if (file)
+	{
+		fclose(file);
+		return false;
+	}
+
+	remove(read_only_path);
+	remove(extra_path);
+	return true;
+}
+
 static bool test_export_concurrent_archive(bool with_read_only)
 {
 	remove(".__test_archive.foz");
@@ -4276,6 +5088,139 @@ static bool test_pdf_recording()
 	return true;
 }
 
+static bool test_binary_encoding()
+{
+	static const char *path = ".__test_binary.foz";
+	static const ResourceTag tags[] = {
+		RESOURCE_SAMPLER,
+		RESOURCE_DESCRIPTOR_SET_LAYOUT,
+		RESOURCE_PIPELINE_LAYOUT,
+		RESOURCE_SHADER_MODULE,
+		RESOURCE_COMPUTE_PIPELINE,
+	};
+
+	{
+		auto db = create_test_archive(path);
+		if (!db)
+			return false;
+
+		StateRecorder recorder;
+		recorder.set_database_enable_binary_encoding(true);
+		recorder.init_recording_synchronized(db.get());
+
+		VkSamplerCreateInfo samp = { VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO };
+		samp.mipLodBias = -1.5f;
+		samp.maxLod = 1000.0f;
+		samp.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+		auto sampler = fake_handle<VkSampler>(1);
+		if (!recorder.record_sampler(sampler, samp))
+			return false;
+
+		VkDescriptorSetLayoutBinding binding = {};
+		binding.descriptorType = VK_DESCRIPTOR_TYPE_SAMPLER;
+		binding.descriptorCount = 1;
+		binding.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+		binding.pImmutableSamplers = &sampler;
+		VkDescriptorSetLayoutCreateInfo set_layout_info = { VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO };
+		set_layout_info.bindingCount = 1;
+		set_layout_info.pBindings = &binding;
+		auto set_layout = fake_handle<VkDescriptorSetLayout>(1);
+		if (!recorder.record_descriptor_set_layout(set_layout, set_layout_info))
+			return false;
+
+		VkPushConstantRange range = { VK_SHADER_STAGE_COMPUTE_BIT, 16, 64 };
+		VkPipelineLayoutCreateInfo layout_info = { VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO };
+		layout_info.setLayoutCount = 1;
+		layout_info.pSetLayouts = &set_layout;
+		layout_info.pushConstantRangeCount = 1;
+		layout_info.pPushConstantRanges = &range;
+		auto layout = fake_handle<VkPipelineLayout>(1);
+		if (!recorder.record_pipeline_layout(layout, layout_info))
+			return false;
+
+		static const uint32_t code[] = { 0x07230203, 0x10000, 0xffffffffu, 0, 1, 2, 3, 100000 };
+		VkShaderModuleCreateInfo module_info = { VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO };
+		module_info.codeSize = sizeof(code);
+		module_info.pCode = code;
+		auto module = fake_handle<VkShaderModule>(1);
+		if (!recorder.record_shader_module(module, module_info))
+			return false;
+
+		static const uint32_t spec_data[] = { 1, 2 };
+		static const VkSpecializationMapEntry spec_entries[] = { { 0, 0, 4 }, { 7, 4, 4 } };
+		VkSpecializationInfo spec = {};
+		spec.mapEntryCount = 2;
+		spec.pMapEntries = spec_entries;
+		spec.dataSize = sizeof(spec_data);
+		spec.pData = spec_data;
+		VkComputePipelineCreateInfo pipe_info = { VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO };
+		pipe_info.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+		pipe_info.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+		pipe_info.stage.module = module;
+		pipe_info.stage.pName = "main";
+		pipe_info.stage.pSpecializationInfo = &spec;
+		pipe_info.layout = layout;
+		pipe_info.basePipelineIndex = -1;
+		if (!recorder.record_compute_pipeline(fake_handle<VkPipeline>(1), pipe_info, nullptr, 0))
+			return false;
+	}
+
+	auto db = std::unique_ptr<DatabaseInterface>(create_stream_archive_database(path, DatabaseMode::ReadOnly));
+	if (!db || !db->prepare())
+		return false;
+
+	StateReplayer replayer, json_replayer;
+	ReplayInterface iface, json_iface;
+	std::vector<uint8_t> blob, json, binary;
+
+	for (auto tag : tags)
+	{
+		size_t hash_count = 0;
+		if (!db->get_hash_list_for_resource_tag(tag, &hash_count, nullptr) || hash_count != 1)
+			return false;
+		Hash hash;
+		if (!db->get_hash_list_for_resource_tag(tag, &hash_count, &hash))
+			return false;
+
+		size_t blob_size = 0;
+		if (!db->read_entry(tag, hash, &blob_size, nullptr, PAYLOAD_READ_NO_FLAGS))
+			return false;
+		blob.resize(blob_size);
+		if (!db->read_entry(tag, hash, &blob_size, blob.data(), PAYLOAD_READ_NO_FLAGS))
+			return false;
+
+		// The replay interface verifies that the decoded create infos hash to what was recorded.
+		if (blob.empty() || blob[0] != '\0')
+			return false;
+		if (!replayer.parse(iface, db.get(), blob.data(), blob.size()))
+			return false;
+
+		// Going through JSON and back must be lossless.
+		if (!convert_state_blob(blob.data(), blob.size(), false, json) || json.empty() || json[0] != '{')
+			return false;
+		if (!json_replayer.parse(json_iface, db.get(), json.data(), json.size()))
+			return false;
+		if (!convert_state_blob(json.data(), json.size(), true, binary) || binary != blob)
+			return false;
+		if (blob.size() >= json.size())
+			return false;
+
+		// Truncated blobs must be rejected.
+		if (convert_state_blob(blob.data(), blob.size() / 2, false, json))
+			return false;
+	}
+
+	// So must payloads which parse as JSON, but are not state blobs.
+	static const char *const non_state_blobs[] = { "[1, 2, 3]", "\"string\"", "42" };
+	for (auto *non_state : non_state_blobs)
+		if (convert_state_blob(non_state, strlen(non_state), true, binary))
+			return false;
+
+	db.reset();
+	remove(path);
+	return true;
+}
+
 static bool test_reused_handles()
 {
 	std::vector<Hash> expect_pass[RESOURCE_COUNT];
@@ -4775,14 +5720,32 @@ int main()
 		return EXIT_FAILURE;
 	if (!test_database())
 		return EXIT_FAILURE;
+	if (!test_folder_database())
+		return EXIT_FAILURE;
+	if (!test_zip_database())
+		return EXIT_FAILURE;
+	if (!test_write_behind_archive())
+		return EXIT_FAILURE;
 	if (!test_filter())
 		return EXIT_FAILURE;
 	if (!test_export_single_archive())
 		return EXIT_FAILURE;
+	if (!test_archive_statistics())
+		return EXIT_FAILURE;
+	if (!test_archive_index())
+		return EXIT_FAILURE;
+	if (!test_lz4_archive())
+		return EXIT_FAILURE;
+	if (!test_dictionary_archive())
+		return EXIT_FAILURE;
+	if (!test_merge_last_use())
+		return EXIT_FAILURE;
 	if (!test_export_concurrent_archive(false))
 		return EXIT_FAILURE;
 	if (!test_export_concurrent_archive(true))
 		return EXIT_FAILURE;
+	if (!test_concurrent_primed_hashes())
+		return EXIT_FAILURE;
 	if (!test_logging())
 		return EXIT_FAILURE;
 	if (!test_pnext_shader_module_hashing())
@@ -4794,6 +5757,9 @@ int main()
 	if (!test_reused_handles())
 		return EXIT_FAILURE;
 
+	if (!test_binary_encoding())
+		return EXIT_FAILURE;
+
 	if (!test_module_identifiers())
 		return EXIT_FAILURE;
 
@@ -4847,5 +5813,12 @@ int main()
 
 	if (!replayer.parse(iface, nullptr, res.data(), res.size()))
 		return EXIT_FAILURE;
+
+	// Decoding strings in place must give the same create infos.
+	StateReplayer in_place_replayer;
+	ReplayInterface in_place_iface;
+	res.push_back('\0');
+	if (!in_place_replayer.parse_in_place(in_place_iface, nullptr, res.data(), res.size()))
+		return EXIT_FAILURE;
 	return EXIT_SUCCESS;
 }
@@ -22,12 +22,73 @@
 
 #include "fossilize.hpp"
 #include "varint.hpp"
+#include <stdio.h>
 #include <string.h>
 #include <random>
 #include <vector>
 
 using namespace Fossilize;
 
+// Picks each word's encoded length at random, so that every shuffle table pattern shows up.
+static uint32_t random_word(std::mt19937 &rnd)
+{
+	switch (rnd() % 6)
+	{
+	case 0:
+		return uint32_t(rnd()) & 0x7f;
+	case 1:
+		return uint32_t(rnd()) & 0x3fff;
+	case 2:
+		return uint32_t(rnd()) & 0x1fffff;
+	case 3:
+		return uint32_t(rnd()) & 0xfffffff;
+	case 4:
+		return uint32_t(rnd());
+	default:
+		return uint32_t(rnd()) & 1;
+	}
+}
+
+// The dispatched decoder must accept and reject exactly the same input as the portable one.
+static bool fuzz_decode_equivalence()
+{
+	std::mt19937 rnd(1);
+	for (unsigned iteration = 0; iteration < 100000; iteration++)
+	{
+		std::vector<uint32_t> words(rnd() % 100);
+		for (auto &w : words)
+			w = random_word(rnd);
+
+		// Pad the buffer, so that decoding can be pointed past the encoded data.
+		std::vector<uint8_t> encoded(compute_size_varint(words.data(), words.size()) + 16);
+		size_t encoded_size = encode_varint(encoded.data(), words.data(), words.size()) - encoded.data();
+
+		if (rnd() & 1)
+		{
+			unsigned flips = rnd() % 4;
+			for (unsigned i = 0; i < flips && encoded_size; i++)
+				encoded[rnd() % encoded_size] ^= uint8_t(1u << (rnd() % 8));
+		}
+
+		size_t buffer_size = (rnd() % 4) ? encoded_size : size_t(rnd() % encoded.size());
+		size_t words_size = (rnd() % 4) ? words.size() : size_t(rnd() % (words.size() + 8));
+
+		std::vector<uint32_t> portable(words_size);
+		std::vector<uint32_t> dispatched(words_size);
+		bool portable_ok = decode_varint_portable(portable.data(), words_size, encoded.data(), buffer_size);
+		bool dispatched_ok = decode_varint(dispatched.data(), words_size, encoded.data(), buffer_size);
+
+		if (portable_ok != dispatched_ok || (portable_ok && portable != dispatched))
+		{
+			fprintf(stderr, "Varint decode mismatch with %s for %zu words, %zu bytes.\n",
+			        get_varint_implementation_name(), words_size, buffer_size);
+			return false;
+		}
+	}
+
+	return true;
+}
+
 int main()
 {
 	std::mt19937 rnd;
@@ -47,5 +108,8 @@ int main()
 	if (memcmp(buffer.data(), decode_buffer.data(), decode_buffer.size() * sizeof(uint32_t)))
 		return EXIT_FAILURE;
 
+	if (!fuzz_decode_equivalence())
+		return EXIT_FAILURE;
+
 	return EXIT_SUCCESS;
 }
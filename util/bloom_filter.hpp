@@ -0,0 +1,133 @@
+/* Copyright (c) 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <vector>
+#include <stdint.h>
+#include <stddef.h>
+
+namespace Fossilize
+{
+// Split block Bloom filter, keyed on 64-bit hashes.
+// Every key maps to a single 256-bit block and sets one bit in each of its eight 32-bit words,
+// so a lookup costs one cache line no matter how many keys there are.
+// With 16 bits per key, roughly 0.1% of absent keys are falsely reported as present.
+// Blocks are plain data, so a filter can be placed in shared memory and queried in place.
+struct BloomFilterBlock
+{
+	uint32_t words[8];
+};
+
+class BloomFilter
+{
+public:
+	enum { BitsPerKey = 16 };
+
+	static size_t compute_block_count(size_t key_count)
+	{
+		return (key_count * BitsPerKey + 255) / 256;
+	}
+
+	static void insert(BloomFilterBlock *blocks, size_t block_count, uint64_t key)
+	{
+		if (!block_count)
+			return;
+
+		key = mix(key);
+		auto &block = blocks[block_index(key, block_count)];
+		for (unsigned i = 0; i < 8; i++)
+			block.words[i] |= bit_mask(uint32_t(key), i);
+	}
+
+	static bool may_contain(const BloomFilterBlock *blocks, size_t block_count, uint64_t key)
+	{
+		if (!block_count)
+			return false;
+
+		key = mix(key);
+		auto &block = blocks[block_index(key, block_count)];
+		for (unsigned i = 0; i < 8; i++)
+		{
+			uint32_t mask = bit_mask(uint32_t(key), i);
+			if ((block.words[i] & mask) != mask)
+				return false;
+		}
+		return true;
+	}
+
+	// Clears the filter and sizes it for key_count keys.
+	void reset(size_t key_count)
+	{
+		blocks.assign(compute_block_count(key_count), BloomFilterBlock{});
+	}
+
+	void insert(uint64_t key)
+	{
+		insert(blocks.data(), blocks.size(), key);
+	}
+
+	bool may_contain(uint64_t key) const
+	{
+		return may_contain(blocks.data(), blocks.size(), key);
+	}
+
+	const BloomFilterBlock *data() const
+	{
+		return blocks.data();
+	}
+
+	size_t size() const
+	{
+		return blocks.size();
+	}
+
+private:
+	std::vector<BloomFilterBlock> blocks;
+
+	// Keys are not always well distributed, e.g. the tag is folded into them by callers.
+	static uint64_t mix(uint64_t key)
+	{
+		key ^= key >> 33;
+		key *= 0xff51afd7ed558ccdull;
+		key ^= key >> 33;
+		key *= 0xc4ceb9fe1a85ec53ull;
+		key ^= key >> 33;
+		return key;
+	}
+
+	static size_t block_index(uint64_t key, size_t block_count)
+	{
+		// Maps the upper half of the key onto [0, block_count) without a division.
+		return size_t(((key >> 32) * uint64_t(block_count)) >> 32);
+	}
+
+	static uint32_t bit_mask(uint32_t key, unsigned word)
+	{
+		static const uint32_t salts[8] = {
+			0x47b6137bu, 0x44974d91u, 0x8824ad5bu, 0xa2b7289du,
+			0x705495c7u, 0x2df1424bu, 0x9efc4947u, 0x5c6bfb31u,
+		};
+		return 1u << ((key * salts[word]) >> 27);
+	}
+};
+}
@@ -0,0 +1,118 @@
+/* Copyright (c) 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+// Target attributes and runtime feature checks for the vectorized paths in
+// crc32.cpp, base64.cpp and varint.cpp. Functions using a FOSSILIZE_TARGET_* attribute
+// must only be called after the matching cpu_supports_*() check succeeds.
+// Each of those also exposes its portable fallback and the name of the dispatched implementation,
+// so that tests and fossilize-bench can compare them.
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define FOSSILIZE_CPU_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define FOSSILIZE_TARGET_PCLMUL
+#define FOSSILIZE_TARGET_SSSE3
+#define FOSSILIZE_TARGET_AVX2
+#else
+#define FOSSILIZE_TARGET_PCLMUL __attribute__((target("sse2,pclmul")))
+#define FOSSILIZE_TARGET_SSSE3 __attribute__((target("ssse3")))
+#define FOSSILIZE_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#elif defined(__aarch64__) || defined(_M_ARM64)
+// NEON is mandatory on AArch64, so only the optional extensions need checking.
+#define FOSSILIZE_CPU_ARM64
+#if defined(__clang__)
+#define FOSSILIZE_TARGET_CRC __attribute__((target("crc")))
+#elif defined(__GNUC__)
+#define FOSSILIZE_TARGET_CRC __attribute__((target("+crc")))
+#endif
+#if defined(__linux__) && !defined(__ARM_FEATURE_CRC32)
+#include <sys/auxv.h>
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+#endif
+#endif
+
+namespace Fossilize
+{
+#ifdef FOSSILIZE_CPU_X86
+static inline bool cpu_supports_pclmul()
+{
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 1);
+	return (info[2] & (1 << 1)) != 0;
+#else
+	return __builtin_cpu_supports("pclmul");
+#endif
+}
+
+static inline bool cpu_supports_ssse3()
+{
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 1);
+	return (info[2] & (1 << 9)) != 0;
+#else
+	return __builtin_cpu_supports("ssse3");
+#endif
+}
+
+static inline bool cpu_supports_avx2()
+{
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 1);
+	// The OS must save YMM state as well.
+	bool osxsave = (info[2] & (1 << 27)) != 0;
+	bool avx = (info[2] & (1 << 28)) != 0;
+	if (!osxsave || !avx || (_xgetbv(0) & 6) != 6)
+		return false;
+	__cpuid(info, 0);
+	if (info[0] < 7)
+		return false;
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+#else
+	return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+#ifdef FOSSILIZE_CPU_ARM64
+static inline bool cpu_supports_arm_crc32()
+{
+#if defined(__ARM_FEATURE_CRC32) || defined(__APPLE__)
+	return true;
+#elif defined(__linux__)
+	return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+#else
+	return false;
+#endif
+}
+#endif
+}
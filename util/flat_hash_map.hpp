@@ -0,0 +1,197 @@
+/* Copyright (c) 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <memory>
+#include <utility>
+#include <stdint.h>
+#include <stddef.h>
+
+namespace Fossilize
+{
+// Open-addressing hash map with linear probing, keyed on 64-bit hashes.
+// Keys and values live in two flat arrays, so there is no allocation per entry,
+// and probing only touches the key array.
+// Key 0 marks empty slots, so a value for key 0 is stored on the side.
+// Entries cannot be erased individually.
+template <typename T>
+class FlatHashMap
+{
+public:
+	FlatHashMap() = default;
+	FlatHashMap(const FlatHashMap &) = delete;
+	void operator=(const FlatHashMap &) = delete;
+
+	T *find(uint64_t key)
+	{
+		return const_cast<T *>(static_cast<const FlatHashMap *>(this)->find(key));
+	}
+
+	const T *find(uint64_t key) const
+	{
+		if (key == 0)
+			return has_zero_key ? &zero_key_value : nullptr;
+
+		if (!capacity)
+			return nullptr;
+
+		size_t mask = capacity - 1;
+		for (size_t index = hash_index(key); ; index = (index + 1) & mask)
+		{
+			if (keys[index] == key)
+				return &values[index];
+			else if (keys[index] == 0)
+				return nullptr;
+		}
+	}
+
+	size_t count(uint64_t key) const
+	{
+		return find(key) ? 1 : 0;
+	}
+
+	// Like std::unordered_map::emplace, an existing value is not replaced.
+	// Returns true if the value was inserted.
+	bool emplace(uint64_t key, const T &value)
+	{
+		if (key == 0)
+		{
+			if (has_zero_key)
+				return false;
+			has_zero_key = true;
+			zero_key_value = value;
+			return true;
+		}
+
+		if (needs_grow(num_keys + 1))
+			rehash(capacity ? capacity * 2 : size_t(MinCapacity));
+
+		size_t mask = capacity - 1;
+		for (size_t index = hash_index(key); ; index = (index + 1) & mask)
+		{
+			if (keys[index] == key)
+				return false;
+			else if (keys[index] == 0)
+			{
+				keys[index] = key;
+				values[index] = value;
+				num_keys++;
+				return true;
+			}
+		}
+	}
+
+	void reserve(size_t count)
+	{
+		size_t new_capacity = capacity ? capacity : size_t(MinCapacity);
+		while (count * MaxLoadDenominator > new_capacity * MaxLoadNumerator)
+			new_capacity *= 2;
+
+		if (new_capacity > capacity)
+			rehash(new_capacity);
+	}
+
+	size_t size() const
+	{
+		return num_keys + (has_zero_key ? 1 : 0);
+	}
+
+	bool empty() const
+	{
+		return size() == 0;
+	}
+
+	void clear()
+	{
+		keys.reset();
+		values.reset();
+		capacity = 0;
+		num_keys = 0;
+		has_zero_key = false;
+	}
+
+	// Calls func(key, value) for every entry. Order is unspecified.
+	template <typename Func>
+	void for_each(Func &&func) const
+	{
+		if (has_zero_key)
+			func(uint64_t(0), zero_key_value);
+
+		for (size_t i = 0; i < capacity; i++)
+			if (keys[i] != 0)
+				func(keys[i], values[i]);
+	}
+
+	size_t get_allocated_size() const
+	{
+		return capacity * (sizeof(uint64_t) + sizeof(T));
+	}
+
+private:
+	enum { MinCapacity = 16, MaxLoadNumerator = 3, MaxLoadDenominator = 4 };
+
+	std::unique_ptr<uint64_t[]> keys;
+	std::unique_ptr<T[]> values;
+	size_t capacity = 0;
+	size_t num_keys = 0;
+	bool has_zero_key = false;
+	T zero_key_value = {};
+
+	size_t hash_index(uint64_t key) const
+	{
+		// Keys are usually good hashes already, but some users have sequential keys.
+		// Fibonacci hashing spreads those out so linear probing does not cluster.
+		key *= 0x9e3779b97f4a7c15ull;
+		return size_t(key ^ (key >> 32)) & (capacity - 1);
+	}
+
+	bool needs_grow(size_t count) const
+	{
+		return count * MaxLoadDenominator > capacity * MaxLoadNumerator;
+	}
+
+	void rehash(size_t new_capacity)
+	{
+		std::unique_ptr<uint64_t[]> old_keys = std::move(keys);
+		std::unique_ptr<T[]> old_values = std::move(values);
+		size_t old_capacity = capacity;
+
+		keys.reset(new uint64_t[new_capacity]());
+		values.reset(new T[new_capacity]);
+		capacity = new_capacity;
+
+		size_t mask = capacity - 1;
+		for (size_t i = 0; i < old_capacity; i++)
+		{
+			if (old_keys[i] == 0)
+				continue;
+
+			size_t index = hash_index(old_keys[i]);
+			while (keys[index] != 0)
+				index = (index + 1) & mask;
+			keys[index] = old_keys[i];
+			values[index] = std::move(old_values[i]);
+		}
+	}
+};
+}
@@ -21,6 +21,13 @@
  */
 
 #include "varint.hpp"
+#include <string.h>
+
+#include "util/cpu_features.hpp"
+
+#ifdef FOSSILIZE_CPU_X86
+#define FOSSILIZE_VARINT_X86
+#endif
 
 namespace Fossilize
 {
@@ -81,25 +88,185 @@ uint8_t *encode_varint(uint8_t *buffer, const uint32_t *words, size_t word_count
 	return buffer;
 }
 
-bool decode_varint(uint32_t *words, size_t words_size, const uint8_t *buffer, size_t buffer_size)
+static inline bool decode_varint_word(uint32_t &w, const uint8_t *buffer, size_t buffer_size, size_t &offset)
 {
-	size_t offset = 0;
-	for (size_t i = 0; i < words_size; i++)
+	w = 0;
+	uint32_t shift = 0;
+	do
 	{
-		auto &w = words[i];
-		w = 0;
+		if (offset >= buffer_size || shift >= 32u)
+			return false;
+
+		w |= uint32_t(buffer[offset] & 0x7f) << shift;
+		shift += 7;
+	} while (buffer[offset++] & 0x80);
+
+	return true;
+}
+
+// Vectorized paths decode as many words as they can starting at words[word_index] and buffer[offset],
+// and advance both. Anything they cannot handle, including malformed input, is left to decode_varint_word().
+using DecodeBlocksFunc = void (*)(uint32_t *, size_t, const uint8_t *, size_t, size_t &, size_t &);
 
-		uint32_t shift = 0;
-		do
+static bool decode_varint_blocks(DecodeBlocksFunc decode_blocks,
+                                 uint32_t *words, size_t words_size, const uint8_t *buffer, size_t buffer_size)
+{
+	size_t offset = 0;
+	size_t i = 0;
+	while (i < words_size)
+	{
+		if (decode_blocks)
 		{
-			if (offset >= buffer_size || shift >= 32u)
-				return false;
+			decode_blocks(words, words_size, buffer, buffer_size, i, offset);
+			if (i == words_size)
+				break;
+		}
 
-			w |= (buffer[offset] & 0x7f) << shift;
-			shift += 7;
-		} while (buffer[offset++] & 0x80);
+		if (!decode_varint_word(words[i], buffer, buffer_size, offset))
+			return false;
+		i++;
 	}
 
 	return buffer_size == offset;
 }
+
+bool decode_varint_portable(uint32_t *words, size_t words_size, const uint8_t *buffer, size_t buffer_size)
+{
+	return decode_varint_blocks(nullptr, words, words_size, buffer, buffer_size);
+}
+
+#ifdef FOSSILIZE_VARINT_X86
+// Shuffle table in the style of Masked VByte (Plaisance, Kurz and Lemire, "Vectorized VByte Decoding").
+// The continuation bits of the next 12 bytes select an entry, which gathers up to four complete words
+// of at most 4 bytes into the four 32-bit lanes. Five byte words end the block and go through the scalar path.
+struct ShuffleTable
+{
+	struct Entry
+	{
+		uint8_t shuffle[16];
+		uint8_t consumed;
+		uint8_t words;
+	};
+
+	ShuffleTable()
+	{
+		for (unsigned mask = 0; mask < 4096; mask++)
+		{
+			auto &entry = entries[mask];
+			memset(entry.shuffle, 0x80, sizeof(entry.shuffle));
+
+			unsigned pos = 0;
+			unsigned count = 0;
+			while (count < 4)
+			{
+				unsigned len = 0;
+				while (pos + len < 12 && (mask & (1u << (pos + len))) != 0)
+					len++;
+
+				// The word must end inside the 12 bytes, and fit in a lane.
+				if (pos + len >= 12 || len >= 4)
+					break;
+				len++;
+
+				for (unsigned k = 0; k < len; k++)
+					entry.shuffle[4 * count + k] = uint8_t(pos + k);
+				pos += len;
+				count++;
+			}
+
+			entry.consumed = uint8_t(pos);
+			entry.words = uint8_t(count);
+		}
+	}
+
+	Entry entries[4096];
+};
+
+static const ShuffleTable &get_shuffle_table()
+{
+	static const ShuffleTable table;
+	return table;
+}
+
+FOSSILIZE_TARGET_SSSE3
+static void decode_blocks_ssse3(uint32_t *words, size_t words_size, const uint8_t *buffer, size_t buffer_size,
+                                size_t &word_index, size_t &offset)
+{
+	auto &table = get_shuffle_table().entries;
+	const __m128i low7 = _mm_set1_epi32(0x7f);
+	size_t i = word_index;
+	size_t o = offset;
+
+	// Every iteration loads 16 bytes and stores 4 words, even if it consumes less.
+	while (words_size - i >= 4 && buffer_size - o >= 16)
+	{
+		__m128i in = _mm_loadu_si128(reinterpret_cast<const __m128i *>(buffer + o));
+		unsigned mask = unsigned(_mm_movemask_epi8(in));
+
+		// Runs of small words, e.g. IDs, are common enough to special case.
+		if (mask == 0 && words_size - i >= 16)
+		{
+			__m128i zero = _mm_setzero_si128();
+			__m128i lo = _mm_unpacklo_epi8(in, zero);
+			__m128i hi = _mm_unpackhi_epi8(in, zero);
+			_mm_storeu_si128(reinterpret_cast<__m128i *>(words + i + 0), _mm_unpacklo_epi16(lo, zero));
+			_mm_storeu_si128(reinterpret_cast<__m128i *>(words + i + 4), _mm_unpackhi_epi16(lo, zero));
+			_mm_storeu_si128(reinterpret_cast<__m128i *>(words + i + 8), _mm_unpacklo_epi16(hi, zero));
+			_mm_storeu_si128(reinterpret_cast<__m128i *>(words + i + 12), _mm_unpackhi_epi16(hi, zero));
+			i += 16;
+			o += 16;
+			continue;
+		}
+
+		auto &entry = table[mask & 0xfff];
+		if (!entry.words)
+			break;
+
+		__m128i v = _mm_shuffle_epi8(in, _mm_loadu_si128(reinterpret_cast<const __m128i *>(entry.shuffle)));
+		// Squeeze the 7-bit groups in each lane together.
+		__m128i w = _mm_and_si128(v, low7);
+		w = _mm_or_si128(w, _mm_and_si128(_mm_srli_epi32(v, 1), _mm_slli_epi32(low7, 7)));
+		w = _mm_or_si128(w, _mm_and_si128(_mm_srli_epi32(v, 2), _mm_slli_epi32(low7, 14)));
+		w = _mm_or_si128(w, _mm_and_si128(_mm_srli_epi32(v, 3), _mm_slli_epi32(low7, 21)));
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(words + i), w);
+
+		i += entry.words;
+		o += entry.consumed;
+	}
+
+	word_index = i;
+	offset = o;
+}
+#endif
+
+struct VarintImplementation
+{
+	DecodeBlocksFunc decode_blocks;
+	const char *name;
+};
+
+static VarintImplementation select_implementation()
+{
+#ifdef FOSSILIZE_VARINT_X86
+	if (cpu_supports_ssse3())
+		return { decode_blocks_ssse3, "ssse3" };
+#endif
+	return { nullptr, "scalar" };
+}
+
+static const VarintImplementation &get_implementation()
+{
+	static const VarintImplementation impl = select_implementation();
+	return impl;
+}
+
+bool decode_varint(uint32_t *words, size_t words_size, const uint8_t *buffer, size_t buffer_size)
+{
+	return decode_varint_blocks(get_implementation().decode_blocks, words, words_size, buffer, buffer_size);
+}
+
+const char *get_varint_implementation_name()
+{
+	return get_implementation().name;
+}
 }
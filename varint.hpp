@@ -28,5 +28,12 @@ namespace Fossilize
 {
 size_t compute_size_varint(const uint32_t *words, size_t word_count);
 uint8_t *encode_varint(uint8_t *buffer, const uint32_t *words, size_t word_count);
+
+// Returns true if buffer holds exactly words_size words. Dispatches at runtime to an SSSE3 decoder on x86.
+// If decoding fails, the contents of words are unspecified.
 bool decode_varint(uint32_t *words, size_t words_size, const uint8_t *buffer, size_t buffer_size);
+
+// Byte-at-a-time fallback and the name of the path decode_varint() picked.
+bool decode_varint_portable(uint32_t *words, size_t words_size, const uint8_t *buffer, size_t buffer_size);
+const char *get_varint_implementation_name();
 }